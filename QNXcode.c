@@ -6,27 +6,217 @@
  *  Author: Souroosh Memarian
  *////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#include <linux/aio_abi.h>
+#include <linux/sockios.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 
 #define LOG_FILE "system.log"
+#define LOG_BUFFER_SIZE 8192                                            // Per-thread log buffer flushed with a single write
+#define LOG_SEGMENT_MB 64                                               // Default size at which LOG_FILE is sealed and rotated
+#define CONFIG_FILE "qnxcode.conf"                                      // Runtime configuration, re-read on SIGHUP or "reload"
+#define STATS_SOCKET_PATH "qnxcode.sock"                                // UNIX socket accepting stats and control commands
+
+#define CLOCK_CALIBRATION_NS 20000000ULL                                // TSC calibration window (20 ms)
+#define CLOCK_SHIFT 32                                                  // Fixed-point fraction bits of the ticks-to-ns factor
+
+#define LOG_LEVEL_DEBUG 0                                               // Per-packet tracing
+#define LOG_LEVEL_INFO  1                                               // Lifecycle and metrics
+#define LOG_LEVEL_ERROR 2                                               // Failures only
 
 
 #define M 10
 #define N 20
 
+#define WRITER_MESSAGE_SIZE 1024                                        // Default upper bound of a generated message
+#define CORPUS_SIZE (8 << 20)                                           // Bytes of synthetic payload built at startup
+#define PAYLOAD_MODE_REFERENCE 0                                        // Writers hand out corpus slices by reference
+#define PAYLOAD_MODE_COPY 1                                             // Writers copy corpus slices into pooled chunks
+#define WRITER_CORRELATIONS 4096                                        // Distinct correlation ids writer sessions are drawn from
+#define PACKET_FLAG_BORROWED 0x1                                        // data points into shared read-only memory; never freed
+#define PACKET_FLAG_REQUEST 0x2                                         // Packet of the request topic
+#define PACKET_FLAG_RESPONSE 0x4                                        // Packet of the response topic
+#define PACKET_FLAG_COMPRESSED 0x8                                      // Wire payload is LZ-compressed with the shared dictionary
+#define CHUNK_SIZE 256                                                  // Payload bytes per pooled chunk
+#define CHUNK_SLAB 256                                                  // Chunks allocated together when the pool is empty
+#define CHUNK_CACHE 128                                                 // Chunks a thread keeps before returning half to the pool
+#define ARENA_BLOCK_SIZE 65536                                          // Bytes per reader scratch arena block
+#define ARENA_ALIGN 16                                                  // Alignment of every scratch allocation
+#define OUTPUT_IOV_MAX 1024                                             // iovec entries gathered before a writev
+#define FORWARD_GATHER_MAX 64                                           // Shorter pieces (prefixes, newlines) are gathered into one buffer
+#define FORWARD_HOLDS 64                                                // Flushed chunk chains a reader keeps until the kernel is done with them
+#define FORWARD_CLOSE_NS 1000000000ULL                                  // How long an exiting reader waits for its chains to be consumed
+#define FORWARD_PIPE_SIZE (1 << 20)                                     // Requested capacity of stdout and per-reader splice pipes
+#define FORWARD_POLL_NS 50000ULL                                        // Re-check interval while waiting for held chunks (50 us)
+#define FORWARD_OFF 0
+#define FORWARD_PIPE 1                                                  // stdout is a pipe: vmsplice straight into it
+#define FORWARD_SOCKET 2                                                // stdout is a socket: vmsplice to a private pipe, splice on
+#define FORWARD_FILE 3                                                  // stdout is a file: same, the file copies out of the pipe
+
+#define WIRE_MAGIC 0x5751                                               // "QW" in a little-endian dump
+#define WIRE_VERSION 3                                                  // 3: the checksum covers the whole header
+#define WIRE_ALIGN 8                                                    // Frames and payloads start on 8-byte boundaries
+#define WIRE_FRAME_SIZE(len) (sizeof(WireHeader) + (((size_t)(len) + WIRE_ALIGN - 1) & ~(size_t)(WIRE_ALIGN - 1)))
+
+#define DICT_MAGIC 0x54434451U                                          // "QDCT" in a little-endian dump
+#define DICT_SIZE 16384                                                 // Bytes of the shared compression dictionary
+#define DICT_SEGMENT 64                                                 // The dictionary is assembled from segments this long
+#define DICT_SAMPLE (1 << 20)                                           // Corpus bytes the dictionary is trained on
+#define LZ_HASH_BITS 12                                                 // Match finder hash table of 4096 positions
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535                                             // Offsets are 16 bits: dictionary plus earlier output
+#define LZ_MIN_INPUT 32                                                 // Shorter payloads are not worth compressing
+
+#define RECENT_CAPACITY 65536                                           // Packets kept by the recent-packet store (power of two)
+#define RECENT_BUCKETS 16384                                            // Correlation index buckets (power of two)
+#define RECENT_PREFIX 64                                                // Payload bytes kept per stored packet
+#define RECENT_QUERY_LIMIT 100                                          // Default number of packets a "recent" reply lists
+
+#define HITTER_DEPTH 4                                                  // Count-min sketch rows
+#define HITTER_WIDTH 1024                                               // Counters per row (power of two)
+#define HITTER_TOP 32                                                   // Space-Saving counters per top-K table (at most 127)
+#define HITTER_INDEX 64                                                 // Key index slots of a top-K table (power of two)
+#define HITTER_MERGE_NS 1000000000ULL                                   // Readers merge their sketches this often (1 s)
+#define HITTER_DECAY_NS 10000000000ULL                                  // Global counts are halved this often (10 s)
+
+#define JOIN_PARTITIONS 16                                              // Independently locked partitions of the join table
+#define JOIN_BUCKETS 1024                                               // Hash buckets per partition (power of two)
+#define JOIN_MAX_PENDING 4096                                           // Unmatched packets a partition buffers
+#define JOIN_WINDOW_NS 5000000000ULL                                    // Longest a packet waits for its counterpart (5 s)
+#define JOIN_EVICT_PERIOD_NS 100000000ULL                               // Eviction timer period (100 ms)
+#define JOIN_LATENCY_BUCKETS 32                                         // Power-of-two microsecond latency buckets
+
+#define EVENT_WINDOW_NS 1000000000ULL                                   // Event-time tumbling window length (1 s)
+#define EVENT_LATENESS_NS 2000000000ULL                                 // Allowed lateness after a window closes (2 s)
+#define EVENT_WINDOW_SLOTS 8                                            // Windows kept open or awaiting late data
+#define EVENT_BATCH_WINDOWS 4                                           // Distinct windows a reader batch accumulates
+#define EVENT_SOURCE_IDLE_NS 1000000000ULL                              // A writer silent this long stops holding the watermark
+
+#define SEGMENT_MAGIC 0x5A474553U                                       // "SEGZ" in a little-endian dump
+#define SEGMENT_VERSION 1
+#define SEGMENT_CHUNK (64 << 10)                                        // Log bytes per independently compressed chunk
+#define SEGMENT_SETTLE_NS 1000000000ULL                                 // A new segment is left alone this long for in-flight writes
+#define COMPACT_IDLE_NS 1000000000ULL                                   // Compactor rescan interval when there is nothing to do
+#define COMPACT_CPU_PERCENT 10                                          // Default CPU share of the background compactor
+#define COMPACT_IO_MB 16                                                // Default read plus write budget of the compactor (MB/s)
+
+#define CHECKPOINT_MAGIC 0x504B4351U                                    // "QCKP" in a little-endian dump
+#define CHECKPOINT_VERSION 2                                            // 2: the checksum covers the recent store
+#define CHECKPOINT_PERIOD_NS 10000000000ULL                             // Interval between state snapshots (10 s)
+#define CHECKPOINT_SECTIONS 5                                           // hitters, event time, join counters, join entries, recent store
+#define CHECKPOINT_RECENT_SLACK (MAX_READERS * BATCH_MAX)               // Store entries reserved but possibly unwritten at a snapshot
+
+#define COLUMN_BLOCK_MAGIC 0x4B4C4351U                                  // "QCLK" in a little-endian dump
+#define COLUMN_VERSION 1
+#define COLUMN_BATCH_ROWS 4096                                          // Rows per columnar block
+#define COLUMN_BLOB_SIZE (1 << 20)                                      // Payload bytes per block before it is written
+#define COLUMN_FLUSH_NS 1000000000ULL                                   // Longest a row waits in a reader's block (1 s)
+#define COLUMN_COUNT 6                                                  // event_id, correlation_id, timestamp_ns, size, payload_offset, payload
+#define COLUMN_TYPE_U64 1                                               // Unsigned integers, stored as 64-bit values
+#define COLUMN_TYPE_U32 2                                               // Unsigned integers below 2^32, stored as 64-bit values
+#define COLUMN_TYPE_BYTES 3                                             // Concatenated payloads, split by payload_offset and size
+#define COLUMN_ENC_PLAIN 0                                              // Little-endian 64-bit values, or raw bytes
+#define COLUMN_ENC_DELTA_VARINT 1                                       // Zigzag delta to the previous row as a LEB128 varint
+#define COLUMN_ENC_LZ_DICT 2                                            // Bytes LZ-compressed with the dictionary whose id is in min
+
+#define SHARD_BUFFER_SIZE (256 << 10)                                   // Frames a reader buffers before writing its shard
+#define DIRECT_ALIGN 4096                                               // O_DIRECT offset, length and buffer alignment
+#define DIRECT_POOL 16                                                  // Idle aligned shard buffers kept for reuse
+#define DIRECT_LATENCY_BUCKETS 32                                       // Power-of-two microsecond write latency buckets
+#define MERGE_BUFFER_SIZE (256 << 10)                                   // Read-ahead per shard while merging
+#define MERGE_IDLE_NS 1000000000ULL                                     // Live merge stops waiting for a shard silent this long
+#define MERGE_POLL_NS 10000000ULL                                       // Live merge re-check interval for new shard data (10 ms)
+
+#define QUEUE_FILE_MAGIC 0x52584E51U                                    // "QNXR" in a little-endian dump
+#define QUEUE_FILE_VERSION 4
+#define QUEUE_SLOT_PAYLOAD 1024                                         // Largest payload a file-backed slot holds
+#define QUEUE_WAKE_BATCH 8                                              // Packets published before an idle reader is woken
+#define QUEUE_WAKE_DELAY_NS 1000000ULL                                  // Longest a published packet waits for a wake-up (1 ms)
+#define PULSE_RING_SIZE 256                                             // Queued pulses (power of two)
+#define PULSE_CODES 64                                                  // Codes that coalesce instead of being dropped when the ring is full
+#define PULSE_BATCH 16                                                  // Pulses a reader handles before its next batch of packets
+#define PULSE_CODE_FLUSH 1                                              // Reader flushes its pending output now
+#define PULSE_CODE_USER 2                                               // SIGUSR1; value numbers the signals
+#define CHANNEL_SPIN 2000                                               // Polls before a channel waiter sleeps (multi-CPU only)
+#define CHANNEL_SENT 0                                                  // ChannelMsg states, the sender's futex word
+#define CHANNEL_RECEIVED 1
+#define CHANNEL_REPLIED 2
+#define WAITSET_MAX 64                                                  // Queues in one wait set (bits of the ready mask)
+#define QUEUE_IDLE_WAIT_MAX_NS 100000000ULL                             // Longest timed sleep of an idle reader (100 ms)
+#ifndef QUEUE_RING_RETRY_NS
+#define QUEUE_RING_RETRY_NS 1000000000ULL                               // Wait before retrying a ring file shrink that failed (1 s)
+#endif
+#ifndef QUEUE_FILE_SYNC
+#define QUEUE_FILE_SYNC 0                                               // 1: msync each slot before publishing it (survives power loss)
+#endif
+
+#define BATCH_MIN 1                                                     // Smallest batch the controller will choose
+#define BATCH_MAX 64                                                    // Largest batch the controller will choose
+#define BATCH_CLAIM(gen, end, next) ((unsigned long long) (gen) << 32 | (unsigned long long) (end) << 16 | (next))
+#define BATCH_CLAIM_GEN(c) ((unsigned int) ((c) >> 32))                 // Batch generation, bumped per batch
+#define BATCH_CLAIM_END(c) ((int) (((c) >> 16) & 0xffff))               // Packets in the batch
+#define BATCH_CLAIM_NEXT(c) ((int) ((c) & 0xffff))                      // Next unclaimed index; claims add 1
+#define BATCH_LATENCY_TARGET_NS 2000000ULL                              // Latency budget a batch may add (2 ms)
+#define BATCH_CONTROL_PERIOD_NS 10000000ULL                             // Controller re-evaluation period (10 ms)
+#define BATCH_METRICS_PERIOD_NS 5000000000ULL                           // Interval between metrics reports (5 s)
+
+#define MAX_READERS 64                                                  // Reader slots, including watchdog replacements
+#define WATCHDOG_PERIOD_NS 100000000ULL                                 // Watchdog scan interval (100 ms)
+#define READER_STALL_NS 2000000000ULL                                   // Time without progress before a reader is stalled (2 s)
+
+#define MAX_CONFIG_READERS 256                                          // Threads that can read the configuration concurrently
+#define CONTROL_TICK_MS 100                                             // Control thread poll interval
+
 
 /****Structures****/
+// Pooled payload chunk; a payload is a NULL-terminated chain of chunks
+typedef struct chunk {
+    struct chunk *next;                                                 // Next chunk of the payload (or of a free list)
+    int len;                                                            // Payload bytes used in data
+    char data[CHUNK_SIZE];
+} Chunk;
+
 // Data packet structure
 typedef struct {
     char *data;                                                         // Pointer to the data buffer
     int size;                                                           // Size of the data buffer in bytes
     unsigned long eventId;      
     unsigned long eventCorrelationId; 
+    unsigned long long timestamp;                                       // now_ns() when the writer produced the packet
+    Chunk *chain;                                                       // Chunked payload of size bytes when data is NULL
+    unsigned int flags;                                                 // PACKET_FLAG_* bits
+    unsigned int source;                                                // Index of the producing writer
 } DataPacket;
 
 // Queue node structure
@@ -35,28 +225,668 @@ typedef struct node {
     struct node *next;                                                  // Pointer to the next node in the queue
 } Node;
 
+// Binary frame header of a serialized DataPacket, followed by the payload padded to WIRE_ALIGN.
+// Fields are in host (little-endian) order so an aligned frame can be read in place.
+typedef struct {
+    unsigned short magic;                                               // WIRE_MAGIC
+    unsigned char version;                                              // WIRE_VERSION
+    unsigned char headerWords;                                          // Header length in 8-byte words (newer versions may grow it)
+    unsigned int flags;                                                 // PACKET_FLAG_* bits that travel with the packet
+    unsigned int length;                                                // Payload length in bytes
+    unsigned int checksum;                                              // CRC32C of every other header byte and the payload
+    unsigned long long eventId;
+    unsigned long long eventCorrelationId;
+    unsigned long long timestamp;
+    unsigned int source;                                                // Producing writer
+    unsigned int rawLength;                                             // Uncompressed payload length with PACKET_FLAG_COMPRESSED
+} WireHeader;
+
+// Header of a compressed log segment (<segment>.qz). Chunks follow, then the chunk index, then a SegmentTrailer.
+typedef struct {
+    unsigned int magic;                                                 // SEGMENT_MAGIC
+    unsigned int version;                                               // SEGMENT_VERSION
+    unsigned int chunkSize;                                             // Raw bytes per chunk; only the last one is shorter
+    unsigned int reserved;
+} SegmentHeader;
+
+// Index entry of one chunk of a compressed segment; chunk i holds raw bytes [i * chunkSize, ...)
+typedef struct {
+    unsigned long long fileOffset;                                      // Where the chunk starts in the .qz file
+    unsigned int packedBytes;                                           // Stored bytes; equal to rawBytes if stored uncompressed
+    unsigned int rawBytes;
+    unsigned int checksum;                                              // CRC32C of the raw bytes
+    unsigned int reserved;
+} SegmentChunk;
+
+// Last bytes of a compressed segment, locating the index
+typedef struct {
+    unsigned long long indexOffset;
+    unsigned long long rawBytes;                                        // Size of the original segment
+    unsigned int chunks;
+    unsigned int magic;                                                 // SEGMENT_MAGIC, written last
+} SegmentTrailer;
+
+// Log rotation and background compaction state
+typedef struct {
+    unsigned int sealed;                                                // Futex word bumped on every rotation
+    unsigned int nextSegment;                                           // Number of the next rotated segment
+    unsigned long long rotatedNs;                                       // Time of the last rotation
+    unsigned long compacted;                                            // Segments compressed
+    unsigned long rawBytes, packedBytes;                                // Totals over compressed segments
+    unsigned long long throttledNs;                                     // Time the compactor slept to stay in budget
+    unsigned long failures;
+} Compactor;
+
+// Shared compression dictionary: payload text that compressed payloads may reference as if it preceded them
+typedef struct {
+    int size;                                                           // Bytes used in data, 0 if no dictionary is loaded
+    unsigned int id;                                                    // CRC32C of data; seeds the checksum of compressed frames
+    unsigned short table[1 << LZ_HASH_BITS];                            // Newest dictionary position + 1 per 4-byte hash, 0 if none
+    char data[DICT_SIZE];
+} PayloadDictionary;
+
+// Header of a dictionary file, followed by size bytes of dictionary
+typedef struct {
+    unsigned int magic;                                                 // DICT_MAGIC
+    unsigned int size;
+    unsigned int id;                                                    // CRC32C of the dictionary bytes
+    unsigned int reserved;
+} DictFileHeader;
+
+// Header of a block of the columnar sink file. A file is a sequence of blocks; each is followed by COLUMN_COUNT
+// ColumnDesc entries and then the encoded columns in the same order.
+typedef struct {
+    unsigned int magic;                                                 // COLUMN_BLOCK_MAGIC
+    unsigned short version;                                             // COLUMN_VERSION
+    unsigned short columns;                                             // Number of ColumnDesc entries
+    unsigned int rows;                                                  // Rows in the block
+    unsigned int checksum;                                              // CRC32C of everything after this header
+    unsigned long long blockBytes;                                      // Size of the block including this header
+} ColumnBlockHeader;
+
+// Description of one column of a columnar block
+typedef struct {
+    char name[16];                                                      // NUL-padded column name
+    unsigned char type;                                                 // COLUMN_TYPE_*
+    unsigned char encoding;                                             // COLUMN_ENC_*
+    unsigned short reserved;
+    unsigned int bytes;                                                 // Encoded bytes of the column
+    unsigned long long min, max;                                        // Value range of integer columns; for LZ bytes the
+                                                                        // dictionary id and the uncompressed length
+} ColumnDesc;
+
+// Header of a file-backed queue ring, at offset 0 of the file
+typedef struct {
+    unsigned int magic;                                                 // QUEUE_FILE_MAGIC once the file is initialized
+    unsigned int version;                                               // QUEUE_FILE_VERSION
+    unsigned int capacity;                                              // Number of slots following the header
+    unsigned int slotSize;                                              // Bytes per slot
+    unsigned long long head;                                            // Next slot to consume (monotonic, slot = head % capacity)
+    unsigned long long tail;                                            // Next slot to fill (monotonic)
+    char pad[32];                                                       // Slots start on a cache line boundary
+} RingFileHeader;
+
+// Slot of a file-backed queue ring: one wire frame with room for QUEUE_SLOT_PAYLOAD bytes
+typedef struct {
+    WireHeader hdr;
+    char data[QUEUE_SLOT_PAYLOAD];                                      // Payload slab
+} RingSlot;
+
 // Queue structure
 typedef struct {
     Node *head, *tail;                                                  // Pointers to the head and tail of the queue
     int count;                                                          // Number of elements in the queue
-    sem_t full, empty;                                                  // Semaphores to manage full and empty states of the queue
+    int debt;                                                           // 'empty' posts to withhold for packets requeued over capacity
+    sem_t empty;                                                        // Semaphore to manage the full state of the queue
+    int ready;                                                          // Published packets not yet claimed by a reader
+    unsigned int wakeSeq;                                               // Futex word idle readers sleep on
+    int idle;                                                           // Readers sleeping (or about to) on wakeSeq
+    int sinceWake;                                                      // Packets published since the last wake-up
+    unsigned long long lastWakeNs;                                      // Time of the last wake-up
+    unsigned long wakeups;                                              // Wake-ups issued by producers
+    unsigned long published;                                            // Packets published
+    unsigned long long lastEventId;                                     // eventId of the newest enqueued packet (queue lock)
     pthread_mutex_t lock;                                               // Mutex for ensuring thread-safe access to the queue
+    RingFileHeader *ring;                                               // Memory-mapped ring file, or NULL for an in-memory queue
+    RingSlot *slots;                                                    // Slot array following the ring header
+    size_t ringBytes;                                                   // Size of the mapping
+    struct pulseRing *pulses;                                           // Pulses delivered ahead of packets, or NULL
+    struct waitSet *waitSet;                                            // Wait set notified on publish, or NULL
+    int capacity;                                                       // Slots writers may reserve, changed by queue_resize
+    const char *ringPath;                                               // Ring file, replaced when the ring is resized
+    unsigned long long ringRetryNs;                                     // Earliest retry of a failed shrink (control thread)
 } Queue;
 
+// Pulse: a tiny control notification, delivered without allocation
+typedef struct {
+    unsigned int code;                                                  // PULSE_CODE_*
+    unsigned int value;
+} Pulse;
+
+// Slot of a pulse ring
+typedef struct {
+    unsigned long long seq;                                             // Position the slot is free for, or that plus 1 once filled
+    unsigned long long pulse;                                           // code << 32 | value
+} PulseSlot;
+
+// Bounded lock-free pulse ring of a queue, filled from any thread or signal handler
+typedef struct pulseRing {
+    PulseSlot slots[PULSE_RING_SIZE];
+    unsigned long long head __attribute__((aligned(64)));               // Next position to receive
+    unsigned long long tail __attribute__((aligned(64)));               // Next position to send
+    unsigned long long coalescedMask;                                   // Codes with a value waiting in coalesced
+    unsigned int coalesced[PULSE_CODES];                                // Latest value of each code sent while full
+    unsigned long sent, delivered, merged, dropped;
+    Queue *queue;                                                       // Queue whose idle readers are woken
+} PulseRing;
+
+// Message of a sender blocked in channel_send; lives on the sender's stack until the reply
+typedef struct channelMsg {
+    struct channelMsg *next;                                            // Next sender waiting on the channel
+    const void *send;                                                   // Message, read in place by the receiver
+    int sendBytes;
+    void *reply;                                                        // Reply buffer, written in place by the replier
+    int replyBytes;
+    int status;                                                         // Value channel_send returns
+    int nice;                                                           // Sender's nice value, lent to the receiver
+    int receiverTid, receiverNice;                                      // Receiver whose nice value to restore on reply
+    unsigned int state;                                                 // CHANNEL_*; futex word the sender sleeps on
+} ChannelMsg;
+
+// Synchronous send-receive-reply channel (QNX MsgSend/MsgReceive/MsgReply)
+typedef struct {
+    pthread_mutex_t lock;                                               // Protects the sender FIFO
+    ChannelMsg *head, *tail;                                            // Senders not yet received, oldest first
+    unsigned int seq;                                                   // Futex word receivers sleep on, bumped per send
+    int receivers;                                                      // Receivers asleep (or about to be)
+    int spin;                                                           // Polls before sleeping, 0 on a single CPU
+} Channel;
+
+// Set of queues a thread can block on together (select over queues)
+typedef struct waitSet {
+    unsigned int seq;                                                   // Eventcount: futex word, bumped by producers
+    int waiters;                                                        // Threads asleep (or about to be) on seq
+    int count;                                                          // Queues in the set
+    Queue *queues[WAITSET_MAX];
+    unsigned long waits, wakeups;                                       // Sleeps taken, wake-ups issued by producers
+} WaitSet;
+
+// Clock source used by now_ns, set up once by clock_init
+typedef struct {
+    int useTsc;                                                         // Nonzero once the TSC is calibrated and invariant
+    unsigned long long tscBase;                                         // TSC reading at calibration
+    unsigned long long nsBase;                                          // CLOCK_MONOTONIC at tscBase
+    unsigned long long mult;                                            // Nanoseconds per tick, fixed point with CLOCK_SHIFT bits
+    double ticksPerNs;                                                  // Calibrated TSC frequency in GHz, for reporting
+} ClockSource;
+
+// Per-thread log buffer
+typedef struct {
+    char buf[LOG_BUFFER_SIZE];                                          // Pending log lines
+    int len;                                                            // Bytes used in buf
+    int count;                                                          // Messages in buf
+    unsigned long long firstNs;                                         // Time the oldest pending message was logged
+} LogBuffer;
+
+// Adaptive batch size controller
+typedef struct {
+    const char *name;                                                   // Name reported in metrics
+    pthread_mutex_t lock;                                               // Protects the estimator state below
+    int batchSize;                                                      // Current decision, read lock-free by the hot path
+    int maxSize;                                                        // Upper bound set by the runtime configuration
+    int pendingItems;                                                   // Items observed since the last re-evaluation
+    unsigned long long lastEvalNs;                                      // Time of the last re-evaluation
+    double arrivalRate;                                                 // EWMA of observed items per second
+    double latencyNs;                                                   // EWMA of observed batch latency
+    unsigned long grows, shrinks;                                       // Decision counters exposed in metrics
+} BatchController;
+
+// Block of a bump-pointer arena
+typedef struct arenaBlock {
+    struct arenaBlock *next;                                            // Next block of the chain
+    size_t size;                                                        // Usable bytes in data
+    size_t used;                                                        // Bytes handed out since the last reset
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+} ArenaBlock;
+
+// Bump-pointer arena for per-batch scratch memory
+typedef struct {
+    ArenaBlock *first;                                                  // Blocks kept across resets
+    ArenaBlock *current;                                                // Block allocations are served from
+    unsigned long overflows;                                            // Blocks chained because a batch outgrew the arena
+} Arena;
+
+// Per-reader state shared with the watchdog
+typedef struct {
+    pthread_t thread;                                                   // Thread running this reader
+    int index;                                                          // Slot index in readerStates
+    int stalled;                                                        // Set by the watchdog once the reader is given up on
+    unsigned long long heartbeatNs;                                     // Last time the reader made progress
+    int busy;                                                           // Nonzero while the reader owns a batch
+    unsigned long long batchClaim;                                      // BATCH_CLAIM word: generation, end and next unclaimed index
+    unsigned long long eventHoldNs;                                     // Set before a pop, 0 once its window counts are added
+    int parkRequested;                                                  // Set by the configuration to take the reader out of service
+    int parked;                                                         // Nonzero while the reader sleeps on park
+    sem_t park;                                                         // Parked readers wait here until resumed
+    Arena arena;                                                        // Scratch memory, reset after every batch
+    DataPacket batch[BATCH_MAX];                                        // Packets of the batch being processed
+} ReaderState;
+
+// Payload corpus synthetic writers slice from
+typedef struct {
+    const char *base;                                                   // Corpus bytes (read-only once built)
+    size_t size;                                                        // Corpus length
+    int mapped;                                                         // Nonzero if base is a file mapping
+} Corpus;
+
+// Zero-copy forwarding of gathered output to stdout (-F)
+typedef struct {
+    int mode;                                                           // FORWARD_*
+    int failed;                                                         // Splicing failed once; output went back to writev
+    pthread_mutex_t lock;                                               // One reader splices at a time, so positions are exact
+    unsigned long long written;                                         // Bytes spliced to stdout so far
+    unsigned long bytes, calls, copied;                                 // Totals for the stats command
+    int heldChains;
+} ForwardSink;
+
+// Chunk chain spliced to stdout, kept until the kernel no longer reads its pages
+typedef struct {
+    Chunk *chain;
+    char *gather;                                                       // Prefixes and newlines spliced with it
+    unsigned long long end;                                             // stdout position after the chain's last byte
+} ForwardHold;
+
+// Reader-side gather list of chunked payloads waiting for one writev
+typedef struct {
+    struct iovec iov[OUTPUT_IOV_MAX];                                   // Prefix, chunks and newline of each packet
+    int iovCount;
+    Chunk *release;                                                     // Chains to return to the pool once written
+    char prefix[48];                                                    // "thread <id> - " of the owning reader
+    int prefixLen;
+    ForwardSink *sink;                                                  // forwardSink, or a bench's own
+    int fd;                                                             // stdout, or a bench's pipe
+    int pipe[2];                                                        // Private splice pipe (-F to a file or socket), or -1
+    char *gather;                                                       // Short pieces of the pending flush, copied for splicing
+    ForwardHold held[FORWARD_HOLDS];                                    // Ring of chains still referenced by the kernel
+    int heldHead, heldCount;
+    int spliced;                                                        // The pending flush spliced user pages
+} OutputVec;
+
+// Entry of the recent-packet store, guarded by its own version (seqlock)
+typedef struct {
+    unsigned long long version;                                         // 2*seq+1 while being written, 2*seq+2 once complete
+    unsigned long long prevSame;                                        // seq+1 of the previous entry in the same index bucket, 0 for none
+    unsigned long long storedNs;                                        // Reservation time of its batch; non-decreasing along seq
+    unsigned long long linkedNs;                                        // When linked into its bucket; non-increasing along prevSame
+    unsigned long long eventId;
+    unsigned long long correlationId;
+    unsigned long long timestamp;
+    int size;                                                           // Full payload size
+    unsigned short len;                                                 // Bytes of payload shown by queries
+    unsigned char isBorrowed;                                           // Payload is referenced through borrowed
+    union {
+        const char *borrowed;                                           // Start of a borrowed payload, which outlives the entry
+        char prefix[RECENT_PREFIX];                                     // Copied start of an owned payload
+    };
+} __attribute__((aligned(64))) RecentEntry;
+
+// Bounded store of the most recent packets with a correlation index and a time index
+typedef struct {
+    unsigned long long next;                                            // Sequence number of the next entry
+    unsigned long long buckets[RECENT_BUCKETS];                         // seq+1 of the newest entry per correlation hash
+    RecentEntry entries[RECENT_CAPACITY];                               // Ring indexed by seq % RECENT_CAPACITY
+} RecentStore;
+
+// Space-Saving counter of a top-K table
+typedef struct {
+    unsigned long long key;                                             // Correlation id
+    unsigned long long count;                                           // Estimated weight (never below the true weight)
+    unsigned long long error;                                           // Largest possible overestimate of count
+    int slot;                                                           // Index slot pointing at this counter
+} HitterCounter;
+
+// Space-Saving top-K table: a min-heap of counters with a linear-probing index by key
+typedef struct {
+    int size;                                                           // Counters in use
+    HitterCounter heap[HITTER_TOP];                                     // Min-heap on count
+    signed char index[HITTER_INDEX];                                    // Heap position + 1, 0 for an empty slot
+} SpaceSaving;
+
+// Heavy-hitter sketch over correlation ids: count-min sketches for estimates, Space-Saving for candidates
+typedef struct {
+    unsigned long long packets[HITTER_DEPTH][HITTER_WIDTH];             // Count-min sketch of packets per id
+    unsigned long long bytes[HITTER_DEPTH][HITTER_WIDTH];               // Count-min sketch of payload bytes per id
+    SpaceSaving topPackets;                                             // Candidates by packets
+    SpaceSaving topBytes;                                               // Candidates by bytes
+    unsigned long long totalPackets, totalBytes;
+    unsigned long long stampNs;                                         // Last merge (reader) or decay (global)
+} HitterSketch;
+
+// Unmatched packet buffered by the request/response join
+typedef struct joinEntry {
+    struct joinEntry *next;                                             // Next entry of the hash bucket
+    struct joinEntry *older, *newer;                                    // Arrival order within the partition
+    unsigned long long correlationId;
+    unsigned long long eventId;
+    unsigned long long timestamp;                                       // Producer timestamp of the packet
+    int response;                                                       // Nonzero for the response side
+} JoinEntry;
+
+// Partition of the join table; a correlation id always maps to the same partition
+typedef struct {
+    pthread_mutex_t lock;
+    JoinEntry *buckets[JOIN_BUCKETS];
+    JoinEntry *oldest, *newest;                                         // Arrival list, evicted from the oldest end
+    JoinEntry *spare;                                                   // Recycled entries
+    int pending;                                                        // Entries in the table
+    unsigned long matched;                                              // Pairs joined
+    unsigned long evicted[2];                                           // Requests and responses that expired unmatched
+    unsigned long latency[JOIN_LATENCY_BUCKETS];                        // Response latency histogram, bucket b < 2^b us
+} __attribute__((aligned(64))) JoinPartition;
+
+// Event-time tumbling window
+typedef struct {
+    unsigned long packets;                                              // Packets with a timestamp in the window
+    unsigned long bytes;
+    unsigned long late;                                                 // Of those, packets that arrived after the window closed
+} EventWindow;
+
+// Event-time windowing state: per-writer watermarks and the ring of windows
+typedef struct {
+    pthread_mutex_t lock;                                               // Held while windows are closed and purged
+    unsigned long long pendingLow;                                      // Watermark waiting for the readers' in-flight packets
+    unsigned long long pendingNs;                                       // When it was seen, 0 for none (not in snapshots)
+    unsigned long long sourceWatermark[N];                              // Newest timestamp seen from each writer
+    unsigned long long sourceAdvancedNs[N];                             // When each writer's watermark last moved
+    unsigned long long lowWatermark;                                    // Minimum over the active writers, once safe
+    unsigned long long closedUpTo;                                      // First window (timestamp / EVENT_WINDOW_NS) still open
+    unsigned long long purgedUpTo;                                      // First window still accepting late data
+    unsigned long lateDropped;                                          // Side output: packets beyond the allowed lateness
+    unsigned long earlyDropped;                                         // Side output: packets too far ahead of the watermark
+    EventWindow windows[EVENT_WINDOW_SLOTS];                            // Window w lives in slot w % EVENT_WINDOW_SLOTS
+    EventWindow lastClosed;                                             // Most recent on-time result, for "windows"
+    unsigned long long lastClosedWindow;
+} EventTime;
+
+// Reader-side window counts and writer watermarks of one batch
+typedef struct {
+    int used;                                                           // Windows in use below
+    unsigned long long window[EVENT_BATCH_WINDOWS];
+    unsigned long packets[EVENT_BATCH_WINDOWS];
+    unsigned long bytes[EVENT_BATCH_WINDOWS];
+    unsigned long long sourceMax[N];                                    // Newest timestamp per writer in the batch
+    unsigned long long *holdNs;                                         // Reader's eventHoldNs, cleared once counts are added
+} EventBatch;
+
+// Header of a state snapshot file, at offset 0; the sections follow at page-aligned offsets
+typedef struct {
+    unsigned int magic;                                                 // CHECKPOINT_MAGIC
+    unsigned int version;                                               // CHECKPOINT_VERSION
+    unsigned long long generation;                                      // Increases with every snapshot, across both files
+    unsigned int complete;                                              // 1 once every section is on disk
+    unsigned int checksum;                                              // CRC32C of every section, the recent store as on disk
+    unsigned long long takenNs;                                         // now_ns() at the snapshot
+    unsigned long long recentNext;                                      // recentStore.next at the snapshot
+    unsigned long long joinEntries;                                     // JoinRecord entries in the join section
+    unsigned long long offset[CHECKPOINT_SECTIONS];                     // File offset of each section
+    unsigned long long size[CHECKPOINT_SECTIONS];                       // Capacity of each section
+} CheckpointHeader;
+
+// Counters of a join partition as stored in a snapshot
+typedef struct {
+    unsigned long matched;
+    unsigned long evicted[2];
+    unsigned long latency[JOIN_LATENCY_BUCKETS];
+} JoinCounters;
+
+// Buffered join entry as stored in a snapshot, in arrival order
+typedef struct {
+    unsigned long long correlationId;
+    unsigned long long eventId;
+    unsigned long long timestamp;
+    unsigned long long response;
+} JoinRecord;
+
+// Snapshot scheduling state, owned by the control thread
+typedef struct {
+    const char *path;                                                   // Snapshot files are <path>.0 and <path>.1
+    pid_t child;                                                        // Process writing a snapshot, 0 if none
+    int target;                                                         // File the child writes
+    unsigned long long generation;                                      // Generation of the newest complete snapshot
+    unsigned long long fileSeq[2];                                      // recentStore.next each file is current up to, 0 if unknown
+    unsigned long long pendingSeq;                                      // recentStore.next at the running snapshot
+    unsigned long long startedNs;                                       // Start of the running or last snapshot
+    unsigned long taken, failed;
+    unsigned long long lastDurationNs;                                  // Fork to completion of the last snapshot
+    unsigned long long lastPauseNs;                                     // Time stage locks were held for the fork
+} Checkpointer;
+
+// Reader-owned output shard: a file of wire frames in the order the reader processed them
+typedef struct {
+    int fd;                                                             // <dir>/shard.<reader index>
+    int direct;                                                         // Nonzero while fd is written with O_DIRECT (-D)
+    size_t len;                                                         // Bytes buffered in buf
+    size_t carried;                                                     // Leading bytes of buf already on disk (partial block)
+    char *buf;                                                          // SHARD_BUFFER_SIZE bytes, DIRECT_ALIGN-aligned
+    char *spare;                                                        // Second buffer, in flight or free (direct only)
+    unsigned long long fileOffset;                                      // File offset of buf[0] (direct only, block-aligned)
+    aio_context_t aio;                                                  // Kernel AIO context, 0 to write synchronously
+    struct iocb iocb;                                                   // The write in flight, if any
+    int inflight;
+    unsigned long long submitNs;                                        // When the write in flight was submitted
+} ShardWriter;
+
+// One input of the k-way merge
+typedef struct {
+    int fd;
+    char *buf;                                                          // MERGE_BUFFER_SIZE bytes, WIRE_ALIGN-aligned
+    size_t start, end;                                                  // Unconsumed bytes are buf[start, end)
+    unsigned long long key;                                             // Sort key of the frame at buf + start
+    long frame;                                                         // Size of that frame, 0 if none is buffered
+    unsigned long long idleSinceNs;                                     // When the shard last ran dry (live mode)
+    unsigned long long offset;                                          // File offset of buf + end
+    int done;                                                           // No more frames will be read
+} MergeInput;
+
+// Reader-side block of rows waiting to be written to the columnar sink
+typedef struct {
+    int rows;                                                           // Rows collected so far
+    unsigned long long firstNs;                                         // Time the first row was added
+    unsigned long long values[COLUMN_COUNT - 1][COLUMN_BATCH_ROWS];     // Integer columns, in ColumnDesc order
+    char *blob;                                                         // Payload column
+    size_t blobLen, blobCap;
+    unsigned char *encoded;                                             // Encoding buffer reused across blocks
+    size_t encodedCap;
+} ColumnBatch;
+
+// Runtime configuration, immutable once published
+typedef struct {
+    int logLevel;                                                       // Lowest LOG_LEVEL_* written to LOG_FILE
+    long rateLimit;                                                     // Packets per second across all writers, 0 for unlimited
+    int enqueueBatchMax;                                                // Upper bounds for the batch size controllers
+    int dequeueBatchMax;
+    int logBatchMax;
+    int outputBatchMax;
+    int readers;                                                        // Number of readers kept in service
+    int messageSize;                                                    // Upper bound of a generated message in bytes
+    int payloadMode;                                                    // PAYLOAD_MODE_*
+    long logSegmentBytes;                                               // LOG_FILE size that triggers rotation, 0 to never rotate
+    int compactCpuPercent;                                              // CPU share the background compactor may use
+    int compactIoMb;                                                    // Read plus write bandwidth of the compactor (MB/s)
+    int queueCapacity;                                                  // Capacity of dataQueue, 0 to keep the current one
+} Config;
+
+// Per-thread read-side marker for configuration grace periods
+typedef struct {
+    unsigned long active;                                               // Number of read-side sections in progress
+    unsigned long seq;                                                  // Completed read-side sections
+    char pad[64 - 2 * sizeof(unsigned long)];                           // Keep slots on separate cache lines
+} ConfigReaderSlot;
+
+// Stats socket command
+typedef struct {
+    const char *name;                                                   // Command word
+    const char *help;                                                   // One-line description for "help"
+    void (*handler)(const char *args, FILE *out);                       // Writes the reply to out
+} StatsCommand;
+
 Queue dataQueue; // Shared queue
+PulseRing pulseRing;                                                    // Control pulses for dataQueue's readers
+Corpus payloadCorpus;                                                   // Built or mapped by corpus_init before writers start
+const char *corpusFilePath = NULL;                                      // Corpus file to map (-c), NULL to synthesize one
+PayloadDictionary payloadDict;                                          // Loaded or trained by payload_dict_open (-z)
+unsigned long compressRawBytes = 0, compressPackedBytes = 0;            // Ring file payload bytes before and after compression
+ClockSource clockSource;                                                // Written by clock_init before threads start
+const char *queueFilePath = NULL;                                       // Backing file for dataQueue (-f), NULL for in-memory
+RecentStore recentStore;                                                // Packets seen by readers, queryable with "recent"
+HitterSketch hitterGlobal;                                              // Merged reader sketches, read by "top"
+pthread_mutex_t hitterLock = PTHREAD_MUTEX_INITIALIZER;                 // Protects hitterGlobal
+JoinPartition joinPartitions[JOIN_PARTITIONS];                          // Request/response join state
+EventTime eventTime = { PTHREAD_MUTEX_INITIALIZER };                    // Event-time windows, see event_batch_flush
+Checkpointer checkpointer;                                              // Enabled by -s
+const char *shardDir = NULL;                                            // Per-reader shard directory (-o), replaces text output
+unsigned long shardFrames = 0, shardBytes = 0;                          // Shard sink totals, for the stats command
+int shardDirect = 0;                                                    // Write shards with O_DIRECT (-D)
+unsigned long directLatency[DIRECT_LATENCY_BUCKETS];                    // O_DIRECT write latency histogram (submit to completion)
+unsigned long directWrites = 0, directFallbacks = 0;
+unsigned long long directStallNs = 0;                                   // Time readers waited for the previous write
+char *directPool[DIRECT_POOL];                                          // Idle shard buffers, under directPoolLock
+int directPoolCount = 0;
+pthread_mutex_t directPoolLock = PTHREAD_MUTEX_INITIALIZER;
+ForwardSink forwardSink = { FORWARD_OFF, 0, PTHREAD_MUTEX_INITIALIZER }; // Enabled by -F
+int columnFd = -1;                                                      // Columnar sink file (-a), replaces text output when open
+unsigned long columnBlocks = 0, columnRows = 0;                         // Columnar sink totals, for the stats command
+unsigned long columnRawBytes = 0, columnFileBytes = 0;
+unsigned long long columnFileEnd = 0;                                   // Next free offset of the sink; readers reserve from it
+
+ReaderState readerStates[MAX_READERS];                                  // Reader slots, used in order
+int readerCount = 0;                                                    // Slots handed out so far
+unsigned long readerStalls = 0;                                         // Stalls detected by the watchdog
+unsigned long packetsProcessed = 0;                                     // Packets handed to process_data, for the bench report
+
+Config defaultConfig = { LOG_LEVEL_DEBUG, 0, BATCH_MAX, BATCH_MAX, BATCH_MAX, BATCH_MAX, M, WRITER_MESSAGE_SIZE,
+                          PAYLOAD_MODE_REFERENCE, (long) LOG_SEGMENT_MB << 20, COMPACT_CPU_PERCENT, COMPACT_IO_MB, 0 };
+Config *activeConfig = &defaultConfig;                                  // Swapped atomically on reload
+Compactor compactor;                                                    // Log rotation (control thread) and compaction state
+pthread_mutex_t controlLock = PTHREAD_MUTEX_INITIALIZER;                // Serializes stats commands with the control thread's work
+ConfigReaderSlot configReaders[MAX_CONFIG_READERS];                     // Read-side markers, one per thread
+int configReaderCount = 0;                                              // Slots handed out so far
+
+BatchController enqueueBatch = { "enqueue", PTHREAD_MUTEX_INITIALIZER, BATCH_MIN, BATCH_MAX };
+BatchController dequeueBatch = { "dequeue", PTHREAD_MUTEX_INITIALIZER, BATCH_MIN, BATCH_MAX };
+BatchController logBatch     = { "log",     PTHREAD_MUTEX_INITIALIZER, BATCH_MIN, BATCH_MAX };
+BatchController outputBatch  = { "output",  PTHREAD_MUTEX_INITIALIZER, BATCH_MIN, BATCH_MAX };
 
 /****************
 
 /****Prototypes of Functions for QNXcode****/
 
+void clock_init(void);
+unsigned long long now_ns(void);
+int batch_controller_size(BatchController *c);
+void batch_controller_observe(BatchController *c, int items, unsigned long long latencyNs);
+void batch_metrics_report(void);
+void batch_controller_set_max(BatchController *c, int maxSize);
 void log_message(const char *message);
+void log_message_level(int level, const char *message);
+void log_flush(void);
+void log_rotate_poll(unsigned long long nowNs);
+void log_segments_init(void);
+long log_segment_read(const char *path, unsigned long long offset, char *buf, size_t len);
+void *compactor_thread(void *arg);
+const Config *config_read_begin(void);
+void config_read_end(void);
+int config_load(const char *path, Config *cfg);
+void config_publish(Config *cfg);
+void config_reload(void);
+void apply_reader_count(int target);
+long futex_wait(unsigned int *word, unsigned int expected, unsigned long long timeoutNs);
+long futex_wake(unsigned int *word, int count);
+void pulse_ring_init(PulseRing *ring, Queue *q);
+int pulse_send(PulseRing *ring, unsigned int code, unsigned int value);
+int pulse_receive(PulseRing *ring, Pulse *pulse);
+int pulse_pending(PulseRing *ring);
+void pulse_handle(const Pulse *pulse);
+void channel_init(Channel *ch);
+int channel_send(Channel *ch, const void *msg, int bytes, void *reply, int replyBytes);
+int channel_receive(Channel *ch, void *msg, int bytes, ChannelMsg **rcvid);
+void channel_reply(ChannelMsg *rcvid, int status, const void *reply, int bytes);
+void waitset_init(WaitSet *ws);
+int waitset_add(WaitSet *ws, Queue *q);
+void waitset_notify(WaitSet *ws);
+int waitset_wait(WaitSet *ws, unsigned long long *readyMask, unsigned long long timeoutNs);
 void initializeQueue(Queue *q, int size);
+void queue_publish(Queue *q, int count);
+int queue_claim(Queue *q, int maxCount, int block);
+int queue_file_attach(Queue *q, const char *path, int size);
+int queue_resize(Queue *q, int size);
+void queue_ring_poll(Queue *q, unsigned long long nowNs);
 void enqueue(Queue *q, DataPacket data);
+void enqueue_batch(Queue *q, DataPacket *packets, int count);
 DataPacket dequeue(Queue *q);
+int dequeue_batch(Queue *q, DataPacket *packets, int maxCount);
+int dequeue_ready(Queue *q, DataPacket *packets, int maxCount);
+unsigned int fast_rand(void);
+int corpus_init(const char *path);
+const char *corpus_slice(int len);
 int get_external_data(char *buffer, int bufferSizeInBytes);
+int get_external_data_chain(DataPacket *packet, int maxBytes);
+int get_external_data_ref(DataPacket *packet, int maxBytes);
 void process_data(char *buffer, int bufferSizeInBytes);
+Chunk *chunk_alloc(void);
+void chunk_free_chain(Chunk *chain);
+int packet_iov(const DataPacket *packet, struct iovec *iov, int maxIov);
+void packet_free(DataPacket *packet);
+void *arena_alloc(Arena *a, size_t size);
+void arena_reset(Arena *a);
+void *reader_scratch(size_t size);
+void output_init(OutputVec *out, ForwardSink *sink, int fd);
+int forward_sink_open(void);
+void output_add(OutputVec *out, DataPacket *packet);
+void output_flush(OutputVec *out);
+void output_close(OutputVec *out);
+void requeue_front(Queue *q, DataPacket *packets, int count);
+unsigned long long recent_store_reserve(int count, unsigned long long *stampNs);
+void recent_store_insert(unsigned long long seq, const DataPacket *packet, unsigned long long nowNs);
+void hitter_observe(HitterSketch *h, const DataPacket *packet);
+void hitter_merge(HitterSketch *local, unsigned long long nowNs);
+void join_init(void);
+void join_observe(const DataPacket *packet);
+void join_evict(unsigned long long nowNs);
+void event_time_init(unsigned long long nowNs);
+void event_batch_add(EventBatch *eb, const DataPacket *packet);
+void event_batch_flush(EventBatch *eb, unsigned long long nowNs);
+int checkpoint_restore(const char *path);
+void checkpoint_poll(unsigned long long nowNs, int force);
+int shard_sink_open(const char *dir);
+ShardWriter *shard_writer_create(int index);
+void shard_writer_add(ShardWriter *w, DataPacket *packet);
+void shard_writer_flush(ShardWriter *w);
+void shard_writer_poll(ShardWriter *w);
+void shard_writer_close(ShardWriter *w);
+int shard_merge(const char *dir, int byTimestamp, int follow);
+int column_sink_open(const char *path);
+ColumnBatch *column_batch_create(void);
+void column_batch_add(ColumnBatch *b, DataPacket *packet);
+void column_batch_flush(ColumnBatch *b);
 void *writer_thread(void *arg);
 void *reader_thread(void *arg);
+ReaderState *start_reader(void);
+void *watchdog_thread(void *arg);
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+long lz_compress(const PayloadDictionary *d, const void *src, int len, void *dst, int cap);
+long lz_decompress(const PayloadDictionary *d, const void *src, int len, void *dst, int cap);
+void payload_dict_train(PayloadDictionary *d, const char *sample, size_t len);
+int payload_dict_open(const char *path);
+long wire_encode(const DataPacket *packet, void *buf, size_t cap);
+long wire_encode_packed(const DataPacket *packet, void *buf, size_t cap);
+void wire_restamp(WireHeader *hdr, unsigned long long eventId);
+long wire_decode(const void *buf, size_t len, DataPacket *packet);
+int stats_socket_open(const char *path);
+void stats_handle_client(int fd);
+void *stats_thread(void *arg);
+void *control_thread(void *arg);
+void run_bench(int seconds);
 
 /*****************/
 
@@ -64,249 +894,7287 @@ void *reader_thread(void *arg);
 
 
 /********************************************************
- * @fn                        -log_message
+ * @fn                        -clock_monotonic_ns
  *
- * @brief                     -Basic logging function
+ * @brief                     -CLOCK_MONOTONIC in nanoseconds (vDSO, no system call)
  *
- * @param[in]                 message     Pointer to a C-string
+ * @return                    Nanoseconds since an arbitrary fixed point
+ * @note                      -none
+ ********************************************************/
+static unsigned long long clock_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/********************************************************
+ * @fn                        -clock_init
+ *
+ * @brief                     -Select and calibrate the clock behind now_ns
  *
  * @return                    -none
- * @note                      -none
+ * @note                      Uses the TSC only if CPUID reports it invariant (constant rate across P/C-states).
+ *                            The TSC is measured against CLOCK_MONOTONIC over CLOCK_CALIBRATION_NS and the
+ *                            tick-to-nanosecond factor is kept in 32.32 fixed point. Otherwise, and on non-x86
+ *                            targets, now_ns keeps using the vDSO CLOCK_MONOTONIC. Must run before other threads.
  ********************************************************/
-void log_message(const char *message) {
-    FILE *file = fopen(LOG_FILE, "a");
-    if (file != NULL) {
-        fprintf(file, "%s\n", message);
-        fclose(file);
+void clock_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    unsigned long long ns0, ns1, tsc0, tsc1;
+    struct timespec pause = { 0, (long)CLOCK_CALIBRATION_NS };
+    char msg[128];
+
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007 ||
+        __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 || !(edx & (1U << 8))) {
+        log_message("Clock: no invariant TSC, using CLOCK_MONOTONIC.");
+        return;
+    }
+
+    ns0 = clock_monotonic_ns();
+    tsc0 = __rdtsc();
+    nanosleep(&pause, NULL);
+    ns1 = clock_monotonic_ns();
+    tsc1 = __rdtsc();
+    if (tsc1 <= tsc0 || ns1 <= ns0) {
+        log_message("Clock: TSC calibration failed, using CLOCK_MONOTONIC.");
+        return;
     }
+
+    clockSource.mult = (unsigned long long)(((unsigned __int128)(ns1 - ns0) << CLOCK_SHIFT) / (tsc1 - tsc0));
+    clockSource.ticksPerNs = (double)(tsc1 - tsc0) / (double)(ns1 - ns0);
+    clockSource.tscBase = tsc1;
+    clockSource.nsBase = ns1;
+    clockSource.useTsc = 1;
+    snprintf(msg, sizeof(msg), "Clock: invariant TSC calibrated at %.3f GHz.", clockSource.ticksPerNs);
+    log_message(msg);
+#else
+    log_message("Clock: no TSC on this architecture, using CLOCK_MONOTONIC.");
+#endif
 }
 
 /********************************************************
- * @fn                        -initializeQueue
+ * @fn                        -now_ns
  *
- * @brief                     -Function to initialize queue
+ * @brief                     -Monotonic timestamp in nanoseconds
  *
- * @param[in]                 q     Pointer to the Queue structure
- * @param[in]                 size  Size of the queue (maximum capacity)
+ * @return                    Nanoseconds since an arbitrary fixed point (the CLOCK_MONOTONIC epoch)
+ * @note                      With a calibrated TSC this is one rdtsc, a multiply and a shift.
+ ********************************************************/
+unsigned long long now_ns(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (clockSource.useTsc) {
+        unsigned long long ticks = __rdtsc() - clockSource.tscBase;
+        return clockSource.nsBase + (unsigned long long)(((unsigned __int128)ticks * clockSource.mult) >> CLOCK_SHIFT);
+    }
+#endif
+    return clock_monotonic_ns();
+}
+
+/********************************************************
+ * @fn                        -batch_controller_size
  *
- * @return                    -none
- * @note                      -none
+ * @brief                     -Current batch size chosen by a controller
+ *
+ * @param[in]                 c     Pointer to the BatchController
+ *
+ * @return                    Batch size between BATCH_MIN and BATCH_MAX
+ * @note                      Lock-free; safe to call on every packet.
  ********************************************************/
-void initializeQueue(Queue *q, int size) {
-    q->head = q->tail = NULL;                                           // Initialize queue pointers to NULL
-    q->count = 0;                                                       // Initialize queue count to zero
-    sem_init(&q->full, 0, 0);                                           // Initialize semaphore 'full' with initial value 0
-    sem_init(&q->empty, 0, size);                                       // Initialize semaphore 'empty' with max size
-    pthread_mutex_init(&q->lock, NULL);                                 // Initialize the queue lock
-    log_message("Queue initialized.");
+int batch_controller_size(BatchController *c) {
+    return __atomic_load_n(&c->batchSize, __ATOMIC_RELAXED);
 }
 
 /********************************************************
- * @fn                        -enqueue
+ * @fn                        -batch_controller_observe
  *
- * @brief                     -Function to push data into the queue
+ * @brief                     -Feed one completed batch into a controller
  *
- * @param[in]                 q     Pointer to the Queue structure
- * @param[in]                 data  DataPacket to be enqueued
+ * @param[in]                 c          Pointer to the BatchController
+ * @param[in]                 items      Number of items in the completed batch
+ * @param[in]                 latencyNs  Time the oldest item of the batch waited
  *
  * @return                    -none
- * @note                      -none
+ * @note                      Every BATCH_CONTROL_PERIOD_NS the arrival rate is re-estimated. The target size is
+ *                            the number of items expected to arrive within BATCH_LATENCY_TARGET_NS: batches
+ *                            grow (doubling) toward it under load and decay toward BATCH_MIN when idle. If the
+ *                            observed latency exceeds the target the batch is halved immediately.
  ********************************************************/
-void enqueue(Queue *q, DataPacket data) {
-    Node *newNode = (Node*) malloc(sizeof(Node));                       // Allocate memory for a new node
-    if (newNode == NULL)
-    {
-    	log_message("Error: Memory allocation failed for new node.");
-    	return;                                                         // Handle memory allocation failures
-    }
-    
-    newNode->packet = data;                                             // Store data packet in the new node
-    newNode->next = NULL;                                               // Set the next pointer of the new node to NULL
+void batch_controller_observe(BatchController *c, int items, unsigned long long latencyNs) {
+    unsigned long long now = now_ns();
+    int size, target;
 
-    sem_wait(&q->empty);                                                // Decrement 'empty' semaphore (wait if queue is full)
-    pthread_mutex_lock(&q->lock);                                       // Acquire lock before modifying the queue
+    pthread_mutex_lock(&c->lock);
+    c->pendingItems += items;
+    c->latencyNs += ((double)latencyNs - c->latencyNs) * 0.25;          // EWMA with alpha 1/4
 
-    if (q->tail == NULL) {                                              // If queue is empty
-        q->head = q->tail = newNode;                                    // Set head and tail to the new node
-    } else {
-        q->tail->next = newNode;                                        // Append the new node to the end of the queue
-        q->tail = newNode;                                              // Update the tail pointer
-    }
-    q->count++;                                                         // Increment queue element count
+    if (c->lastEvalNs == 0) {
+        c->lastEvalNs = now;                                            // First observation only starts the clock
+    } else if (now - c->lastEvalNs >= BATCH_CONTROL_PERIOD_NS) {
+        double rate = c->pendingItems * 1e9 / (double)(now - c->lastEvalNs);
+        c->arrivalRate += (rate - c->arrivalRate) * 0.5;
+        c->pendingItems = 0;
+        c->lastEvalNs = now;
 
-    pthread_mutex_unlock(&q->lock);                                     // Release the lock
-    sem_post(&q->full);                                                 // Increment 'full' semaphore (signal queue is not empty)
-    log_message("Data enqueued.");
+        size = c->batchSize;
+        target = (int)(c->arrivalRate * BATCH_LATENCY_TARGET_NS / 1e9);
+        if (target < BATCH_MIN) target = BATCH_MIN;
+        if (target > BATCH_MAX) target = BATCH_MAX;
+
+        if (c->latencyNs > BATCH_LATENCY_TARGET_NS && size > BATCH_MIN) {
+            size = size / 2;                                            // Over budget: back off multiplicatively
+            c->shrinks++;
+        } else if (target > size) {
+            size = (size * 2 < target) ? size * 2 : target;             // Under load: grow toward the target
+            c->grows++;
+        } else if (target < size) {
+            size -= (size - target + 1) / 2;                            // Idle: decay toward the target
+            c->shrinks++;
+        }
+        if (size > c->maxSize) size = c->maxSize;
+        if (size < BATCH_MIN) size = BATCH_MIN;
+        __atomic_store_n(&c->batchSize, size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&c->lock);
 }
- 
+
 /********************************************************
- * @fn                        -dequeue
+ * @fn                        -batch_controller_set_max
  *
- * @brief                     -Function to pop data from the queue
+ * @brief                     -Change the largest batch a controller may choose
  *
- * @param[in]                 q     Pointer to the Queue structure from which data will be dequeued
+ * @param[in]                 c        Pointer to the BatchController
+ * @param[in]                 maxSize  New upper bound, clamped to [BATCH_MIN, BATCH_MAX]
  *
- * @return                    DataPacket containing the dequeued data, or a zero-initialized DataPacket if the queue is empty
- * @note                      This function blocks if the queue is empty, waiting for data to become available.
+ * @return                    -none
+ * @note                      The current decision is clamped immediately, so the bound applies from the next batch.
  ********************************************************/
-DataPacket dequeue(Queue *q) {
-    DataPacket data = {0};                                              // Initialize data packet to zero
+void batch_controller_set_max(BatchController *c, int maxSize) {
+    if (maxSize < BATCH_MIN) maxSize = BATCH_MIN;
+    if (maxSize > BATCH_MAX) maxSize = BATCH_MAX;
 
-    sem_wait(&q->full);                                                 // Decrement 'full' semaphore (wait if queue is empty)
-    pthread_mutex_lock(&q->lock);                                       // Acquire lock before modifying the queue
+    pthread_mutex_lock(&c->lock);
+    c->maxSize = maxSize;
+    if (c->batchSize > maxSize)
+        __atomic_store_n(&c->batchSize, maxSize, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&c->lock);
+}
 
-    if (q->head == NULL) {                                              // If queue is unexpectedly empty
-        pthread_mutex_unlock(&q->lock);                                 // Release the lock
-        log_message("Error: Tried to dequeue from an empty queue.");
-        sem_post(&q->empty);                                            // Correct semaphore state, should not wait if there's an error
-        return data;                                                    // Return empty data if queue is unexpectedly empty
-    }
+/********************************************************
+ * @fn                        -batch_metrics_report
+ *
+ * @brief                     -Log the decisions of all batch controllers
+ *
+ * @return                    -none
+ * @note                      Rate limited to one report per BATCH_METRICS_PERIOD_NS across all threads.
+ ********************************************************/
+void batch_metrics_report(void) {
+    static unsigned long long lastReportNs = 0;
+    BatchController *controllers[] = { &enqueueBatch, &dequeueBatch, &logBatch, &outputBatch };
+    unsigned long long now = now_ns();
+    unsigned long long last = __atomic_load_n(&lastReportNs, __ATOMIC_RELAXED);
+    char line[256];
+    int i;
 
-    Node *temp = q->head;                                               // Temporary pointer to the head of the queue
-    data = temp->packet;                                                // Retrieve data packet from the head node
-    q->head = q->head->next;                                            // Move head pointer to the next node
+    if (last == 0) {
+        __atomic_compare_exchange_n(&lastReportNs, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return;                                                         // First call only starts the reporting period
+    }
+    if (now - last < BATCH_METRICS_PERIOD_NS ||
+        !__atomic_compare_exchange_n(&lastReportNs, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;                                                         // Not due yet, or another thread reports
 
-    if (q->head == NULL) {
-        q->tail = NULL;                                                 // If queue becomes empty, update tail pointer
+    for (i = 0; i < (int)(sizeof(controllers) / sizeof(controllers[0])); i++) {
+        BatchController *c = controllers[i];
+        pthread_mutex_lock(&c->lock);
+        snprintf(line, sizeof(line), "Metrics: batch %s size=%d rate=%.0f/s latency=%.0fns grows=%lu shrinks=%lu",
+                 c->name, c->batchSize, c->arrivalRate, c->latencyNs, c->grows, c->shrinks);
+        pthread_mutex_unlock(&c->lock);
+        log_message(line);
     }
-    q->count--;                                                         // Decrement queue element count
+}
 
-    pthread_mutex_unlock(&q->lock);                                     // Release the lock
-    sem_post(&q->empty);                                                // Increment 'empty' semaphore (signal queue is not full)
+static __thread LogBuffer logBuffer;
+static int logFd = -1;
+static pthread_once_t logOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t logExitKey;                                        // Flushes a thread's buffer when it exits
 
-    free(temp);                                                        // Free memory of the dequeued node
-    log_message("Data dequeued.");
-    return data;                                                        // Return the dequeued data packet
-}
- 
 /********************************************************
- * @fn                        -get_external_data
+ * @fn                        -log_thread_exit
  *
- * @brief                     -Function to simulate data retrieval from an external source
+ * @brief                     -Thread exit destructor of logExitKey: write out the exiting thread's pending messages
+ ********************************************************/
+static void log_thread_exit(void *unused) {
+    log_flush();
+}
+
+/********************************************************
+ * @fn                        -log_open
  *
- * @param[in]                 bufferSizeInBytes   Size of the buffer in bytes
+ * @brief                     -Open LOG_FILE once for appending (pthread_once callback)
  *
- * @return                    Number of bytes copied to the buffer, or -1 if the buffer size is insufficient
- * @note                      This function generates random data and copies it to the provided buffer. 
- *                            It returns the number of bytes copied, which can be less than or equal to bufferSizeInBytes.
+ * @return                    -none
+ * @note                      Also arranges for pending messages to be written when a thread or the process exits.
  ********************************************************/
-int get_external_data(char *buffer, int bufferSizeInBytes) {
-    int val;
-    char srcString[] = "0123456789abcdefghijklmnopqrstuvwxyxABCDEFGHIJKLMNOPQRSTUVWXYZ";
-
-    val = (int)(rand() % bufferSizeInBytes);                            // Generate random value within buffer size
-
-    if (bufferSizeInBytes < val)
-        return (-1);                                                    // Return error if buffer size is less than required
+static void log_open(void) {
+    logFd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    pthread_key_create(&logExitKey, log_thread_exit);
+    atexit(log_flush);                                                  // The main thread's buffer on exit()
+}
 
-    strncpy(buffer, srcString, val);                                    // Copy random data to buffer
-    return val;                                                         // Return number of bytes copied
+/********************************************************
+ * @fn                        -log_message
+ *
+ * @brief                     -Basic logging function
+ *
+ * @param[in]                 message     Pointer to a C-string
+ *
+ * @return                    -none
+ * @note                      Logs at LOG_LEVEL_INFO, see log_message_level.
+ ********************************************************/
+void log_message(const char *message) {
+    log_message_level(LOG_LEVEL_INFO, message);
 }
 
 /********************************************************
- * @fn                        -process_data
+ * @fn                        -log_message_level
  *
- * @brief                     -Function to process data
+ * @brief                     -Logging function with a severity
  *
- * @param[in]                 buffer              Pointer to the data buffer to be processed
- * @param[in]                 bufferSizeInBytes   Size of the data buffer in bytes
+ * @param[in]                 level       One of the LOG_LEVEL_* values
+ * @param[in]                 message     Pointer to a C-string
  *
  * @return                    -none
- * @note                      This function prints the contents of the data buffer character by character
- *                            and clears the buffer after printing. It also handles the case where the buffer
- *                            pointer is NULL by printing an error message.
+ * @note                      Messages below the configured log level are dropped. The rest are collected in a
+ *                            per-thread buffer and appended to LOG_FILE with a single write once the `logBatch`
+ *                            controller's batch size or latency target is reached. O_APPEND keeps whole flushes
+ *                            from different threads from interleaving.
  ********************************************************/
-void process_data(char *buffer, int bufferSizeInBytes) {
-    int i;
+void log_message_level(int level, const char *message) {
+    LogBuffer *lb = &logBuffer;
+    int len, minLevel;
+    unsigned long long now;
 
-    if (buffer) {
-        printf("thread %llu - ", pthread_self());                       // Print thread ID
-        for (i = 0; i < bufferSizeInBytes; i++) {
-            printf("%c", buffer[i]);                                    // Print each character in the buffer
+    minLevel = config_read_begin()->logLevel;
+    config_read_end();
+    if (level < minLevel)
+        return;
+
+    len = (int)strlen(message);
+    now = now_ns();
+    pthread_once(&logOnce, log_open);
+    if (logFd < 0)
+        return;
+
+    if (lb->len + len + 1 > LOG_BUFFER_SIZE)
+        log_flush();                                                    // Make room for the new message
+    if (len + 1 > LOG_BUFFER_SIZE) {                                    // Oversized message bypasses the buffer
+        struct iovec iov[2] = { { (void*) message, (size_t) len }, { (void*) "\n", 1 } };
+        if (writev(logFd, iov, 2) < 0) {
+            /* Dropped, as in log_flush */
         }
-        printf("\n");
-        memset(buffer, 0, bufferSizeInBytes);                           // Clear the buffer
-    } else {
-        printf("error in process data - %llu\n", pthread_self());       // Print error if buffer is NULL
+        return;
+    }
+
+    if (lb->count == 0) {
+        lb->firstNs = now;
+        pthread_setspecific(logExitKey, lb);                            // Non-NULL, so the exit destructor runs
     }
+    memcpy(lb->buf + lb->len, message, len);
+    lb->buf[lb->len + len] = '\n';
+    lb->len += len + 1;
+    lb->count++;
+
+    if (lb->count >= batch_controller_size(&logBatch) || now - lb->firstNs >= BATCH_LATENCY_TARGET_NS)
+        log_flush();
 }
- 
+
 /********************************************************
- * @fn                        -writer_thread
- *
- * @brief                     -Writer thread
+ * @fn                        -log_flush
  *
- * @param[in]                 arg       Pointer to optional thread argument (not used in this function)
+ * @brief                     -Write out the calling thread's pending log messages
  *
  * @return                    -none
- * @note                      This function represents a writer thread that continuously retrieves
- *                            external data, encapsulates it into a `DataPacket` structure, and enqueues
- *                            the packet into a shared queue (`dataQueue`) for processing by reader threads.
- *                            If data retrieval fails or returns an empty packet, memory allocated for the
- *                            data buffer (`packet.data`) is freed to avoid memory leaks.
+ * @note                      Called automatically by log_message and before a thread blocks on the queue, so
+ *                            messages never wait behind an idle thread.
  ********************************************************/
-void *writer_thread(void *arg) {
-    while (1) {
-        DataPacket packet;
-        packet.data = (char*) malloc(1024);                             // Allocate memory for the buffer
-        if (packet.data == NULL) {
-            log_message("Error: Memory allocation failed for data packet.");
-            continue;                                                   // Handle memory allocation failure
-        }
-        packet.size = get_external_data(packet.data, 1024);             // Retrieve external data
-        packet.eventId = 0; 
-        packet.eventCorrelationId = 0; 
+void log_flush(void) {
+    LogBuffer *lb = &logBuffer;
 
-        if (packet.size > 0) {
-            enqueue(&dataQueue, packet);                                // Enqueue the data packet
-        } else {
-            free(packet.data);                                          // Clean up if data retrieval failed
-        }
+    if (lb->count == 0 || logFd < 0)
+        return;
+    if (write(logFd, lb->buf, lb->len) < 0) {
+        /* Nothing sensible to log a logging failure to; drop the batch */
     }
-    return NULL;
+    batch_controller_observe(&logBatch, lb->count, now_ns() - lb->firstNs);
+    lb->len = 0;
+    lb->count = 0;
 }
 
 /********************************************************
- * @fn                        -reader_thread
+ * @fn                        -config_read_begin
  *
- * @brief                     -Reader thread
+ * @brief                     -Enter a configuration read-side section
+ *
+ * @return                    Pointer to the active Config, valid until config_read_end
+ * @note                      Lock-free: marks the calling thread's slot active and loads the published pointer.
+ *                            Sections must be short and must not block; copy the fields that are needed.
+ ********************************************************/
+static __thread int configSlot = -1;
+
+const Config *config_read_begin(void) {
+    if (configSlot < 0) {
+        configSlot = __atomic_fetch_add(&configReaderCount, 1, __ATOMIC_RELAXED);
+        if (configSlot >= MAX_CONFIG_READERS)
+            configSlot = MAX_CONFIG_READERS - 1;                        // Overflow threads share the last slot
+    }
+    __atomic_fetch_add(&configReaders[configSlot].active, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&activeConfig, __ATOMIC_ACQUIRE);
+}
 
+/********************************************************
+ * @fn                        -config_read_end
  *
- * @param[in]                 arg       Pointer to optional thread argument (not used in this function)
+ * @brief                     -Leave a configuration read-side section
  *
  * @return                    -none
- * @note                      This function represents a reader thread that continuously dequeues
- *                            data packets from a shared queue (`dataQueue`). If a valid data packet
- *                            is dequeued, it processes the data using the `process_data` function and
- *                            then frees the associated memory of the data buffer (`packet.data`).
+ * @note                      -none
+ ********************************************************/
+void config_read_end(void) {
+    __atomic_fetch_add(&configReaders[configSlot].seq, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&configReaders[configSlot].active, 1, __ATOMIC_RELEASE);
+}
+
+/********************************************************
+ * @fn                        -config_load
+ *
+ * @brief                     -Parse a configuration file on top of the active configuration
+ *
+ * @param[in]                 path  Path to a file of "key = value" lines ('#' starts a comment)
+ * @param[out]                cfg   Receives the resulting configuration
+ *
+ * @return                    0 on success, -1 if the file cannot be read
+ * @note                      Keys: log_level (debug|info|error), rate_limit, enqueue_batch_max, dequeue_batch_max,
+ *                            log_batch_max, output_batch_max, readers, message_size, payload_mode
+ *                            (reference|copy), queue_capacity. Unknown keys are logged and ignored.
+ ********************************************************/
+int config_load(const char *path, Config *cfg) {
+    FILE *file = fopen(path, "r");
+    char line[256], key[64], value[64], msg[160];
+
+    *cfg = *config_read_begin();                                        // Unset keys keep their current value
+    config_read_end();
+    if (file == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *hash = strchr(line, '#');
+        if (hash != NULL)
+            *hash = '\0';
+        if (sscanf(line, " %63[^= \t] = %63s", key, value) != 2)
+            continue;                                                   // Blank or malformed line
+
+        if (strcmp(key, "log_level") == 0) {
+            cfg->logLevel = strcmp(value, "debug") == 0 ? LOG_LEVEL_DEBUG :
+                            strcmp(value, "error") == 0 ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO;
+        } else if (strcmp(key, "rate_limit") == 0) {
+            cfg->rateLimit = atol(value);
+        } else if (strcmp(key, "enqueue_batch_max") == 0) {
+            cfg->enqueueBatchMax = atoi(value);
+        } else if (strcmp(key, "dequeue_batch_max") == 0) {
+            cfg->dequeueBatchMax = atoi(value);
+        } else if (strcmp(key, "log_batch_max") == 0) {
+            cfg->logBatchMax = atoi(value);
+        } else if (strcmp(key, "output_batch_max") == 0) {
+            cfg->outputBatchMax = atoi(value);
+        } else if (strcmp(key, "readers") == 0) {
+            cfg->readers = atoi(value);
+        } else if (strcmp(key, "message_size") == 0) {
+            cfg->messageSize = atoi(value) > 1 ? atoi(value) : 2;
+        } else if (strcmp(key, "payload_mode") == 0) {
+            cfg->payloadMode = strcmp(value, "copy") == 0 ? PAYLOAD_MODE_COPY : PAYLOAD_MODE_REFERENCE;
+        } else if (strcmp(key, "log_segment_mb") == 0) {
+            cfg->logSegmentBytes = atol(value) > 0 ? atol(value) << 20 : 0;
+        } else if (strcmp(key, "compact_cpu_percent") == 0) {
+            cfg->compactCpuPercent = atoi(value) < 1 ? 1 : atoi(value) > 100 ? 100 : atoi(value);
+        } else if (strcmp(key, "compact_io_mb") == 0) {
+            cfg->compactIoMb = atoi(value) > 1 ? atoi(value) : 1;
+        } else if (strcmp(key, "queue_capacity") == 0) {
+            cfg->queueCapacity = atoi(value) > 0 ? atoi(value) : 0;
+        } else {
+            snprintf(msg, sizeof(msg), "Config: unknown key '%s' ignored.", key);
+            log_message(msg);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -config_publish
+ *
+ * @brief                     -Make a configuration active and apply it
+ *
+ * @param[in]                 cfg   Heap-allocated configuration; ownership passes to this function
+ *
+ * @return                    -none
+ * @note                      RCU-style: the pointer is swapped atomically, then the previous configuration is
+ *                            freed once every thread that might still be reading it has left its read-side
+ *                            section. Publishers hold controlLock (the control thread's tick or a stats command),
+ *                            so updates never race each other.
+ ********************************************************/
+void config_publish(Config *cfg) {
+    Config *old = __atomic_exchange_n(&activeConfig, cfg, __ATOMIC_SEQ_CST);
+    int slots = __atomic_load_n(&configReaderCount, __ATOMIC_RELAXED);
+    int i;
+
+    batch_controller_set_max(&enqueueBatch, cfg->enqueueBatchMax);
+    batch_controller_set_max(&dequeueBatch, cfg->dequeueBatchMax);
+    batch_controller_set_max(&logBatch, cfg->logBatchMax);
+    batch_controller_set_max(&outputBatch, cfg->outputBatchMax);
+    apply_reader_count(cfg->readers);
+    if (cfg->queueCapacity > 0 && cfg->queueCapacity != __atomic_load_n(&dataQueue.capacity, __ATOMIC_RELAXED))
+        queue_resize(&dataQueue, cfg->queueCapacity);
+
+    if (slots > MAX_CONFIG_READERS)
+        slots = MAX_CONFIG_READERS;
+    for (i = 0; i < slots; i++) {                                       // Wait for a grace period
+        unsigned long seq = __atomic_load_n(&configReaders[i].seq, __ATOMIC_ACQUIRE);
+        while (__atomic_load_n(&configReaders[i].active, __ATOMIC_ACQUIRE) != 0 &&
+               __atomic_load_n(&configReaders[i].seq, __ATOMIC_ACQUIRE) == seq)
+            sched_yield();                                              // Sections are a few instructions long
+    }
+    if (old != &defaultConfig)
+        free(old);
+}
+
+/********************************************************
+ * @fn                        -config_reload
+ *
+ * @brief                     -Re-read CONFIG_FILE and publish the result
+ *
+ * @return                    -none
+ * @note                      -none
+ ********************************************************/
+void config_reload(void) {
+    Config *cfg = (Config*) malloc(sizeof(Config));
+    char msg[200];
+
+    if (cfg == NULL) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for configuration.");
+        return;
+    }
+    if (config_load(CONFIG_FILE, cfg) != 0) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot read " CONFIG_FILE ", configuration unchanged.");
+        free(cfg);
+        return;
+    }
+    config_publish(cfg);
+    snprintf(msg, sizeof(msg), "Config: reloaded log_level=%d rate_limit=%ld batch_max=%d/%d/%d/%d readers=%d",
+             cfg->logLevel, cfg->rateLimit, cfg->enqueueBatchMax, cfg->dequeueBatchMax,
+             cfg->logBatchMax, cfg->outputBatchMax, cfg->readers);
+    log_message(msg);
+}
+
+/********************************************************
+ * @fn                        -futex_wait
+ *
+ * @brief                     -Sleep on a futex word while it holds the expected value
+ *
+ * @param[in]                 word        Futex word
+ * @param[in]                 expected    Value the word must still hold for the caller to sleep
+ * @param[in]                 timeoutNs   Relative timeout, 0 to wait without one
+ *
+ * @return                    0 when woken, -1 on timeout, mismatch or interruption (see errno)
+ * @note                      -none
+ ********************************************************/
+long futex_wait(unsigned int *word, unsigned int expected, unsigned long long timeoutNs) {
+    struct timespec ts = { (time_t)(timeoutNs / 1000000000ULL), (long)(timeoutNs % 1000000000ULL) };
+    return syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, timeoutNs ? &ts : NULL, NULL, 0);
+}
+
+/********************************************************
+ * @fn                        -futex_wake
+ *
+ * @brief                     -Wake threads sleeping on a futex word
+ *
+ * @param[in]                 word    Futex word
+ * @param[in]                 count   Maximum number of threads to wake
+ *
+ * @return                    Number of threads woken, or -1 on error
+ * @note                      Async-signal-safe.
+ ********************************************************/
+long futex_wake(unsigned int *word, int count) {
+    return syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/********************************************************
+ * @fn                        -pulse_ring_init
+ *
+ * @brief                     -Prepare a pulse ring and attach it to the queue whose readers receive the pulses
+ *
+ * @param[out]                ring   Pulse ring
+ * @param[in]                 q      Queue whose idle readers a pulse wakes
+ *
+ * @return                    -none
+ * @note                      Must run before the first pulse_send, including from a signal handler.
+ ********************************************************/
+void pulse_ring_init(PulseRing *ring, Queue *q) {
+    int i;
+
+    memset(ring, 0, sizeof(*ring));
+    for (i = 0; i < PULSE_RING_SIZE; i++)
+        ring->slots[i].seq = i;                                         // Slot i is free for position i
+    ring->queue = q;
+    q->pulses = ring;
+}
+
+/********************************************************
+ * @fn                        -pulse_send
+ *
+ * @brief                     -Post a pulse to the readers of a queue
+ *
+ * @param[in]                 ring    Pulse ring
+ * @param[in]                 code    Pulse code (PULSE_CODE_*)
+ * @param[in]                 value   Pulse value
+ *
+ * @return                    1 if queued, 0 if coalesced with or dropped for a full ring
+ * @note                      Async-signal-safe and allocation-free: a bounded multi-producer ring where a slot
+ *                            is claimed with one compare-and-swap and published by its sequence number, so a
+ *                            producer never waits for another. When the ring is full, codes below PULSE_CODES
+ *                            coalesce (the latest value is delivered once), higher codes are dropped. An idle
+ *                            reader is woken through the queue's futex, and so is a thread waiting on the
+ *                            queue's wait set.
+ ********************************************************/
+int pulse_send(PulseRing *ring, unsigned int code, unsigned int value) {
+    unsigned long long pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    int queued = 0;
+
+    for (;;) {
+        PulseSlot *s = &ring->slots[pos & (PULSE_RING_SIZE - 1)];
+        unsigned long long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                s->pulse = (unsigned long long) code << 32 | value;
+                __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&ring->sent, 1, __ATOMIC_RELAXED);
+                queued = 1;
+                break;
+            }
+        } else if (seq < pos) {                                         // Full: the slot still holds the previous lap
+            if (code < PULSE_CODES) {
+                __atomic_store_n(&ring->coalesced[code], value, __ATOMIC_RELAXED);
+                __atomic_fetch_or(&ring->coalescedMask, 1ULL << code, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&ring->merged, 1, __ATOMIC_RELAXED);
+            } else {
+                __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            }
+            break;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);       // Another producer took the slot
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);                            // Publish before checking for sleepers
+    if (__atomic_load_n(&ring->queue->idle, __ATOMIC_RELAXED) > 0) {
+        __atomic_fetch_add(&ring->queue->wakeSeq, 1, __ATOMIC_RELEASE);
+        futex_wake(&ring->queue->wakeSeq, 1);
+    }
+    if (ring->queue->waitSet != NULL)
+        waitset_notify(ring->queue->waitSet);
+    return queued;
+}
+
+/********************************************************
+ * @fn                        -pulse_receive
+ *
+ * @brief                     -Take the oldest pending pulse
+ *
+ * @param[in]                 ring    Pulse ring
+ * @param[out]                pulse   Receives the pulse
+ *
+ * @return                    1 if a pulse was taken, 0 if none is pending
+ * @note                      Queued pulses come in order, then coalesced ones by code. Not for signal handlers.
+ ********************************************************/
+int pulse_receive(PulseRing *ring, Pulse *pulse) {
+    unsigned long long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED), mask;
+
+    for (;;) {
+        PulseSlot *s = &ring->slots[pos & (PULSE_RING_SIZE - 1)];
+        unsigned long long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos + 1) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                unsigned long long v = s->pulse;
+                __atomic_store_n(&s->seq, pos + PULSE_RING_SIZE, __ATOMIC_RELEASE); // Free for the next lap
+                pulse->code = (unsigned int) (v >> 32);
+                pulse->value = (unsigned int) v;
+                __atomic_fetch_add(&ring->delivered, 1, __ATOMIC_RELAXED);
+                return 1;
+            }
+        } else if (seq < pos + 1) {
+            break;                                                      // Empty (or the next slot is still being written)
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    mask = __atomic_load_n(&ring->coalescedMask, __ATOMIC_ACQUIRE);
+    while (mask != 0 && !__atomic_compare_exchange_n(&ring->coalescedMask, &mask, mask & (mask - 1), 1,
+                                                     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        ;
+    if (mask == 0)
+        return 0;
+    pulse->code = (unsigned int) __builtin_ctzll(mask);
+    pulse->value = __atomic_load_n(&ring->coalesced[pulse->code], __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ring->delivered, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/********************************************************
+ * @fn                        -pulse_pending
+ *
+ * @brief                     -Whether a pulse is waiting, without taking it
+ ********************************************************/
+int pulse_pending(PulseRing *ring) {
+    unsigned long long pos = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&ring->slots[pos & (PULSE_RING_SIZE - 1)].seq, __ATOMIC_ACQUIRE) == pos + 1 ||
+           __atomic_load_n(&ring->coalescedMask, __ATOMIC_ACQUIRE) != 0;
+}
+
+/********************************************************
+ * @fn                        -pulse_signal_handler
+ *
+ * @brief                     -SIGUSR1 handler: posts a PULSE_CODE_USER pulse numbering the signals received
+ ********************************************************/
+static void pulse_signal_handler(int sig) {
+    static unsigned int received = 0;
+    int savedErrno = errno;                                             // futex_wake may set it
+
+    (void) sig;
+    pulse_send(&pulseRing, PULSE_CODE_USER, __atomic_add_fetch(&received, 1, __ATOMIC_RELAXED));
+    errno = savedErrno;
+}
+
+/********************************************************
+ * @fn                        -pulse_handle
+ *
+ * @brief                     -Default action of a reader for a pulse it has no specific handling for
+ ********************************************************/
+void pulse_handle(const Pulse *pulse) {
+    char msg[64];
+
+    snprintf(msg, sizeof(msg), "Pulse: code %u value %u.", pulse->code, pulse->value);
+    log_message(msg);
+}
+
+/********************************************************
+ * @fn                        -cpu_relax
+ *
+ * @brief                     -Spin-wait hint: yields the core to a sibling hyperthread while polling
+ ********************************************************/
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+/********************************************************
+ * @fn                        -thread_nice
+ *
+ * @brief                     -Nice value of the calling thread, read once and cached
+ ********************************************************/
+static __thread int threadNice = INT_MIN;
+
+static int thread_nice(void) {
+    if (threadNice == INT_MIN) {
+        errno = 0;
+        threadNice = getpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid));
+        if (errno != 0)
+            threadNice = 0;
+    }
+    return threadNice;
+}
+
+/********************************************************
+ * @fn                        -channel_init
+ *
+ * @brief                     -Prepare a synchronous message channel
+ *
+ * @param[out]                ch   Channel to initialize
+ *
+ * @return                    -none
+ * @note                      Waiting sides poll for CHANNEL_SPIN rounds before sleeping only when another CPU
+ *                            can run the peer meanwhile; on one CPU spinning just delays it.
+ ********************************************************/
+void channel_init(Channel *ch) {
+    pthread_mutex_init(&ch->lock, NULL);
+    ch->head = ch->tail = NULL;
+    ch->seq = 0;
+    ch->receivers = 0;
+    ch->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CHANNEL_SPIN : 0;
+}
+
+/********************************************************
+ * @fn                        -channel_send
+ *
+ * @brief                     -Send a message and block until a receiver replies (MsgSend)
+ *
+ * @param[in]                 ch           Channel
+ * @param[in]                 msg          Message; read in place by the receiver
+ * @param[in]                 bytes        Message length
+ * @param[out]                reply        Reply buffer; written in place by the replier
+ * @param[in]                 replyBytes   Capacity of reply
+ *
+ * @return                    Status passed to channel_reply
+ * @note                      The message is never copied into an intermediate buffer and nothing is allocated:
+ *                            the request lives on the sender's stack until the reply, since the sender is
+ *                            blocked all that time. Senders are served in FIFO order.
+ ********************************************************/
+int channel_send(Channel *ch, const void *msg, int bytes, void *reply, int replyBytes) {
+    ChannelMsg m;
+    int spin;
+
+    m.next = NULL;
+    m.send = msg;
+    m.sendBytes = bytes;
+    m.reply = reply;
+    m.replyBytes = replyBytes;
+    m.status = 0;
+    m.nice = thread_nice();
+    m.state = CHANNEL_SENT;
+
+    pthread_mutex_lock(&ch->lock);
+    if (ch->tail != NULL)
+        ch->tail->next = &m;
+    else
+        __atomic_store_n(&ch->head, &m, __ATOMIC_RELEASE);              // Receivers peek at head while spinning
+    ch->tail = &m;
+    pthread_mutex_unlock(&ch->lock);
+    __atomic_fetch_add(&ch->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ch->receivers, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&ch->seq, 1);                                        // Hand the message to a blocked receiver
+
+    for (spin = ch->spin; ; ) {
+        unsigned int state = __atomic_load_n(&m.state, __ATOMIC_ACQUIRE);
+        if (state == CHANNEL_REPLIED)
+            break;
+        if (spin > 0) {
+            spin--;
+            cpu_relax();
+            continue;
+        }
+        futex_wait(&m.state, state, 0);                                 // REPLY-blocked, as on QNX
+    }
+    return m.status;
+}
+
+/********************************************************
+ * @fn                        -channel_receive
+ *
+ * @brief                     -Wait for the next message of a channel (MsgReceive)
+ *
+ * @param[in]                 ch      Channel
+ * @param[out]                msg     Receives the first bytes of the message
+ * @param[in]                 bytes   Capacity of msg
+ * @param[out]                rcvid   Handle to pass to channel_reply
+ *
+ * @return                    Full length of the message, which may exceed bytes
+ * @note                      If the sender runs at a better nice value than the receiver, the receiver adopts
+ *                            it until it replies, so a busy low-priority server does not hold up an urgent
+ *                            client. Raising priority needs CAP_SYS_NICE or RLIMIT_NICE; without them the
+ *                            receiver keeps its own.
+ ********************************************************/
+int channel_receive(Channel *ch, void *msg, int bytes, ChannelMsg **rcvid) {
+    ChannelMsg *m;
+    int spin = ch->spin;
+
+    for (;;) {
+        unsigned int seq = __atomic_load_n(&ch->seq, __ATOMIC_SEQ_CST);
+
+        if (spin > 0 && __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE) == NULL) {
+            spin--;
+            cpu_relax();
+            continue;
+        }
+        pthread_mutex_lock(&ch->lock);
+        m = ch->head;
+        if (m != NULL) {
+            __atomic_store_n(&ch->head, m->next, __ATOMIC_RELAXED);
+            if (m->next == NULL)
+                ch->tail = NULL;
+        }
+        pthread_mutex_unlock(&ch->lock);
+        if (m != NULL)
+            break;
+        __atomic_fetch_add(&ch->receivers, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&ch->seq, seq, 0);                                   // RECEIVE-blocked until a send bumps seq
+        __atomic_fetch_sub(&ch->receivers, 1, __ATOMIC_SEQ_CST);
+    }
+
+    memcpy(msg, m->send, m->sendBytes < bytes ? m->sendBytes : bytes);  // Straight from the sender's buffer
+    m->receiverTid = 0;
+    if (m->nice < thread_nice()) {
+        m->receiverTid = (int) syscall(SYS_gettid);
+        m->receiverNice = thread_nice();
+        if (setpriority(PRIO_PROCESS, (id_t) m->receiverTid, m->nice) == 0)
+            threadNice = m->nice;
+        else
+            m->receiverTid = 0;
+    }
+    __atomic_store_n(&m->state, CHANNEL_RECEIVED, __ATOMIC_RELEASE);
+    *rcvid = m;
+    return m->sendBytes;
+}
+
+/********************************************************
+ * @fn                        -channel_reply
+ *
+ * @brief                     -Reply to a received message and unblock its sender (MsgReply)
+ *
+ * @param[in]                 rcvid    Handle from channel_receive
+ * @param[in]                 status   Value channel_send returns
+ * @param[in]                 reply    Reply data, copied straight into the sender's buffer (may be NULL)
+ * @param[in]                 bytes    Reply length; truncated to the sender's capacity
+ *
+ * @return                    -none
+ * @note                      Restores the receiver's nice value if channel_receive raised it. rcvid is invalid
+ *                            afterwards: the sender's stack frame goes away as soon as it wakes up.
+ ********************************************************/
+void channel_reply(ChannelMsg *rcvid, int status, const void *reply, int bytes) {
+    if (reply != NULL && bytes > 0)
+        memcpy(rcvid->reply, reply, bytes < rcvid->replyBytes ? bytes : rcvid->replyBytes);
+    rcvid->status = status;
+    if (rcvid->receiverTid != 0 && setpriority(PRIO_PROCESS, (id_t) rcvid->receiverTid, rcvid->receiverNice) == 0)
+        threadNice = rcvid->receiverNice;
+    __atomic_store_n(&rcvid->state, CHANNEL_REPLIED, __ATOMIC_RELEASE);
+    futex_wake(&rcvid->state, 1);                                       // Last access: the sender may return now
+}
+
+/********************************************************
+ * @fn                        -waitset_init
+ *
+ * @brief                     -Prepare an empty wait set
+ ********************************************************/
+void waitset_init(WaitSet *ws) {
+    memset(ws, 0, sizeof(*ws));
+}
+
+/********************************************************
+ * @fn                        -waitset_add
+ *
+ * @brief                     -Add a queue (and its pulse ring, if any) to a wait set
+ *
+ * @param[in]                 ws   Wait set
+ * @param[in]                 q    Queue; belongs to at most one wait set
+ *
+ * @return                    Index of the queue's bit in the ready mask, or -1 if the set is full or the queue
+ *                            already belongs to a set
+ * @note                      Call before any thread waits on the set.
+ ********************************************************/
+int waitset_add(WaitSet *ws, Queue *q) {
+    if (ws->count == WAITSET_MAX || q->waitSet != NULL)
+        return -1;
+    ws->queues[ws->count] = q;
+    __atomic_store_n(&q->waitSet, ws, __ATOMIC_RELEASE);
+    return ws->count++;
+}
+
+/********************************************************
+ * @fn                        -waitset_notify
+ *
+ * @brief                     -Wake a thread waiting on the set after a member queue became ready
+ *
+ * @param[in]                 ws   Wait set
+ *
+ * @return                    -none
+ * @note                      Called by producers after publishing. Costs one fence and one load while nobody
+ *                            waits. Async-signal-safe, so pulse_send can use it.
+ ********************************************************/
+void waitset_notify(WaitSet *ws) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);                            // Publish before checking for sleepers
+    if (__atomic_load_n(&ws->waiters, __ATOMIC_RELAXED) == 0)
+        return;
+    __atomic_fetch_add(&ws->seq, 1, __ATOMIC_RELEASE);
+    if (futex_wake(&ws->seq, 1) > 0)
+        __atomic_fetch_add(&ws->wakeups, 1, __ATOMIC_RELAXED);
+}
+
+/********************************************************
+ * @fn                        -waitset_scan
+ *
+ * @brief                     -Collect the members of a wait set that have packets or pulses to take
+ ********************************************************/
+static int waitset_scan(WaitSet *ws, unsigned long long *readyMask) {
+    unsigned long long mask = 0;
+    int i, n = 0;
+
+    for (i = 0; i < ws->count; i++) {
+        Queue *q = ws->queues[i];
+        if (__atomic_load_n(&q->ready, __ATOMIC_SEQ_CST) > 0 || (q->pulses != NULL && pulse_pending(q->pulses))) {
+            mask |= 1ULL << i;
+            n++;
+        }
+    }
+    *readyMask = mask;
+    return n;
+}
+
+/********************************************************
+ * @fn                        -waitset_wait
+ *
+ * @brief                     -Block until any queue of the set has packets or pulses
+ *
+ * @param[in]                 ws          Wait set
+ * @param[out]                readyMask   Bit i set when ws->queues[i] is ready
+ * @param[in]                 timeoutNs   Longest wait, 0 to wait without a timeout
+ *
+ * @return                    Number of ready queues, 0 on timeout
+ * @note                      Readiness is a hint: another reader may claim the packets first, so take them
+ *                            with dequeue_ready, which never blocks. The set shares one eventcount: a waiter
+ *                            reads it, announces itself, re-checks the queues and sleeps only if the count is
+ *                            unchanged, so a publish between the check and the sleep is never lost. No lock is
+ *                            taken on either side.
+ ********************************************************/
+int waitset_wait(WaitSet *ws, unsigned long long *readyMask, unsigned long long timeoutNs) {
+    unsigned long long deadline = timeoutNs ? now_ns() + timeoutNs : 0;
+    int n;
+
+    while ((n = waitset_scan(ws, readyMask)) == 0) {
+        unsigned long long left = 0;
+        unsigned int seq = __atomic_load_n(&ws->seq, __ATOMIC_ACQUIRE);
+
+        if (deadline != 0) {
+            unsigned long long now = now_ns();
+            if (now >= deadline)
+                return 0;
+            left = deadline - now;
+        }
+        __atomic_fetch_add(&ws->waiters, 1, __ATOMIC_SEQ_CST);
+        if (waitset_scan(ws, readyMask) == 0) {                         // Re-check after announcing ourselves
+            __atomic_fetch_add(&ws->waits, 1, __ATOMIC_RELAXED);
+            futex_wait(&ws->seq, seq, left);
+        }
+        __atomic_fetch_sub(&ws->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    return n;
+}
+
+/********************************************************
+ * @fn                        -initializeQueue
+ *
+ * @brief                     -Function to initialize queue
+ *
+ * @param[in]                 q     Pointer to the Queue structure
+ * @param[in]                 size  Size of the queue (maximum capacity)
+ *
+ * @return                    -none
+ * @note                      If `queueFilePath` is set the ring lives in that file: an existing ring is
+ *                            reattached and resumes at its persisted head and tail (its capacity wins over
+ *                            size), otherwise a new one is created. Falls back to an in-memory queue on error.
+ ********************************************************/
+void initializeQueue(Queue *q, int size) {
+    int pending = 0;
+
+    q->head = q->tail = NULL;                                           // Initialize queue pointers to NULL
+    q->count = 0;                                                       // Initialize queue count to zero
+    q->debt = 0;                                                        // Nothing requeued over capacity yet
+    q->ring = NULL;
+    q->slots = NULL;
+    q->ringBytes = 0;
+    q->pulses = NULL;
+    q->waitSet = NULL;
+    q->ringPath = NULL;
+    q->ringRetryNs = 0;
+
+    if (queueFilePath != NULL && queue_file_attach(q, queueFilePath, size) == 0) {
+        size = (int)q->ring->capacity;
+        pending = (int)(q->ring->tail - q->ring->head);                 // Packets that survived the restart
+        q->count = pending;
+    }
+    q->ready = pending;                                                 // Packets already queued are ready to be claimed
+    q->wakeSeq = 0;
+    q->idle = 0;
+    q->sinceWake = 0;
+    q->lastWakeNs = 0;
+    q->wakeups = q->published = 0;
+    q->lastEventId = (q->ring != NULL) ? q->ring->tail : 0;             // Event ids continue across restarts of a ring file
+    q->capacity = size;
+    sem_init(&q->empty, 0, size - pending);                             // Initialize semaphore 'empty' with the free capacity
+    pthread_mutex_init(&q->lock, NULL);                                 // Initialize the queue lock
+    log_message("Queue initialized.");
+}
+
+/********************************************************
+ * @fn                        -queue_publish
+ *
+ * @brief                     -Make newly linked packets claimable and wake a reader if worthwhile
+ *
+ * @param[in]                 q       Pointer to the Queue structure
+ * @param[in]                 count   Number of packets just added
+ *
+ * @return                    -none
+ * @note                      Wake-ups are coalesced: an idle reader is woken only once QUEUE_WAKE_BATCH packets
+ *                            have been published since the last wake-up, or when the last wake-up is older than
+ *                            QUEUE_WAKE_DELAY_NS (so sparse traffic is still delivered immediately). At most one
+ *                            reader is woken per wake-up; it takes a whole batch. A wake-up is only held back
+ *                            within QUEUE_WAKE_DELAY_NS of the previous one, and the reader that one woke sleeps
+ *                            at most QUEUE_WAKE_DELAY_NS afterwards (see queue_claim), so it picks up the held-back
+ *                            packets within that delay.
+ *                            A wait set the queue belongs to is notified on every publish, without coalescing.
+ ********************************************************/
+void queue_publish(Queue *q, int count) {
+    int pending;
+    unsigned long long now;
+
+    __atomic_fetch_add(&q->ready, count, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&q->published, count, __ATOMIC_RELAXED);
+    if (q->waitSet != NULL)
+        waitset_notify(q->waitSet);                                     // Threads waiting on several queues at once
+    if (__atomic_load_n(&q->idle, __ATOMIC_SEQ_CST) == 0)
+        return;                                                         // Nobody asleep: readers will find the packets
+
+    pending = __atomic_add_fetch(&q->sinceWake, count, __ATOMIC_RELAXED);
+    now = now_ns();
+    if (pending < QUEUE_WAKE_BATCH && now - __atomic_load_n(&q->lastWakeNs, __ATOMIC_RELAXED) < QUEUE_WAKE_DELAY_NS)
+        return;                                                         // Let more packets accumulate first
+
+    __atomic_store_n(&q->sinceWake, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->lastWakeNs, now, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&q->wakeSeq, 1, __ATOMIC_RELEASE);
+    if (futex_wake(&q->wakeSeq, 1) > 0)
+        __atomic_fetch_add(&q->wakeups, 1, __ATOMIC_RELAXED);
+}
+
+/********************************************************
+ * @fn                        -queue_claim
+ *
+ * @brief                     -Claim up to maxCount published packets
+ *
+ * @param[in]                 q          Pointer to the Queue structure
+ * @param[in]                 maxCount   Largest number of packets to claim
+ * @param[in]                 block      Nonzero to sleep until at least one packet can be claimed
+ *
+ * @return                    Number of packets claimed (0 only when not blocking, or when a pulse is pending)
+ * @note                      Claimed packets are reserved for the caller, who removes them under the queue lock.
+ *                            An idle reader sleeps with a timeout that starts at QUEUE_WAKE_DELAY_NS and doubles
+ *                            up to QUEUE_IDLE_WAIT_MAX_NS while it keeps timing out on an empty queue. After a
+ *                            wake-up, or while queue_publish holds one back, it is QUEUE_WAKE_DELAY_NS again.
+ ********************************************************/
+int queue_claim(Queue *q, int maxCount, int block) {
+    unsigned long long timeoutNs = QUEUE_WAKE_DELAY_NS;
+
+    while (1) {
+        int ready = __atomic_load_n(&q->ready, __ATOMIC_ACQUIRE);
+        unsigned int seq;
+
+        while (ready > 0) {
+            int take = (ready < maxCount) ? ready : maxCount;
+            if (__atomic_compare_exchange_n(&q->ready, &ready, ready - take, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                if (ready == take && __atomic_load_n(&q->sinceWake, __ATOMIC_RELAXED) > 0)
+                    __atomic_store_n(&q->sinceWake, 0, __ATOMIC_RELAXED); // Drained: no held-back wake-up is owed
+                return take;
+            }
+        }
+        if (!block || (q->pulses != NULL && pulse_pending(q->pulses)))
+            return 0;                                                   // A pending pulse goes ahead of waiting
+
+        seq = __atomic_load_n(&q->wakeSeq, __ATOMIC_ACQUIRE);
+        __atomic_fetch_add(&q->idle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->ready, __ATOMIC_SEQ_CST) == 0 &&        // Re-check after announcing ourselves
+            (q->pulses == NULL || !pulse_pending(q->pulses))) {
+            if (__atomic_load_n(&q->sinceWake, __ATOMIC_RELAXED) > 0)
+                timeoutNs = QUEUE_WAKE_DELAY_NS;                        // A wake-up is being held back: stay on call
+            if (futex_wait(&q->wakeSeq, seq, timeoutNs) == 0 || errno != ETIMEDOUT)
+                timeoutNs = QUEUE_WAKE_DELAY_NS;                        // Woken: next sleep is short (see queue_publish)
+            else if (timeoutNs < QUEUE_IDLE_WAIT_MAX_NS)
+                timeoutNs *= 2;                                         // Timed out on an empty queue: back off
+        }
+        __atomic_fetch_sub(&q->idle, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/********************************************************
+ * @fn                        -queue_file_attach
+ *
+ * @brief                     -Map a ring file as the backing store of a queue
+ *
+ * @param[in]                 q     Pointer to the Queue structure
+ * @param[in]                 path  Ring file, created if missing or not a valid ring
+ * @param[in]                 size  Capacity used when a new ring is created
+ *
+ * @return                    0 on success, -1 on failure (the queue stays in memory)
+ * @note                      A slot is written completely before `tail` is advanced past it, and a slot is
+ *                            copied out before `head` is advanced, so after a crash the file holds exactly the
+ *                            packets that were enqueued and not yet handed to a reader.
+ ********************************************************/
+int queue_file_attach(Queue *q, const char *path, int size) {
+    size_t bytes = sizeof(RingFileHeader) + (size_t)size * sizeof(RingSlot);
+    RingFileHeader *hdr;
+    struct stat st;
+    char msg[200];
+    int fd, fresh = 0;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot open queue file, using an in-memory queue.");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    if ((size_t)st.st_size >= sizeof(RingFileHeader)) {                 // Existing file: trust its own geometry
+        RingFileHeader probe;
+        if (pread(fd, &probe, sizeof(probe), 0) == sizeof(probe) && probe.magic == QUEUE_FILE_MAGIC &&
+            probe.version == QUEUE_FILE_VERSION && probe.slotSize == sizeof(RingSlot) && probe.capacity > 0 &&
+            probe.head <= probe.tail && probe.tail - probe.head <= probe.capacity &&
+            (size_t)st.st_size >= sizeof(RingFileHeader) + (size_t)probe.capacity * sizeof(RingSlot)) {
+            bytes = sizeof(RingFileHeader) + (size_t)probe.capacity * sizeof(RingSlot);
+        } else {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Queue file is not a valid ring, reinitializing it.");
+            fresh = 1;
+        }
+    } else {
+        fresh = 1;
+    }
+
+    if (fresh && ftruncate(fd, (off_t)bytes) != 0) {
+        close(fd);
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot size queue file, using an in-memory queue.");
+        return -1;
+    }
+    hdr = (RingFileHeader*) mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);                                                          // The mapping keeps the file referenced
+    if (hdr == MAP_FAILED) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot map queue file, using an in-memory queue.");
+        return -1;
+    }
+
+    if (fresh) {
+        hdr->magic = 0;                                                 // Invalid until fully initialized
+        hdr->version = QUEUE_FILE_VERSION;
+        hdr->capacity = (unsigned int)size;
+        hdr->slotSize = sizeof(RingSlot);
+        hdr->head = hdr->tail = 0;
+        msync(hdr, sizeof(*hdr), MS_SYNC);
+        __atomic_store_n(&hdr->magic, QUEUE_FILE_MAGIC, __ATOMIC_RELEASE);
+        msync(hdr, sizeof(*hdr), MS_SYNC);
+    }
+
+    q->ring = hdr;
+    q->slots = (RingSlot*) (hdr + 1);
+    q->ringBytes = bytes;
+    q->ringPath = path;
+    snprintf(msg, sizeof(msg), "Queue file %s attached: capacity=%u head=%llu tail=%llu%s", path,
+             hdr->capacity, hdr->head, hdr->tail, fresh ? " (new)" : "");
+    log_message(msg);
+    return 0;
+}
+
+static __thread RingSlot *ringStaging = NULL;                           // Frames encoded or decoded outside the queue lock
+static __thread int ringStagingSlots = 0;
+
+/********************************************************
+ * @fn                        -ring_staging
+ *
+ * @brief                     -Calling thread's staging buffer for ring frames, grown to at least count slots
+ *
+ * @param[in]                 count   Number of frames needed
+ *
+ * @return                    Buffer, or NULL if it cannot be grown
+ ********************************************************/
+static RingSlot *ring_staging(int count) {
+    if (count > ringStagingSlots) {
+        RingSlot *grown = (RingSlot*) realloc(ringStaging, (size_t) count * sizeof(RingSlot));
+        if (grown == NULL)
+            return NULL;
+        ringStaging = grown;
+        ringStagingSlots = count;
+    }
+    return ringStaging;
+}
+
+/********************************************************
+ * @fn                        -queue_file_stage
+ *
+ * @brief                     -Encode a packet into a ring frame, without the queue lock
+ *
+ * @param[in]                 packet  Packet to encode; its buffer stays with the caller
+ * @param[out]                slot    Frame buffer, a staging slot or the ring slot itself
+ *
+ * @return                    -none
+ * @note                      With a dictionary loaded (-z) payloads are stored compressed, so a slot holds more
+ *                            than QUEUE_SLOT_PAYLOAD bytes of compressible text. Payloads that still do not fit
+ *                            are truncated.
+ ********************************************************/
+static void queue_file_stage(const DataPacket *packet, RingSlot *slot) {
+    if (wire_encode_packed(packet, slot, sizeof(RingSlot)) < 0) {       // The slot holds the packet's wire frame
+        DataPacket truncated = *packet;
+        log_message_level(LOG_LEVEL_ERROR, "Error: Packet truncated to the queue file slot size.");
+        truncated.size = QUEUE_SLOT_PAYLOAD;
+        wire_encode_packed(&truncated, slot, sizeof(RingSlot));
+    }
+    if (payloadDict.size > 0) {
+        __atomic_fetch_add(&compressRawBytes, (unsigned long) packet->size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&compressPackedBytes, (unsigned long) slot->hdr.length, __ATOMIC_RELAXED);
+    }
+}
+
+/********************************************************
+ * @fn                        -queue_file_push
+ *
+ * @brief                     -Append one packet to the ring file (queue lock held, free slot reserved)
+ *
+ * @param[in]                 q       Pointer to a file-backed Queue
+ * @param[in]                 packet  Packet the slot is for, with its eventId assigned
+ * @param[in]                 staged  Its frame from queue_file_stage, or NULL to encode it here
+ *
+ * @return                    -none
+ * @note                      A staged frame is copied in and only its event id is stamped, which redoes the
+ *                            checksum but not the compression.
+ ********************************************************/
+static void queue_file_push(Queue *q, const DataPacket *packet, const RingSlot *staged) {
+    unsigned long long tail = q->ring->tail;
+    RingSlot *slot = &q->slots[tail % q->ring->capacity];
+
+    if (staged == NULL) {
+        queue_file_stage(packet, slot);                                 // No staging buffer: encode under the lock
+    } else {
+        memcpy(slot, staged, WIRE_FRAME_SIZE(staged->hdr.length));
+        wire_restamp(&slot->hdr, packet->eventId);                      // Ids follow queue order, so only known here
+    }
+#if QUEUE_FILE_SYNC
+    msync((void*) ((unsigned long) slot & ~4095UL), (unsigned long) (slot + 1) - ((unsigned long) slot & ~4095UL), MS_SYNC);
+#endif
+    __atomic_store_n(&q->ring->tail, tail + 1, __ATOMIC_RELEASE);       // Publish only after the slot is complete
+}
+
+/********************************************************
+ * @fn                        -queue_file_take
+ *
+ * @brief                     -Remove the oldest frame from the ring file (queue lock held, ring not empty)
+ *
+ * @param[in]                 q       Pointer to a file-backed Queue
+ * @param[out]                frame   Receives a copy of the slot, for queue_file_decode after unlocking
+ *
+ * @return                    -none
+ ********************************************************/
+static void queue_file_take(Queue *q, RingSlot *frame) {
+    unsigned long long head = q->ring->head;
+
+    memcpy(frame, &q->slots[head % q->ring->capacity], sizeof(RingSlot));
+    __atomic_store_n(&q->ring->head, head + 1, __ATOMIC_RELEASE);       // Release the slot only after copying it out
+}
+
+/********************************************************
+ * @fn                        -queue_file_untake
+ *
+ * @brief                     -Put frames back at the head of the ring file (queue lock held)
+ *
+ * @param[in]                 q       Pointer to a file-backed Queue
+ * @param[in]                 frames  Frames from queue_file_take, oldest first
+ * @param[in]                 count   Number of frames
+ *
+ * @return                    0 on success, -1 if the ring has no room left for them
+ * @note                      Their slots were never released to writers, so there is room unless the ring was
+ *                            replaced by a smaller one in the meantime.
+ ********************************************************/
+static int queue_file_untake(Queue *q, const RingSlot *frames, int count) {
+    unsigned long long head = q->ring->head - count;
+    int i;
+
+    if (q->ring->tail - q->ring->head + count > q->ring->capacity)
+        return -1;
+    for (i = 0; i < count; i++)
+        memcpy(&q->slots[(head + i) % q->ring->capacity], &frames[i], sizeof(RingSlot));
+    __atomic_store_n(&q->ring->head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -queue_file_decode
+ *
+ * @brief                     -Turn a frame taken from the ring file into a packet, without the queue lock
+ *
+ * @param[in]                 frame   Frame from queue_file_take
+ * @param[out]                packet  Receives the packet with a freshly allocated data buffer
+ *
+ * @return                    0 on success, -1 if no buffer could be allocated (the caller puts the frame back)
+ * @note                      The frame is verified by wire_decode. A corrupt slot (for example torn by a power
+ *                            loss without QUEUE_FILE_SYNC) is handed out as an empty packet, which readers skip.
+ *                            Compressed payloads are decompressed straight into the packet's buffer, in place
+ *                            of the copy.
+ ********************************************************/
+static int queue_file_decode(const RingSlot *frame, DataPacket *packet) {
+    int compressed, size;
+    DataPacket view;
+    char *data;
+
+    memset(packet, 0, sizeof(*packet));
+    if (wire_decode(frame, sizeof(RingSlot), &view) > 0) {
+        compressed = (view.flags & PACKET_FLAG_COMPRESSED) != 0;
+        size = compressed ? (int) frame->hdr.rawLength : view.size;
+        data = (char*) malloc(size > 0 ? size : 1);
+        if (data == NULL)
+            return -1;
+        if (!compressed)
+            memcpy(data, view.data, size);
+        else if (lz_decompress(&payloadDict, view.data, view.size, data, size) != size)
+            size = -1;
+        if (size >= 0) {
+            *packet = view;
+            packet->data = data;
+            packet->size = size;
+            packet->flags &= ~(PACKET_FLAG_BORROWED | PACKET_FLAG_COMPRESSED);
+        } else {
+            free(data);
+            log_message_level(LOG_LEVEL_ERROR, "Error: Undecodable queue file slot dropped.");
+        }
+    } else {
+        log_message_level(LOG_LEVEL_ERROR, "Error: Corrupt queue file slot dropped.");
+    }
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -queue_ring_migrate
+ *
+ * @brief                     -Move a file-backed ring to a new file with a different number of slots
+ *
+ * @param[in]                 q      Pointer to a file-backed Queue
+ * @param[in]                 slots  New slot count
+ *
+ * @return                    0 on success, 1 if the queue no longer fits in slots, -1 on failure (the old ring
+ *                            stays in use in both cases)
+ * @note                      Called without the queue lock and only with controlLock held (queue_resize,
+ *                            queue_ring_poll), so the ring is never replaced underneath it. Pending slots keep
+ *                            their positions (head and tail are monotonic, so event ids still continue across
+ *                            restarts). The new file is created, filled and synced while writers and readers
+ *                            keep using the old ring: pending slots are never overwritten. The queue lock is
+ *                            only held to copy the slots that changed meanwhile, sync them and rename the new
+ *                            file over the old one. A crash leaves either the old or the new ring, never a mix.
+ ********************************************************/
+static int queue_ring_migrate(Queue *q, int slots) {
+    size_t bytes = sizeof(RingFileHeader) + (size_t)slots * sizeof(RingSlot);
+    size_t oldBytes = q->ringBytes;
+    RingFileHeader *old = q->ring, *hdr;
+    RingSlot *to;
+    unsigned long long head, tail, pos;
+    char tmp[PATH_MAX], msg[200];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.resize", q->ringPath);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)bytes) != 0) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot create resized queue file.");
+        if (fd >= 0) close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    hdr = (RingFileHeader*) mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot map resized queue file.");
+        unlink(tmp);
+        return -1;
+    }
+
+    hdr->magic = 0;                                                     // Invalid until fully written
+    hdr->version = QUEUE_FILE_VERSION;
+    hdr->capacity = (unsigned int)slots;
+    hdr->slotSize = sizeof(RingSlot);
+    to = (RingSlot*) (hdr + 1);
+    pthread_mutex_lock(&q->lock);
+    head = old->head;
+    tail = old->tail;
+    pthread_mutex_unlock(&q->lock);
+    if (tail - head <= (unsigned long long)slots) {
+        for (pos = head; pos != tail; pos++)                            // The bulk, without the queue lock
+            memcpy(&to[pos % (unsigned int)slots], &q->slots[pos % old->capacity], sizeof(RingSlot));
+        msync(hdr, bytes, MS_SYNC);
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if (old->tail - old->head > (unsigned long long)slots ||
+        (unsigned long long)q->capacity + q->debt > (unsigned long long)slots) {
+        pthread_mutex_unlock(&q->lock);
+        munmap(hdr, bytes);
+        unlink(tmp);
+        return 1;                                                       // Writers may push more than it holds
+    }
+    for (pos = old->head; pos < head; pos++)                            // Put back by queue_file_untake meanwhile
+        memcpy(&to[pos % (unsigned int)slots], &q->slots[pos % old->capacity], sizeof(RingSlot));
+    for (pos = (old->head > tail) ? old->head : tail; pos != old->tail; pos++) // Pushed meanwhile
+        memcpy(&to[pos % (unsigned int)slots], &q->slots[pos % old->capacity], sizeof(RingSlot));
+    hdr->head = old->head;
+    hdr->tail = old->tail;
+    msync(hdr, bytes, MS_SYNC);                                         // Only pages dirtied since the bulk sync
+    __atomic_store_n(&hdr->magic, QUEUE_FILE_MAGIC, __ATOMIC_RELEASE);
+    msync(hdr, sizeof(*hdr), MS_SYNC);
+    if (rename(tmp, q->ringPath) != 0) {
+        pthread_mutex_unlock(&q->lock);
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot replace queue file with the resized one.");
+        munmap(hdr, bytes);
+        unlink(tmp);
+        return -1;
+    }
+    snprintf(msg, sizeof(msg), "Queue file %s resized: slots=%u -> %d head=%llu tail=%llu", q->ringPath,
+             old->capacity, slots, hdr->head, hdr->tail);
+    q->ring = hdr;
+    q->slots = to;
+    q->ringBytes = bytes;
+    pthread_mutex_unlock(&q->lock);
+
+    munmap(old, oldBytes);                                              // Readers only copy slots under the lock
+    log_message(msg);
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -queue_ring_poll
+ *
+ * @brief                     -Shrink a file-backed ring once the queue's capacity allows it
+ *
+ * @param[in]                 q       Pointer to the Queue structure
+ * @param[in]                 nowNs   Current time
+ *
+ * @return                    -none
+ * @note                      Called with controlLock held, every tick of the control thread and by
+ *                            queue_resize. The ring must hold every pending packet and every slot writers may
+ *                            still reserve, so it waits until the debt is paid off; an attempt that failed is
+ *                            retried after QUEUE_RING_RETRY_NS.
+ ********************************************************/
+void queue_ring_poll(Queue *q, unsigned long long nowNs) {
+    unsigned long long pending;
+    int slots = 0;
+
+    if (q->ring == NULL || nowNs < q->ringRetryNs)
+        return;
+    pthread_mutex_lock(&q->lock);
+    pending = q->ring->tail - q->ring->head;
+    if (q->debt == 0 && q->ring->capacity > (unsigned int)q->capacity && q->ring->capacity > pending)
+        slots = (pending > (unsigned long long)q->capacity) ? (int)pending : q->capacity;
+    pthread_mutex_unlock(&q->lock);
+    if (slots > 0 && queue_ring_migrate(q, slots) < 0)
+        q->ringRetryNs = nowNs + QUEUE_RING_RETRY_NS;                   // 1 (the queue moved) is retried next tick
+}
+
+/********************************************************
+ * @fn                        -queue_resize
+ *
+ * @brief                     -Change the capacity of a live queue
+ *
+ * @param[in]                 q     Pointer to the Queue structure
+ * @param[in]                 size  New capacity (at least 1)
+ *
+ * @return                    0 on success, -1 if a file-backed ring could not be grown (capacity unchanged)
+ * @note                      Capacity is the number of 'empty' slots writers can reserve, so no packet moves:
+ *                            growing pays off debt first and posts the rest, shrinking takes the free slots
+ *                            that are available right now and records the remainder as debt, which later
+ *                            dequeues pay back instead of releasing slots. Capacity and debt change in one
+ *                            critical section. Writers already blocked stay blocked until the queue drains
+ *                            below the new capacity; nothing is lost or reordered. A file-backed ring must hold
+ *                            every packet a writer may still push (capacity plus debt): it is grown at once and
+ *                            shrunk by queue_ring_poll once the debt is paid off. Called with controlLock held.
+ ********************************************************/
+int queue_resize(Queue *q, int size) {
+    int delta, paid = 0, taken = 0, slots;
+    char msg[120];
+
+    if (size < 1)
+        size = 1;
+    pthread_mutex_lock(&q->lock);
+    while (q->ring != NULL && size > q->capacity) {
+        slots = (q->capacity + q->debt > size) ? q->capacity + q->debt : size; // Debt is paid out of the growth first
+        if (q->ring->capacity >= (unsigned int)slots)
+            break;
+        pthread_mutex_unlock(&q->lock);
+        if (queue_ring_migrate(q, slots) < 0)
+            return -1;
+        pthread_mutex_lock(&q->lock);                                   // Look again: the debt may have grown
+    }
+    delta = size - q->capacity;
+    if (delta > 0) {
+        paid = (q->debt < delta) ? q->debt : delta;
+        q->debt -= paid;
+    } else {
+        while (taken < -delta && sem_trywait(&q->empty) == 0)
+            taken++;                                                    // Free slots withdrawn immediately
+        q->debt += -delta - taken;                                      // The rest as packets leave
+    }
+    q->capacity = size;
+    pthread_mutex_unlock(&q->lock);
+
+    if (delta > 0) {
+        for (taken = paid; taken < delta; taken++)
+            sem_post(&q->empty);                                        // New free slots for writers
+    } else if (delta < 0) {
+        queue_ring_poll(q, now_ns());                                   // At once if nothing is owed
+    }
+    snprintf(msg, sizeof(msg), "Queue resized: capacity=%d (%+d)", size, delta);
+    log_message(msg);
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -crc32c
+ *
+ * @brief                     -CRC32C (Castagnoli) checksum
+ *
+ * @param[in]                 crc   Running value, 0 to start
+ * @param[in]                 buf   Bytes to add
+ * @param[in]                 len   Number of bytes
+ *
+ * @return                    Updated checksum
+ * @note                      Uses the SSE4.2 crc32 instruction 8 bytes at a time when the CPU has it, and a
+ *                            table otherwise. Both produce the same values.
+ ********************************************************/
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *p, size_t len) {
+    unsigned long long c = ~crc;
+
+    while (len > 0 && ((unsigned long) p & 7)) {
+        c = __builtin_ia32_crc32qi((unsigned int) c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        c = __builtin_ia32_crc32di(c, *(const unsigned long long*) p);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        c = __builtin_ia32_crc32qi((unsigned int) c, *p++);
+    return ~(unsigned int) c;
+}
+#endif
+
+static unsigned int crc32cTable[256];
+
+static void crc32c_table_init(void) {
+    unsigned int i, j;
+    for (i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (j = 0; j < 8; j++)
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78U : c >> 1;
+        crc32cTable[i] = c;
+    }
+}
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len) {
+    static pthread_once_t tableOnce = PTHREAD_ONCE_INIT;
+    const unsigned char *p = (const unsigned char*) buf;
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32c_hw(crc, p, len);
+#endif
+    pthread_once(&tableOnce, crc32c_table_init);
+    crc = ~crc;
+    while (len-- > 0)
+        crc = crc32cTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/********************************************************
+ * @fn                        -lz_hash
+ *
+ * @brief                     -Hash the 4 bytes at p into the match finder table
+ ********************************************************/
+static inline unsigned int lz_hash(const unsigned char *p) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/********************************************************
+ * @fn                        -lz_match
+ *
+ * @brief                     -Length of the common prefix of a and b, at most max bytes
+ ********************************************************/
+static inline int lz_match(const unsigned char *a, const unsigned char *b, int max) {
+    int n = 0;
+
+    while (n + 8 <= max) {
+        unsigned long long x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y)
+            return n + (__builtin_ctzll(x ^ y) >> 3);
+        n += 8;
+    }
+    while (n < max && a[n] == b[n])
+        n++;
+    return n;
+}
+
+/********************************************************
+ * @fn                        -lz_put_length
+ *
+ * @brief                     -Append the part of a length that did not fit its 4-bit token field
+ ********************************************************/
+static inline unsigned char *lz_put_length(unsigned char *op, int len) {
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+/********************************************************
+ * @fn                        -lz_compress
+ *
+ * @brief                     -Compress a buffer, optionally against a shared dictionary
+ *
+ * @param[in]                 d     Dictionary, or NULL (or an empty one) for plain LZ
+ * @param[in]                 src   Bytes to compress
+ * @param[in]                 len   Number of bytes
+ * @param[out]                dst   Destination
+ * @param[in]                 cap   Capacity of dst; pass less than len to only accept output that saves space
+ *
+ * @return                    Compressed size, or -1 if it does not fit in cap
+ * @note                      LZ77 in sequences of a token byte (literal and match length nibbles, 15 meaning
+ *                            "more bytes follow"), the literals, a 16-bit little-endian offset and the rest of
+ *                            the match length. The last sequence has literals only. Offsets reach back into the
+ *                            dictionary as if it preceded src, which is what makes short payloads compress.
+ *                            Single pass with one hash probe per position; the per-thread table is invalidated
+ *                            by a generation stamp instead of being cleared on every call.
+ ********************************************************/
+long lz_compress(const PayloadDictionary *d, const void *src, int len, void *dst, int cap) {
+    static __thread unsigned long long table[1 << LZ_HASH_BITS];        // generation << 32 | input position
+    static __thread unsigned long long generation = 0;
+    const unsigned char *in = (const unsigned char*) src;
+    const unsigned char *dict = (const unsigned char*) (d != NULL ? d->data : NULL);
+    int dictSize = d != NULL ? d->size : 0;
+    unsigned char *op = (unsigned char*) dst, *end = op + cap;
+    int ip = 0, anchor = 0, limit = len - LZ_MIN_MATCH - 4, lit;
+
+    if (++generation == 1ULL << 32) {
+        memset(table, 0, sizeof(table));
+        generation = 1;
+    }
+    while (ip < limit) {
+        unsigned int h = lz_hash(in + ip);
+        int offset = 0, n = 0;
+
+        if (table[h] >> 32 == generation) {                             // Earlier in this input
+            int ref = (int)(unsigned int) table[h];
+            if (ip - ref <= LZ_MAX_OFFSET) {
+                n = lz_match(in + ref, in + ip, len - ip);
+                offset = ip - ref;
+            }
+        } else if (dictSize > 0 && d->table[h] != 0) {                  // In the dictionary, which then runs into src
+            int ref = d->table[h] - 1;
+            if (ip + dictSize - ref <= LZ_MAX_OFFSET) {
+                n = lz_match(dict + ref, in + ip, dictSize - ref < len - ip ? dictSize - ref : len - ip);
+                if (n == dictSize - ref)
+                    n += lz_match(in, in + ip + n, len - ip - n);
+                offset = ip + dictSize - ref;
+            }
+        }
+        table[h] = generation << 32 | (unsigned int) ip;
+        if (n < LZ_MIN_MATCH) {
+            ip += 1 + ((ip - anchor) >> 5);                             // Skip faster through incompressible input
+            continue;
+        }
+
+        lit = ip - anchor;
+        if (end - op < 1 + lit + lit / 255 + 2 + (n - LZ_MIN_MATCH) / 255 + 1)
+            return -1;
+        *op = (unsigned char)(((lit < 15 ? lit : 15) << 4) | (n - LZ_MIN_MATCH < 15 ? n - LZ_MIN_MATCH : 15));
+        op++;
+        if (lit >= 15)
+            op = lz_put_length(op, lit);
+        memcpy(op, in + anchor, lit);
+        op += lit;
+        *op++ = (unsigned char) offset;
+        *op++ = (unsigned char)(offset >> 8);
+        if (n - LZ_MIN_MATCH >= 15)
+            op = lz_put_length(op, n - LZ_MIN_MATCH);
+        ip += n;
+        anchor = ip;
+        if (ip - 2 < limit && ip >= 2) {
+            h = lz_hash(in + ip - 2);                                   // Let the next match start inside this one
+            table[h] = generation << 32 | (unsigned int)(ip - 2);
+        }
+    }
+
+    lit = len - anchor;                                                 // Trailing literals
+    if (end - op < 1 + lit + lit / 255 + 1)
+        return -1;
+    *op++ = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15)
+        op = lz_put_length(op, lit);
+    memcpy(op, in + anchor, lit);
+    op += lit;
+    return (long)(op - (unsigned char*) dst);
+}
+
+/********************************************************
+ * @fn                        -lz_decompress
+ *
+ * @brief                     -Decompress the output of lz_compress
+ *
+ * @param[in]                 d     Dictionary the input was compressed with, or NULL
+ * @param[in]                 src   Compressed bytes
+ * @param[in]                 len   Number of compressed bytes
+ * @param[out]                dst   Destination for the original bytes
+ * @param[in]                 cap   Capacity of dst
+ *
+ * @return                    Decompressed size, or -1 if the input is malformed or does not fit
+ * @note                      Writes straight into dst with no staging buffer. Every length and offset is
+ *                            checked before use, so corrupt input cannot read or write out of bounds.
+ ********************************************************/
+long lz_decompress(const PayloadDictionary *d, const void *src, int len, void *dst, int cap) {
+    const unsigned char *ip = (const unsigned char*) src, *iend = ip + len;
+    const unsigned char *dict = (const unsigned char*) (d != NULL ? d->data : NULL);
+    long dictSize = d != NULL ? d->size : 0;
+    unsigned char *out = (unsigned char*) dst, *op = out, *oend = out + cap;
+
+    for (;;) {
+        long lit, n, offset;
+        unsigned char token, b;
+
+        if (ip >= iend)
+            return -1;
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);                                         // Short run: one fixed-size copy, excess overwritten later
+        } else {
+            memcpy(op, ip, lit);
+        }
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;                                                      // Literal-only last sequence
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        n = token & 15;
+        if (n == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                n += b;
+            } while (b == 255);
+        }
+        n += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (op - out) + dictSize || n > oend - op)
+            return -1;
+
+        if (offset > op - out) {                                        // Starts in the dictionary
+            long from = dictSize - (offset - (op - out));
+            long part = dictSize - from < n ? dictSize - from : n;
+            if (part <= 16 && from + 16 <= DICT_SIZE && oend - op >= 16)
+                memcpy(op, dict + from, 16);                            // dict is a DICT_SIZE array
+            else
+                memcpy(op, dict + from, part);
+            op += part;
+            n -= part;
+            offset = op - out;                                          // Continues at the start of the output
+        }
+        if (offset >= 8 && oend - op >= n + 8) {
+            unsigned char *mend = op + n;
+            do {                                                        // 8 bytes at a time, may run past mend
+                memcpy(op, op - offset, 8);
+                op += 8;
+            } while (op < mend);
+            op = mend;
+        } else if (offset >= n) {
+            memcpy(op, op - offset, n);
+            op += n;
+        } else {
+            while (n-- > 0) {                                           // Overlapping copy repeats the pattern
+                *op = *(op - offset);
+                op++;
+            }
+        }
+    }
+    return (long)(op - out);
+}
+
+/********************************************************
+ * @fn                        -payload_dict_index
+ *
+ * @brief                     -Compute the id and match finder table of a dictionary
+ *
+ * @param[in,out]             d   Dictionary whose data and size are set
+ *
+ * @return                    -none
+ * @note                      Later positions overwrite earlier ones, so matches use the shortest offsets.
+ ********************************************************/
+static void payload_dict_index(PayloadDictionary *d) {
+    int i;
+
+    memset(d->table, 0, sizeof(d->table));
+    for (i = 0; i + 4 <= d->size; i++)
+        d->table[lz_hash((const unsigned char*) d->data + i)] = (unsigned short)(i + 1);
+    d->id = crc32c(0, d->data, d->size);
+}
+
+/********************************************************
+ * @fn                        -payload_dict_train
+ *
+ * @brief                     -Build a dictionary from sample payload bytes
+ *
+ * @param[out]                d        Dictionary to fill in
+ * @param[in]                 sample   Representative payload bytes
+ * @param[in]                 len      Number of sample bytes (at most DICT_SAMPLE are used)
+ *
+ * @return                    -none
+ * @note                      Counts every 8-byte substring of the sample, then splits the sample into one epoch
+ *                            per dictionary segment and takes from each epoch the DICT_SEGMENT bytes whose
+ *                            substrings are most frequent overall. Substrings already taken stop scoring, so
+ *                            segments do not repeat each other. Linear in the sample size.
+ ********************************************************/
+void payload_dict_train(PayloadDictionary *d, const char *sample, size_t len) {
+    unsigned int *counts = (unsigned int*) calloc(1 << 16, sizeof(unsigned int));
+    unsigned short *kmer;
+    size_t segments = DICT_SIZE / DICT_SEGMENT, epoch, i, s;
+
+    if (len > DICT_SAMPLE)
+        len = DICT_SAMPLE;
+    epoch = len / segments;
+    kmer = (unsigned short*) malloc(len * sizeof(unsigned short));
+    if (counts == NULL || kmer == NULL || epoch < DICT_SEGMENT) {       // Too little to choose from: use the sample
+        d->size = (int)(len < DICT_SIZE ? len : DICT_SIZE);
+        memcpy(d->data, sample + len - d->size, d->size);
+        payload_dict_index(d);
+        free(counts);
+        free(kmer);
+        return;
+    }
+
+    for (i = 0; i + 8 <= len; i++) {
+        unsigned long long v;
+        memcpy(&v, sample + i, 8);
+        kmer[i] = (unsigned short)((v * 0x9E3779B97F4A7C15ULL) >> 48);
+        counts[kmer[i]]++;
+    }
+    for (s = 0; s < segments; s++) {
+        size_t start = s * epoch, last = start + epoch - DICT_SEGMENT, best = start, p;
+        unsigned long long score = 0, bestScore;
+        for (p = start; p + 8 <= start + DICT_SEGMENT; p++)
+            score += counts[kmer[p]];
+        bestScore = score;
+        for (p = start + 1; p <= last; p++) {                           // Slide the window by one byte
+            score += counts[kmer[p + DICT_SEGMENT - 8]];
+            score -= counts[kmer[p - 1]];
+            if (score > bestScore) {
+                bestScore = score;
+                best = p;
+            }
+        }
+        memcpy(d->data + s * DICT_SEGMENT, sample + best, DICT_SEGMENT);
+        for (p = best; p + 8 <= best + DICT_SEGMENT; p++)
+            counts[kmer[p]] = 0;
+    }
+    d->size = (int)(segments * DICT_SEGMENT);
+    payload_dict_index(d);
+    free(counts);
+    free(kmer);
+}
+
+/********************************************************
+ * @fn                        -payload_dict_open
+ *
+ * @brief                     -Load the shared dictionary from a file, training and saving it if needed
+ *
+ * @param[in]                 path   Dictionary file
+ *
+ * @return                    0 on success, -1 if no dictionary could be loaded or trained
+ * @note                      Called by main after corpus_init and before any thread starts. Files written
+ *                            with compression (ring file, columnar sink) can only be read with the same
+ *                            dictionary, so it is kept next to them instead of being retrained on every start.
+ *                            Without a corpus (the merge tool) an existing file is only loaded, never retrained.
+ ********************************************************/
+int payload_dict_open(const char *path) {
+    PayloadDictionary *d = &payloadDict;
+    DictFileHeader hdr;
+    char msg[200], tmp[PATH_MAX];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == DICT_MAGIC && hdr.size > 0 &&
+            hdr.size <= DICT_SIZE && read(fd, d->data, hdr.size) == (ssize_t) hdr.size) {
+            d->size = (int) hdr.size;
+            payload_dict_index(d);
+        }
+        close(fd);
+        if (d->size > 0 && d->id == hdr.id) {
+            snprintf(msg, sizeof(msg), "Dictionary %s loaded: %d bytes, id %08x.", path, d->size, d->id);
+            log_message(msg);
+            return 0;
+        }
+        d->size = 0;
+        log_message_level(LOG_LEVEL_ERROR, "Error: Dictionary file is invalid, retraining it.");
+    }
+    if (payloadCorpus.size == 0) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: No dictionary file and no corpus to train one on.");
+        return -1;
+    }
+
+    payload_dict_train(d, payloadCorpus.base, payloadCorpus.size);
+    hdr.magic = DICT_MAGIC;
+    hdr.size = (unsigned int) d->size;
+    hdr.id = d->id;
+    hdr.reserved = 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || write(fd, d->data, d->size) != d->size ||
+        fsync(fd) != 0 || rename(tmp, path) != 0) {                     // Never leave a half-written dictionary
+        if (fd >= 0) close(fd);
+        unlink(tmp);
+        d->size = 0;
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot save dictionary file, compression disabled.");
+        return -1;
+    }
+    close(fd);
+    snprintf(msg, sizeof(msg), "Dictionary %s trained: %d bytes, id %08x.", path, d->size, d->id);
+    log_message(msg);
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -wire_header_crc
+ *
+ * @brief                     -Checksum of a frame header, every byte except the checksum field itself
+ *
+ * @param[in]                 hdr        First sizeof(WireHeader) bytes of the header
+ * @param[in]                 ext        Header words beyond WireHeader (from a newer writer), or NULL
+ * @param[in]                 extBytes   Length of ext
+ *
+ * @return                    Running CRC32C to continue over the payload
+ * @note                      Compressed frames seed it with the dictionary id.
+ ********************************************************/
+static unsigned int wire_header_crc(const WireHeader *hdr, const void *ext, size_t extBytes) {
+    unsigned int crc = crc32c((hdr->flags & PACKET_FLAG_COMPRESSED) ? payloadDict.id : 0, hdr,
+                              offsetof(WireHeader, checksum));
+
+    crc = crc32c(crc, &hdr->eventId, sizeof(WireHeader) - offsetof(WireHeader, eventId));
+    return extBytes ? crc32c(crc, ext, extBytes) : crc;
+}
+
+/********************************************************
+ * @fn                        -wire_finish
+ *
+ * @brief                     -Write the header of a frame whose payload is already in place
+ *
+ * @param[out]                hdr         Frame header; the payload follows it
+ * @param[in]                 packet      Packet the frame carries
+ * @param[in]                 length      Payload bytes in the frame
+ * @param[in]                 rawLength   Uncompressed length for a compressed payload, 0 otherwise
+ * @param[in]                 flags       PACKET_FLAG_* bits to store
+ *
+ * @return                    Frame size in bytes
+ * @note                      Zeroes the padding. Compressed frames seed the checksum with the dictionary id,
+ *                            so a frame read back with a different dictionary fails validation.
+ ********************************************************/
+static long wire_finish(WireHeader *hdr, const DataPacket *packet, unsigned int length, unsigned int rawLength,
+                        unsigned int flags) {
+    size_t frame = WIRE_FRAME_SIZE(length);
+    char *payload = (char*) (hdr + 1);
+    unsigned int crc;
+
+    memset(payload + length, 0, frame - sizeof(WireHeader) - length);
+    hdr->magic = WIRE_MAGIC;
+    hdr->version = WIRE_VERSION;
+    hdr->headerWords = sizeof(WireHeader) / 8;
+    hdr->flags = flags & ~PACKET_FLAG_BORROWED;                         // Ownership does not travel
+    hdr->length = length;
+    hdr->eventId = packet->eventId;
+    hdr->eventCorrelationId = packet->eventCorrelationId;
+    hdr->timestamp = packet->timestamp;
+    hdr->source = packet->source;
+    hdr->rawLength = rawLength;
+    crc = wire_header_crc(hdr, NULL, 0);
+    hdr->checksum = crc32c(crc, payload, length);
+    return (long) frame;
+}
+
+/********************************************************
+ * @fn                        -wire_restamp
+ *
+ * @brief                     -Change the event id of an encoded frame
+ *
+ * @param[in,out]             hdr       Header of a frame written by wire_finish; the payload follows it
+ * @param[in]                 eventId   New event id
+ *
+ * @return                    -none
+ * @note                      Only the checksum is redone, so a payload compressed ahead of time stays as it is.
+ ********************************************************/
+void wire_restamp(WireHeader *hdr, unsigned long long eventId) {
+    hdr->eventId = eventId;
+    hdr->checksum = crc32c(wire_header_crc(hdr, NULL, 0), hdr + 1, hdr->length);
+}
+
+/********************************************************
+ * @fn                        -wire_encode
+ *
+ * @brief                     -Serialize a packet into a binary wire frame
+ *
+ * @param[in]                 packet   Packet to serialize (contiguous, chunked or borrowed payload)
+ * @param[out]                buf      Destination, ideally WIRE_ALIGN-aligned
+ * @param[in]                 cap      Capacity of buf in bytes
+ *
+ * @return                    Frame size in bytes (WIRE_FRAME_SIZE of the payload), or -1 if buf is too small
+ * @note                      The payload is copied once, straight from its chunks; the header is written in
+ *                            place and the padding is zeroed so frames are byte-for-byte reproducible.
+ ********************************************************/
+long wire_encode(const DataPacket *packet, void *buf, size_t cap) {
+    WireHeader *hdr = (WireHeader*) buf;
+    char *payload = (char*) (hdr + 1);
+
+    if (packet->size < 0 || WIRE_FRAME_SIZE(packet->size) > cap)
+        return -1;
+
+    if (packet->chain != NULL) {
+        const Chunk *c;
+        int off = 0;
+        for (c = packet->chain; c != NULL && off < packet->size; c = c->next) {
+            int n = (c->len < packet->size - off) ? c->len : packet->size - off;
+            memcpy(payload + off, c->data, n);                          // Gather the chain
+            off += n;
+        }
+    } else if (packet->size > 0) {
+        memcpy(payload, packet->data, packet->size);
+    }
+    return wire_finish(hdr, packet, (unsigned int) packet->size, 0, packet->flags & ~PACKET_FLAG_COMPRESSED);
+}
+
+/********************************************************
+ * @fn                        -wire_encode_packed
+ *
+ * @brief                     -Serialize a packet, compressing its payload with the shared dictionary
+ *
+ * @param[in]                 packet   Packet to serialize
+ * @param[out]                buf      Destination, ideally WIRE_ALIGN-aligned
+ * @param[in]                 cap      Capacity of buf in bytes
+ *
+ * @return                    Frame size in bytes, or -1 if buf is too small
+ * @note                      The payload is compressed straight into the frame. Falls back to wire_encode when
+ *                            no dictionary is loaded, the payload is short or compression would not save
+ *                            space. Chunked payloads are gathered into a stack buffer first.
+ ********************************************************/
+long wire_encode_packed(const DataPacket *packet, void *buf, size_t cap) {
+    WireHeader *hdr = (WireHeader*) buf;
+    char gather[4096];
+    const char *src = packet->data;
+    size_t room = cap - sizeof(WireHeader);
+    long packed;
+
+    if (payloadDict.size == 0 || packet->size < LZ_MIN_INPUT || cap <= sizeof(WireHeader) ||
+        (packet->chain != NULL && packet->size > (int) sizeof(gather)))
+        return wire_encode(packet, buf, cap);
+    if (packet->chain != NULL) {
+        const Chunk *c;
+        int off = 0;
+        for (c = packet->chain; c != NULL && off < packet->size; c = c->next) {
+            int n = (c->len < packet->size - off) ? c->len : packet->size - off;
+            memcpy(gather + off, c->data, n);
+            off += n;
+        }
+        src = gather;
+    }
+    if (room > (size_t) packet->size - 1)
+        room = (size_t) packet->size - 1;                               // Only keep output that saves space
+    packed = lz_compress(&payloadDict, src, packet->size, hdr + 1, (int)(room & ~(size_t)(WIRE_ALIGN - 1)));
+    if (packed < 0)
+        return wire_encode(packet, buf, cap);                           // Incompressible: store it as is
+    return wire_finish(hdr, packet, (unsigned int) packed, (unsigned int) packet->size,
+                       packet->flags | PACKET_FLAG_COMPRESSED);
+}
+
+/********************************************************
+ * @fn                        -wire_decode
+ *
+ * @brief                     -Validate a wire frame and view it as a DataPacket without copying
+ *
+ * @param[in]                 buf      Received bytes, starting at a frame
+ * @param[in]                 len      Number of bytes available in buf
+ * @param[out]                packet   Receives the fields; data points into buf (PACKET_FLAG_BORROWED)
+ *
+ * @return                    Frame size consumed, 0 if buf holds only part of a frame, -1 if the frame is invalid
+ * @note                      Every length is checked against len before it is used, so arbitrary input cannot
+ *                            cause an out-of-bounds read. The checksum covers the whole header and the payload,
+ *                            only the zero padding is outside it. Aligned frames are read in place; unaligned ones have
+ *                            only their header copied. The payload stays valid as long as buf does.
+ *                            A compressed payload is left compressed: the packet has PACKET_FLAG_COMPRESSED and
+ *                            size is the compressed length; the header's rawLength gives the original one.
+ ********************************************************/
+long wire_decode(const void *buf, size_t len, DataPacket *packet) {
+    const WireHeader *hdr = (const WireHeader*) buf;
+    WireHeader copy;
+    size_t headerBytes, frame;
+    const char *payload;
+    unsigned int crc;
+
+    if (len < sizeof(WireHeader))
+        return 0;
+    if ((unsigned long) buf & (WIRE_ALIGN - 1)) {
+        memcpy(&copy, buf, sizeof(copy));                               // Unaligned: read the header from a copy
+        hdr = &copy;
+    }
+    if (hdr->magic != WIRE_MAGIC || hdr->version != WIRE_VERSION)
+        return -1;
+    headerBytes = (size_t) hdr->headerWords * 8;
+    if (headerBytes < sizeof(WireHeader) || hdr->length > INT_MAX)
+        return -1;
+    frame = headerBytes + (((size_t) hdr->length + WIRE_ALIGN - 1) & ~(size_t)(WIRE_ALIGN - 1));
+    if (frame > len)
+        return 0;                                                       // Wait for the rest of the frame
+
+    payload = (const char*) buf + headerBytes;
+    crc = wire_header_crc(hdr, (const char*) buf + sizeof(WireHeader), headerBytes - sizeof(WireHeader));
+    if (crc32c(crc, payload, hdr->length) != hdr->checksum)
+        return -1;
+
+    packet->data = (char*) payload;
+    packet->size = (int) hdr->length;
+    packet->eventId = hdr->eventId;
+    packet->eventCorrelationId = hdr->eventCorrelationId;
+    packet->timestamp = hdr->timestamp;
+    packet->source = hdr->source;
+    packet->chain = NULL;
+    packet->flags = hdr->flags | PACKET_FLAG_BORROWED;
+    return (long) frame;
+}
+
+/********************************************************
+ * @fn                        -enqueue
+ *
+ * @brief                     -Function to push data into the queue
+ *
+ * @param[in]                 q     Pointer to the Queue structure
+ * @param[in]                 data  DataPacket to be enqueued
+ *
+ * @return                    -none
+ * @note                      -none
+ ********************************************************/
+void enqueue(Queue *q, DataPacket data) {
+    enqueue_batch(q, &data, 1);
+}
+
+/********************************************************
+ * @fn                        -enqueue_batch
+ *
+ * @brief                     -Function to push several packets into the queue under one lock acquisition
+ *
+ * @param[in]                 q        Pointer to the Queue structure
+ * @param[in]                 packets  Array of DataPackets to be enqueued, in order
+ * @param[in]                 count    Number of packets in the array
+ *
+ * @return                    -none
+ * @note                      Packets whose node cannot be allocated are dropped and their buffer is freed.
+ *                            Each packet's eventId is assigned here, in the order packets enter the queue.
+ *                            Free slots are claimed and published in runs, so a writer never holds slots it
+ *                            has not filled while it blocks for more (which could deadlock other writers).
+ ********************************************************/
+void enqueue_batch(Queue *q, DataPacket *packets, int count) {
+    Node *first = NULL, *last = NULL;
+    int i, linked = 0;
+
+    for (i = 0; i < count; i++) {
+        Node *newNode = (Node*) malloc(sizeof(Node));                   // Allocate memory for a new node
+        if (newNode == NULL)
+        {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for new node.");
+            packet_free(&packets[i]);                                   // Handle memory allocation failures
+            continue;
+        }
+
+        newNode->packet = packets[i];                                   // Store data packet in the new node
+        newNode->next = NULL;                                           // Set the next pointer of the new node to NULL
+        if (last == NULL) {
+            first = newNode;
+        } else {
+            last->next = newNode;                                       // Chain the batch privately before locking
+        }
+        last = newNode;
+        linked++;
+    }
+    if (linked == 0)
+        return;
+
+    while (first != NULL) {
+        Node *runLast = first;
+        int run = 1;
+
+        if (sem_trywait(&q->empty) != 0) {
+            log_flush();                                                // About to block: do not hold back log lines
+            sem_wait(&q->empty);                                        // Decrement 'empty' semaphore (wait if queue is full)
+        }
+        while (runLast->next != NULL && sem_trywait(&q->empty) == 0) {
+            runLast = runLast->next;                                    // Claim free slots that are already available
+            run++;
+        }
+
+        Node *rest = runLast->next;                                     // Remaining nodes wait for the next run
+        runLast->next = NULL;
+
+        RingSlot *staged = (q->ring != NULL) ? ring_staging(run) : NULL;
+        if (staged != NULL) {
+            Node *n;
+            for (n = first, i = 0; n != NULL; n = n->next, i++)
+                queue_file_stage(&n->packet, &staged[i]);               // Compress before taking the lock
+        }
+
+        pthread_mutex_lock(&q->lock);                                   // Acquire lock before modifying the queue
+        for (Node *n = first; n != NULL; n = n->next)
+            n->packet.eventId = ++q->lastEventId;                       // Event ids follow queue order
+        if (q->ring != NULL) {
+            Node *n;
+            for (n = first, i = 0; n != NULL; n = n->next, i++)
+                queue_file_push(q, &n->packet, staged != NULL ? &staged[i] : NULL); // File-backed: copy the run into ring slots
+        } else if (q->tail == NULL) {                                   // If queue is empty
+            q->head = first;                                            // Set head to the first node of the run
+        } else {
+            q->tail->next = first;                                      // Append the run to the end of the queue
+        }
+        if (q->ring == NULL)
+            q->tail = runLast;                                          // Update the tail pointer
+        q->count += run;                                                // Increment queue element count
+        pthread_mutex_unlock(&q->lock);                                 // Release the lock
+
+        if (q->ring != NULL) {
+            while (first != NULL) {                                     // The ring holds copies; drop the nodes
+                Node *n = first;
+                first = first->next;
+                packet_free(&n->packet);
+                free(n);
+            }
+        }
+        first = rest;
+
+        queue_publish(q, run);                                          // Make the run claimable (signal queue is not empty)
+        for (i = 0; i < run; i++) {
+            log_message_level(LOG_LEVEL_DEBUG, "Data enqueued.");
+        }
+    }
+}
+ 
+/********************************************************
+ * @fn                        -dequeue
+ *
+ * @brief                     -Function to pop data from the queue
+ *
+ * @param[in]                 q     Pointer to the Queue structure from which data will be dequeued
+ *
+ * @return                    DataPacket containing the dequeued data, or a zero-initialized DataPacket if the queue is empty
+ * @note                      This function blocks if the queue is empty, waiting for data to become available.
+ ********************************************************/
+DataPacket dequeue(Queue *q) {
+    DataPacket data = {0};                                              // Initialize data packet to zero
+
+    dequeue_batch(q, &data, 1);
+    return data;                                                        // Return the dequeued data packet
+}
+
+/********************************************************
+ * @fn                        -dequeue_claimed
+ *
+ * @brief                     -Unlink packets claimed with queue_claim and release their slots to writers
+ *
+ * @param[in]                 q         Pointer to the Queue structure
+ * @param[out]                packets   Array receiving the dequeued packets, in queue order
+ * @param[in]                 taken     Number of packets claimed
+ *
+ * @return                    Number of packets dequeued (fewer than taken if the queue was unexpectedly empty, or
+ *                            if a ring packet could not be allocated; its claim is handed back and it stays queued)
+ * @note                      Ring frames are only copied out under the lock; they are verified, decompressed and
+ *                            given their buffers after it is released. Frames whose buffer cannot be allocated
+ *                            are put back at the head of the ring.
+ ********************************************************/
+static int dequeue_claimed(Queue *q, DataPacket *packets, int taken) {
+    RingSlot *staged = NULL;
+    Node *temp;
+    int owed, unclaimed = 0, missing = 0, frames = 0, i;
+
+    if (taken == 0)
+        return 0;
+    if (q->ring != NULL)
+        staged = ring_staging(taken);                                   // Room to copy ring frames out of the lock
+    pthread_mutex_lock(&q->lock);                                       // Acquire lock before modifying the queue
+    for (i = 0; i < taken; i++) {
+        if (q->head == NULL && q->ring != NULL && q->ring->head != q->ring->tail) {
+            if (staged == NULL) {
+                unclaimed = taken - i;                                  // Still in the ring: give back the claims only
+                taken = i;
+                break;
+            }
+            queue_file_take(q, &staged[frames++]);                      // Decoded once the lock is released
+            q->count--;                                                 // File-backed packet; requeued ones in the list go first
+            continue;
+        }
+        if (q->head == NULL) {                                          // If queue is unexpectedly empty
+            missing = taken - i;
+            taken = i;
+            break;
+        }
+
+        temp = q->head;                                                 // Temporary pointer to the head of the queue
+        packets[i] = temp->packet;                                      // Retrieve data packet from the head node
+        q->head = q->head->next;                                        // Move head pointer to the next node
+        if (q->head == NULL) {
+            q->tail = NULL;                                             // If queue becomes empty, update tail pointer
+        }
+        q->count--;                                                     // Decrement queue element count
+        free(temp);                                                     // Free memory of the dequeued node
+    }
+    owed = (q->debt < taken) ? q->debt : taken;                         // Slots that were never reserved by a writer
+    q->debt -= owed;                                                    // A shrink it completes is left to queue_ring_poll
+    pthread_mutex_unlock(&q->lock);                                     // Release the lock
+
+    for (i = 0; i < frames; i++) {
+        if (queue_file_decode(&staged[i], &packets[taken - frames + i]) != 0)
+            break;
+    }
+    if (i < frames) {
+        int back = frames - i;                                          // This frame and the rest go back, in order
+        pthread_mutex_lock(&q->lock);
+        if (queue_file_untake(q, &staged[i], back) == 0) {
+            q->count += back;
+            taken -= back;
+            unclaimed += back;
+            if (owed > taken) {
+                q->debt += owed - taken;                                // Their slots are held again
+                owed = taken;
+            }
+        } else {
+            for (; i < frames; i++)
+                memset(&packets[taken - frames + i], 0, sizeof(DataPacket)); // Handed out empty, readers skip them
+            log_message_level(LOG_LEVEL_ERROR, "Error: Queue file packets lost, the ring shrank meanwhile.");
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    if (unclaimed > 0) {
+        __atomic_fetch_add(&q->ready, unclaimed, __ATOMIC_RELEASE);
+        log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for a queue file packet, left queued.");
+    }
+    if (missing > 0) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: Tried to dequeue from an empty queue.");
+        for (; missing > 0; missing--)
+            sem_post(&q->empty);                                        // Correct semaphore state, should not wait if there's an error
+    }
+    for (i = 0; i < taken; i++) {
+        if (i >= owed)
+            sem_post(&q->empty);                                        // Increment 'empty' semaphore (signal queue is not full)
+        log_message_level(LOG_LEVEL_DEBUG, "Data dequeued.");
+    }
+    return taken;
+}
+
+static __thread ColumnBatch *readerColumns = NULL;                      // Calling reader's columnar block, if any
+static __thread unsigned long long *readerEventHold = NULL;             // Calling reader's eventHoldNs, if any
+static __thread ShardWriter *readerShard = NULL;                        // Calling reader's shard writer, if any
+
+/********************************************************
+ * @fn                        -dequeue_batch
+ *
+ * @brief                     -Function to pop up to maxCount packets from the queue under one lock acquisition
+ *
+ * @param[in]                 q         Pointer to the Queue structure from which data will be dequeued
+ * @param[out]                packets   Array receiving the dequeued packets, in queue order
+ * @param[in]                 maxCount  Capacity of the packets array
+ *
+ * @return                    Number of packets dequeued (0 if the queue was unexpectedly empty, or to let the
+ *                            caller handle a pending pulse first)
+ * @note                      Blocks until at least one packet is available, then takes whatever else is already
+ *                            queued up to maxCount without waiting, so batching never adds latency. A sleeping
+ *                            reader is woken according to the coalescing rules of queue_publish. Before
+ *                            blocking, the calling reader's pending log lines, columnar rows and shard frames are
+ *                            written out.
+ *                            A reader's eventHoldNs is stamped before it pops, never while it blocks.
+ ********************************************************/
+int dequeue_batch(Queue *q, DataPacket *packets, int maxCount) {
+    int taken;
+
+    taken = queue_claim(q, maxCount, 0);                                // Claim packets that are already queued
+    if (taken == 0) {
+        log_flush();                                                    // About to block: do not hold back log lines
+        if (readerColumns != NULL)
+            column_batch_flush(readerColumns);                          // Nor rows of a half-filled columnar block
+        if (readerShard != NULL)
+            shard_writer_flush(readerShard);                            // Nor frames a live merge is waiting for
+        taken = queue_claim(q, maxCount, 1);                            // Wait if queue is empty
+    }
+    if (taken > 0 && readerEventHold != NULL)
+        __atomic_store_n(readerEventHold, now_ns(), __ATOMIC_SEQ_CST);  // Before the pop: see event_batch_flush
+    return dequeue_claimed(q, packets, taken);
+}
+
+/********************************************************
+ * @fn                        -dequeue_ready
+ *
+ * @brief                     -Pop up to maxCount packets that are already queued, without blocking
+ *
+ * @param[in]                 q         Pointer to the Queue structure
+ * @param[out]                packets   Array receiving the dequeued packets, in queue order
+ * @param[in]                 maxCount  Capacity of the packets array
+ *
+ * @return                    Number of packets dequeued, 0 if none could be claimed
+ * @note                      For threads that block in waitset_wait instead of on the queue itself.
+ ********************************************************/
+int dequeue_ready(Queue *q, DataPacket *packets, int maxCount) {
+    return dequeue_claimed(q, packets, queue_claim(q, maxCount, 0));
+}
+ 
+/********************************************************
+ * @fn                        -requeue_front
+ *
+ * @brief                     -Function to put packets back at the head of the queue
+ *
+ * @param[in]                 q        Pointer to the Queue structure
+ * @param[in]                 packets  Array of DataPackets to requeue, in their original order
+ * @param[in]                 count    Number of packets in the array
+ *
+ * @return                    -none
+ * @note                      Never blocks: the packets already left the queue once, so if no free slot is
+ *                            available the queue temporarily runs over capacity and the excess is recorded as
+ *                            debt that later dequeues pay back instead of releasing slots to writers.
+ *                            For a file-backed queue the requeued packets stay in memory ahead of the ring.
+ ********************************************************/
+void requeue_front(Queue *q, DataPacket *packets, int count) {
+    Node *first = NULL, *last = NULL;
+    int i, linked = 0, reserved = 0;
+
+    for (i = 0; i < count; i++) {
+        Node *newNode = (Node*) malloc(sizeof(Node));
+        if (newNode == NULL) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for requeued node.");
+            packet_free(&packets[i]);
+            continue;
+        }
+        newNode->packet = packets[i];
+        newNode->next = NULL;
+        if (last == NULL) {
+            first = newNode;
+        } else {
+            last->next = newNode;
+        }
+        last = newNode;
+        linked++;
+    }
+    if (linked == 0)
+        return;
+
+    while (reserved < linked && sem_trywait(&q->empty) == 0)
+        reserved++;                                                     // Use free slots where there are some
+
+    pthread_mutex_lock(&q->lock);
+    last->next = q->head;                                               // Splice the packets in front of the head
+    q->head = first;
+    if (q->tail == NULL) {
+        q->tail = last;
+    }
+    q->count += linked;
+    q->debt += linked - reserved;                                       // Slots borrowed beyond capacity
+    pthread_mutex_unlock(&q->lock);
+
+    queue_publish(q, linked);
+}
+
+/********************************************************
+ * @fn                        -fast_rand
+ *
+ * @brief                     -Per-thread xorshift pseudo-random generator
+ *
+ * @return                    32 pseudo-random bits
+ * @note                      Lock-free replacement for rand() on the packet path.
+ ********************************************************/
+unsigned int fast_rand(void) {
+    static __thread unsigned long long state = 0;
+
+    if (state == 0)
+        state = (unsigned long long) pthread_self() * 0x9E3779B97F4A7C15ULL | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (unsigned int)(state >> 32);
+}
+
+/********************************************************
+ * @fn                        -corpus_init
+ *
+ * @brief                     -Map or build the payload corpus
+ *
+ * @param[in]                 path   File to map read-only, or NULL to synthesize CORPUS_SIZE bytes
+ *
+ * @return                    0 on success, -1 on failure
+ * @note                      The synthetic corpus is a stream of log- and request-like text records with varied
+ *                            field values, generated once from a fixed seed, so payloads look realistic and runs
+ *                            are repeatable.
+ ********************************************************/
+int corpus_init(const char *path) {
+    static const char *methods[] = { "GET", "PUT", "POST", "DELETE" };
+    static const char *paths[] = { "/api/v1/items", "/api/v1/users", "/api/v2/orders", "/health", "/metrics" };
+    static const char *levels[] = { "INFO", "WARN", "DEBUG", "ERROR" };
+    unsigned long long seed = 0x5EEDULL;
+    size_t used = 0;
+    char *buf;
+    char msg[160];
+
+    if (path != NULL) {
+        struct stat st;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        void *base;
+
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+            if (fd >= 0) close(fd);
+            log_message_level(LOG_LEVEL_ERROR, "Error: Cannot open payload corpus file.");
+            return -1;
+        }
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Cannot map payload corpus file.");
+            return -1;
+        }
+        payloadCorpus.base = (const char*) base;
+        payloadCorpus.size = st.st_size;
+        payloadCorpus.mapped = 1;
+    } else {
+        buf = (char*) malloc(CORPUS_SIZE + 256);
+        if (buf == NULL) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for payload corpus.");
+            return -1;
+        }
+        while (used < CORPUS_SIZE) {
+            unsigned int r1, r2;
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            r1 = (unsigned int) seed;
+            r2 = (unsigned int)(seed >> 32);
+            if (r1 & 1) {
+                used += sprintf(buf + used, "{\"ts\":%u,\"method\":\"%s\",\"path\":\"%s/%u\",\"status\":%d,\"bytes\":%u,"
+                                "\"user\":\"u%05u\"}\n", r2, methods[(r1 >> 1) & 3], paths[(r1 >> 3) % 5],
+                                r2 % 100000, (r1 >> 8) % 7 ? 200 : 500, (r2 >> 8) % 65536, (r1 >> 12) % 50000);
+            } else {
+                used += sprintf(buf + used, "%u %s worker-%02u session=%08x latency_us=%u queue_depth=%u\n",
+                                r2, levels[(r1 >> 1) & 3], (r1 >> 3) % 32, r2 ^ r1, (r1 >> 8) % 20000, (r2 >> 16) % 128);
+            }
+        }
+        payloadCorpus.base = buf;
+        payloadCorpus.size = CORPUS_SIZE;
+        payloadCorpus.mapped = 0;
+    }
+    snprintf(msg, sizeof(msg), "Corpus: %zu bytes %s.", payloadCorpus.size, payloadCorpus.mapped ? "mapped" : "generated");
+    log_message(msg);
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -corpus_slice
+ *
+ * @brief                     -Pick a random slice of the payload corpus
+ *
+ * @param[in]                 len   Slice length; must not exceed the corpus size
+ *
+ * @return                    Pointer to len readable corpus bytes
+ * @note                      -none
+ ********************************************************/
+const char *corpus_slice(int len) {
+    size_t span = payloadCorpus.size - (size_t) len + 1;
+    return payloadCorpus.base + (((unsigned long long) fast_rand() << 32 | fast_rand()) % span);
+}
+
+/********************************************************
+ * @fn                        -get_external_data
+ *
+ * @brief                     -Function to simulate data retrieval from an external source
+ *
+ * @param[in]                 bufferSizeInBytes   Size of the buffer in bytes
+ *
+ * @return                    Number of bytes copied to the buffer, or -1 if the buffer size is insufficient
+ * @note                      This function copies a random-length slice of the payload corpus to the provided
+ *                            buffer. It returns the number of bytes copied, which is less than bufferSizeInBytes.
+ ********************************************************/
+int get_external_data(char *buffer, int bufferSizeInBytes) {
+    int val;
+
+    val = (int)(fast_rand() % bufferSizeInBytes);                       // Generate random value within buffer size
+
+    if (bufferSizeInBytes < val || (size_t) val > payloadCorpus.size)
+        return (-1);                                                    // Return error if buffer size is less than required
+
+    memcpy(buffer, corpus_slice(val), val);                             // Copy corpus data to buffer
+    return val;                                                         // Return number of bytes copied
+}
+
+/********************************************************
+ * @fn                        -get_external_data_ref
+ *
+ * @brief                     -Function to simulate data retrieval without copying
+ *
+ * @param[out]                packet     DataPacket whose data and size are filled in
+ * @param[in]                 maxBytes   Upper bound of the message size in bytes
+ *
+ * @return                    Number of bytes referenced
+ * @note                      The packet borrows a slice of the corpus (PACKET_FLAG_BORROWED): nothing is
+ *                            allocated or copied, so generator cost stays out of queue and processing benchmarks.
+ ********************************************************/
+int get_external_data_ref(DataPacket *packet, int maxBytes) {
+    int val = (int)(fast_rand() % maxBytes);                            // Generate random value within the bound
+
+    if ((size_t) val > payloadCorpus.size)
+        val = (int) payloadCorpus.size;
+    packet->data = (char*) corpus_slice(val);
+    packet->chain = NULL;
+    packet->flags |= PACKET_FLAG_BORROWED;
+    packet->size = val;
+    return val;
+}
+
+/********************************************************
+ * @fn                        -process_data
+ *
+ * @brief                     -Function to process data
+ *
+ * @param[in]                 buffer              Pointer to the data buffer to be processed
+ * @param[in]                 bufferSizeInBytes   Size of the data buffer in bytes
+ *
+ * @return                    -none
+ * @note                      This function prints the contents of the data buffer as one line assembled in
+ *                            the reader's scratch arena and clears the buffer after printing. It also handles the case where the buffer
+ *                            pointer is NULL by printing an error message.
+ ********************************************************/
+void process_data(char *buffer, int bufferSizeInBytes) {
+    char *line;
+    int len;
+
+    if (buffer) {
+        line = (char*) reader_scratch(bufferSizeInBytes + 48);          // Build the whole line in scratch memory
+        if (line != NULL) {
+            len = sprintf(line, "thread %lu - ", (unsigned long) pthread_self()); // Print thread ID
+            memcpy(line + len, buffer, bufferSizeInBytes);              // Append the buffer's contents
+            line[len + bufferSizeInBytes] = '\n';
+            fwrite(line, 1, len + bufferSizeInBytes + 1, stdout);
+        } else {
+            printf("thread %lu - ", (unsigned long) pthread_self());
+            fwrite(buffer, 1, bufferSizeInBytes, stdout);
+            printf("\n");
+        }
+        memset(buffer, 0, bufferSizeInBytes);                           // Clear the buffer
+    } else {
+        printf("error in process data - %lu\n", (unsigned long) pthread_self()); // Print error if buffer is NULL
+    }
+}
+ 
+/********************************************************
+ * @fn                        -get_external_data_chain
+ *
+ * @brief                     -Function to simulate data retrieval into a chunked payload
+ *
+ * @param[out]                packet     DataPacket whose chain and size are filled in
+ * @param[in]                 maxBytes   Upper bound of the message size in bytes
+ *
+ * @return                    Number of bytes retrieved, or -1 if no chunk could be allocated
+ * @note                      Like get_external_data, the size is drawn at random below maxBytes and a corpus
+ *                            slice of that size is copied in with memcpy. Messages of any size are built from
+ *                            CHUNK_SIZE blocks, so no large contiguous allocation is ever made.
+ ********************************************************/
+int get_external_data_chain(DataPacket *packet, int maxBytes) {
+    Chunk **link = &packet->chain;
+    int val = (int)(fast_rand() % maxBytes);                            // Generate random value within the bound
+    int left;
+    const char *src;
+
+    if ((size_t) val > payloadCorpus.size)
+        val = (int) payloadCorpus.size;
+    src = corpus_slice(val);
+    left = val;
+
+    packet->data = NULL;
+    packet->chain = NULL;
+    packet->size = 0;
+    while (left > 0) {
+        Chunk *c = chunk_alloc();
+        if (c == NULL) {
+            chunk_free_chain(packet->chain);
+            packet->chain = NULL;
+            return -1;
+        }
+        c->len = (left < CHUNK_SIZE) ? left : CHUNK_SIZE;
+        memcpy(c->data, src + (val - left), c->len);                    // Copy corpus data to the chunk
+        *link = c;
+        link = &c->next;
+        left -= c->len;
+    }
+    packet->size = val;
+    return val;
+}
+
+/********************************************************
+ * @fn                        -chunk_alloc
+ *
+ * @brief                     -Take one chunk from the pool
+ *
+ * @return                    Pointer to a chunk with next = NULL and len = 0, or NULL if memory is exhausted
+ * @note                      Served from a per-thread cache; the cache is refilled from the shared free list
+ *                            and the shared list from new CHUNK_SLAB-sized slabs. Slabs are never returned to
+ *                            the system, so memory stays in uniform recyclable blocks.
+ ********************************************************/
+static pthread_mutex_t chunkPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static Chunk *chunkPool = NULL;                                         // Shared free list
+static __thread Chunk *chunkCache = NULL;                               // Per-thread free list
+static __thread int chunkCacheCount = 0;
+
+Chunk *chunk_alloc(void) {
+    Chunk *c;
+
+    if (chunkCache == NULL) {
+        int i;
+        pthread_mutex_lock(&chunkPoolLock);
+        for (i = 0; i < CHUNK_CACHE / 2 && chunkPool != NULL; i++) {    // Refill half a cache from the pool
+            c = chunkPool;
+            chunkPool = c->next;
+            c->next = chunkCache;
+            chunkCache = c;
+            chunkCacheCount++;
+        }
+        pthread_mutex_unlock(&chunkPoolLock);
+
+        if (chunkCache == NULL) {                                       // Pool empty: carve a new slab
+            Chunk *slab = (Chunk*) malloc(CHUNK_SLAB * sizeof(Chunk));
+            if (slab == NULL) {
+                log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for chunk slab.");
+                return NULL;
+            }
+            for (i = 0; i < CHUNK_SLAB; i++) {
+                slab[i].next = (i + 1 < CHUNK_SLAB) ? &slab[i + 1] : NULL;
+            }
+            pthread_mutex_lock(&chunkPoolLock);
+            slab[CHUNK_SLAB - 1].next = chunkPool;
+            chunkPool = slab[CHUNK_CACHE / 2].next;                     // Keep half a cache, share the rest
+            pthread_mutex_unlock(&chunkPoolLock);
+            slab[CHUNK_CACHE / 2].next = NULL;
+            chunkCache = slab;
+            chunkCacheCount = CHUNK_CACHE / 2 + 1;
+        }
+    }
+
+    c = chunkCache;
+    chunkCache = c->next;
+    chunkCacheCount--;
+    c->next = NULL;
+    c->len = 0;
+    return c;
+}
+
+/********************************************************
+ * @fn                        -chunk_free_chain
+ *
+ * @brief                     -Return a chain of chunks to the pool
+ *
+ * @param[in]                 chain   First chunk of the chain (may be NULL)
+ *
+ * @return                    -none
+ * @note                      When the per-thread cache grows beyond CHUNK_CACHE, half of it moves to the shared
+ *                            free list, so chunks freed by readers flow back to writers.
+ ********************************************************/
+void chunk_free_chain(Chunk *chain) {
+    while (chain != NULL) {
+        Chunk *next = chain->next;
+        chain->next = chunkCache;
+        chunkCache = chain;
+        chunkCacheCount++;
+        chain = next;
+    }
+
+    if (chunkCacheCount > CHUNK_CACHE) {
+        Chunk *first = chunkCache, *last = chunkCache;
+        int i;
+        for (i = 1; i < chunkCacheCount / 2; i++)
+            last = last->next;
+        chunkCache = last->next;
+        chunkCacheCount -= i;
+        pthread_mutex_lock(&chunkPoolLock);
+        last->next = chunkPool;
+        chunkPool = first;
+        pthread_mutex_unlock(&chunkPoolLock);
+    }
+}
+
+/********************************************************
+ * @fn                        -packet_iov
+ *
+ * @brief                     -Describe a packet's payload as an iovec array
+ *
+ * @param[in]                 packet   Packet with a contiguous or chunked payload
+ * @param[out]                iov      Receives one entry per contiguous piece
+ * @param[in]                 maxIov   Capacity of iov
+ *
+ * @return                    Number of entries used, or -1 if maxIov is too small
+ * @note                      No payload bytes are copied.
+ ********************************************************/
+int packet_iov(const DataPacket *packet, struct iovec *iov, int maxIov) {
+    const Chunk *c;
+    int n = 0;
+
+    if (packet->chain == NULL) {
+        if (packet->size <= 0 || packet->data == NULL)
+            return 0;
+        if (maxIov < 1)
+            return -1;
+        iov[0].iov_base = packet->data;
+        iov[0].iov_len = packet->size;
+        return 1;
+    }
+    for (c = packet->chain; c != NULL; c = c->next) {
+        if (n == maxIov)
+            return -1;
+        iov[n].iov_base = (void*) c->data;
+        iov[n].iov_len = c->len;
+        n++;
+    }
+    return n;
+}
+
+/********************************************************
+ * @fn                        -packet_free
+ *
+ * @brief                     -Release a packet's payload, contiguous, chunked or borrowed
+ *
+ * @param[in]                 packet   Packet whose payload is released; data and chain are reset
+ *
+ * @return                    -none
+ * @note                      -none
+ ********************************************************/
+void packet_free(DataPacket *packet) {
+    if (packet->chain != NULL)
+        chunk_free_chain(packet->chain);
+    if (!(packet->flags & PACKET_FLAG_BORROWED))
+        free(packet->data);
+    packet->chain = NULL;
+    packet->data = NULL;
+}
+
+/********************************************************
+ * @fn                        -arena_alloc
+ *
+ * @brief                     -Allocate scratch memory from a bump-pointer arena
+ *
+ * @param[in]                 a      Pointer to the Arena
+ * @param[in]                 size   Number of bytes
+ *
+ * @return                    ARENA_ALIGN-aligned memory valid until the next arena_reset, or NULL
+ * @note                      Normally a pointer increment. When the current block is full the next kept block
+ *                            is used, or a new one (at least size bytes) is chained on. There is no free.
+ ********************************************************/
+void *arena_alloc(Arena *a, size_t size) {
+    ArenaBlock *b = a->current;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    while (b != NULL && b->used + size > b->size) {
+        if (b->next != NULL) {
+            b = b->next;                                                // Reuse a block kept from an earlier batch
+            b->used = 0;
+        } else {
+            ArenaBlock *grow;
+            size_t bytes = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+            grow = (ArenaBlock*) malloc(sizeof(ArenaBlock) + bytes);
+            if (grow == NULL)
+                return NULL;
+            grow->next = NULL;
+            grow->size = bytes;
+            grow->used = 0;
+            b->next = grow;                                             // Overflow: chain another block
+            b = grow;
+            a->overflows++;
+        }
+    }
+    if (b == NULL) {                                                    // First use
+        size_t bytes = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        b = (ArenaBlock*) malloc(sizeof(ArenaBlock) + bytes);
+        if (b == NULL)
+            return NULL;
+        b->next = NULL;
+        b->size = bytes;
+        b->used = 0;
+        a->first = b;
+    }
+    a->current = b;
+    p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+/********************************************************
+ * @fn                        -arena_reset
+ *
+ * @brief                     -Release all scratch memory of an arena at once
+ *
+ * @param[in]                 a   Pointer to the Arena
+ *
+ * @return                    -none
+ * @note                      Regular blocks stay chained for the next batch; blocks made for a single oversized
+ *                            allocation are returned to the system so one huge packet does not pin memory.
+ ********************************************************/
+void arena_reset(Arena *a) {
+    ArenaBlock **link;
+
+    if (a->first == NULL)
+        return;
+    for (link = &a->first; *link != NULL; ) {
+        ArenaBlock *b = *link;
+        if (b->size > ARENA_BLOCK_SIZE) {
+            *link = b->next;
+            free(b);
+        } else {
+            link = &b->next;
+        }
+    }
+    if (a->first != NULL)
+        a->first->used = 0;
+    a->current = a->first;                                              // NULL if only oversized blocks were used
+}
+
+/********************************************************
+ * @fn                        -reader_scratch
+ *
+ * @brief                     -Scratch memory for processing handlers running on a reader
+ *
+ * @param[in]                 size   Number of bytes
+ *
+ * @return                    Memory valid until the reader finishes its current batch, or NULL when called
+ *                            outside a reader thread or out of memory
+ * @note                      Handlers never free it; the reader resets its arena after each dequeued batch.
+ ********************************************************/
+static __thread Arena *readerArena = NULL;
+
+void *reader_scratch(size_t size) {
+    return (readerArena != NULL) ? arena_alloc(readerArena, size) : NULL;
+}
+
+/********************************************************
+ * @fn                        -iov_advance
+ *
+ * @brief                     -Skip written bytes of an iovec array, as after a short writev
+ *
+ * @param[in,out]             iov    First entry not fully written
+ * @param[in,out]             left   Entries from iov on
+ * @param[in]                 n      Bytes written
+ *
+ * @return                    -none
+ ********************************************************/
+static void iov_advance(struct iovec **iov, int *left, size_t n) {
+    while (*left > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*left)--;
+    }
+    if (*left > 0) {
+        (*iov)->iov_base = (char*) (*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+/********************************************************
+ * @fn                        -forward_sink_open
+ *
+ * @brief                     -Turn on zero-copy forwarding of chunked and borrowed payloads to stdout (-F)
+ *
+ * @return                    0 if stdout supports it, -1 if output stays on writev
+ * @note                      A pipe is fed with vmsplice directly. Files and sockets are fed through a private
+ *                            pipe per reader: vmsplice into it, then splice out of it to stdout.
+ ********************************************************/
+int forward_sink_open(void) {
+    struct stat st;
+
+    if (fstat(STDOUT_FILENO, &st) != 0)
+        return -1;
+    if (S_ISFIFO(st.st_mode))
+        forwardSink.mode = FORWARD_PIPE;
+    else if (S_ISSOCK(st.st_mode))
+        forwardSink.mode = FORWARD_SOCKET;
+    else if (S_ISREG(st.st_mode))
+        forwardSink.mode = FORWARD_FILE;
+    else
+        return -1;                                                      // Terminal or device: nothing to splice to
+    if (forwardSink.mode == FORWARD_PIPE)
+        fcntl(STDOUT_FILENO, F_SETPIPE_SZ, FORWARD_PIPE_SIZE);          // Fewer blocking vmsplice calls; best effort
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -forward_pending
+ *
+ * @brief                     -Bytes written to a sink's descriptor that the kernel may still read from user pages
+ *
+ * @param[in]                 sink   Forwarding sink
+ * @param[in]                 fd     Its descriptor
+ *
+ * @return                    Unread pipe bytes, unacknowledged socket bytes, or 0 for a file
+ * @note                      A file copies spliced data into the page cache before splice returns.
+ ********************************************************/
+static unsigned long long forward_pending(const ForwardSink *sink, int fd) {
+    int n = 0;
+
+    if (sink->mode == FORWARD_PIPE && ioctl(fd, FIONREAD, &n) != 0)
+        n = 0;
+    else if (sink->mode == FORWARD_SOCKET && ioctl(fd, SIOCOUTQ, &n) != 0)
+        n = 0;
+    return n > 0 ? (unsigned long long) n : 0;
+}
+
+/********************************************************
+ * @fn                        -forward_reclaim
+ *
+ * @brief                     -Return to the pool the chunk chains of a reader the kernel has finished with
+ *
+ * @param[in]                 out    Reader's gather list
+ * @param[in]                 wait   Wait until at least one chain is released
+ *
+ * @return                    -none
+ * @note                      Each held chain records the stdout position of its last byte. Everything up to
+ *                            written - pending has been consumed. Bytes other writers put on stdout (stdio, a
+ *                            shell sharing the pipe) are not counted, which only makes the estimate late.
+ ********************************************************/
+static void forward_reclaim(OutputVec *out, int wait) {
+    while (out->heldCount > 0) {
+        ForwardHold *h = &out->held[out->heldHead];
+        unsigned long long written = __atomic_load_n(&out->sink->written, __ATOMIC_ACQUIRE);
+        unsigned long long pending = forward_pending(out->sink, out->fd); // Read after written: errs towards holding
+
+        if (h->end + pending > written) {
+            struct timespec ts = { 0, FORWARD_POLL_NS };
+            if (!wait)
+                return;
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        chunk_free_chain(h->chain);
+        free(h->gather);
+        out->heldHead = (out->heldHead + 1) % FORWARD_HOLDS;
+        out->heldCount--;
+        wait = 0;
+        __atomic_fetch_sub(&out->sink->heldChains, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/********************************************************
+ * @fn                        -forward_gather
+ *
+ * @brief                     -Copy the short pieces of a gather list into one buffer, in place of the originals
+ *
+ * @param[in]                 out    Reader's gather list; out->gather receives the buffer
+ * @param[in,out]             iov    Entries to write, rewritten in place
+ * @param[in]                 left   Number of entries
+ *
+ * @return                    Number of entries after merging, or -1 if no buffer could be allocated
+ * @note                      Runs of prefixes, newlines and short payload tails become one entry, so they take
+ *                            one pipe buffer instead of one pinned page each. Chunks and corpus slices of
+ *                            FORWARD_GATHER_MAX bytes or more are left to be spliced where they are.
+ ********************************************************/
+static int forward_gather(OutputVec *out, struct iovec *iov, int left) {
+    size_t need = 0, used = 0;
+    int i, n = 0;
+
+    for (i = 0; i < left; i++)
+        if (iov[i].iov_len < FORWARD_GATHER_MAX)
+            need += iov[i].iov_len;
+    if (need == 0)
+        return left;
+    if ((out->gather = (char*) malloc(need)) == NULL)
+        return -1;
+    for (i = 0; i < left; i++) {
+        if (iov[i].iov_len >= FORWARD_GATHER_MAX) {
+            iov[n++] = iov[i];
+            continue;
+        }
+        if (iov[i].iov_len == 0)
+            continue;
+        memcpy(out->gather + used, iov[i].iov_base, iov[i].iov_len);
+        if (n > 0 && (char*) iov[n - 1].iov_base + iov[n - 1].iov_len == out->gather + used) {
+            iov[n - 1].iov_len += iov[i].iov_len;                       // Extends the previous gathered run
+        } else {
+            iov[n].iov_base = out->gather + used;
+            iov[n].iov_len = iov[i].iov_len;
+            n++;
+        }
+        used += iov[i].iov_len;
+    }
+    return n;
+}
+
+/********************************************************
+ * @fn                        -forward_write
+ *
+ * @brief                     -Splice a reader's gather list to stdout without copying its payloads
+ *
+ * @param[in]                 out    Reader's gather list; out->spliced is set if any user page was spliced
+ * @param[in,out]             iov    First entry still to write; advanced past what was written
+ * @param[in]                 left   Entries still to write
+ *
+ * @return                    Entries the caller still has to write with writev
+ * @note                      Pooled chunks and corpus slices are vmspliced where they are; only the short
+ *                            pieces are copied (forward_gather). The chunks stay referenced by the pipe, so
+ *                            output_flush holds them until the kernel has consumed them. One reader at a time,
+ *                            so the stdout position each flush ends at is exact. The first splice failure (a
+ *                            file system without splice support, for example) turns forwarding off; data
+ *                            already in a reader's pipe is copied out first.
+ ********************************************************/
+static int forward_write(OutputVec *out, struct iovec **iov, int left) {
+    ForwardSink *sink = out->sink;
+    int fd = sink->mode == FORWARD_PIPE ? out->fd : out->pipe[1];
+    int broken = 0, merged;
+
+    if (__atomic_load_n(&sink->failed, __ATOMIC_RELAXED) || (sink->mode != FORWARD_PIPE && out->pipe[0] < 0))
+        return left;
+    if ((merged = forward_gather(out, *iov, left)) < 0)
+        return left;                                                    // No memory: copied with writev
+    left = merged;
+    pthread_mutex_lock(&sink->lock);
+    while (left > 0 && !broken) {
+        ssize_t n = vmsplice(fd, *iov, left > IOV_MAX ? IOV_MAX : left, 0), moved;
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            broken = 1;
+            break;
+        }
+        sink->calls++;
+        out->spliced = 1;
+        for (moved = n; fd != out->fd && moved > 0; ) {
+            ssize_t m = splice(out->pipe[0], NULL, out->fd, NULL, moved, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m <= 0) {                                               // Copy what is stuck in the private pipe
+                char buf[4096];
+                while (moved > 0 && (m = read(out->pipe[0], buf, moved > 4096 ? 4096 : moved)) > 0) {
+                    if (write(out->fd, buf, m) != m)
+                        break;
+                    moved -= m;
+                    sink->copied += m;
+                }
+                broken = 1;
+                break;
+            }
+            sink->calls++;
+            moved -= m;
+        }
+        sink->bytes += n;
+        __atomic_store_n(&sink->written, sink->written + n, __ATOMIC_RELEASE);
+        iov_advance(iov, &left, n);
+    }
+    if (broken && !sink->failed) {
+        __atomic_store_n(&sink->failed, 1, __ATOMIC_RELAXED);
+        if (sink == &forwardSink)
+            log_message_level(LOG_LEVEL_ERROR, "Error: splice to stdout failed, forwarding with writev.");
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return left;
+}
+
+/********************************************************
+ * @fn                        -output_init
+ *
+ * @brief                     -Prepare a reader's gather list
+ *
+ * @param[out]                out    OutputVec owned by the calling reader
+ * @param[in]                 sink   Forwarding sink: forwardSink for stdout
+ * @param[in]                 fd     Descriptor written to: STDOUT_FILENO
+ *
+ * @return                    -none
+ * @note                      With -F to a file or socket the reader also gets its private splice pipe.
+ ********************************************************/
+void output_init(OutputVec *out, ForwardSink *sink, int fd) {
+    out->iovCount = 0;
+    out->release = NULL;
+    out->prefixLen = snprintf(out->prefix, sizeof(out->prefix), "thread %lu - ", (unsigned long) pthread_self());
+    out->sink = sink;
+    out->fd = fd;
+    out->pipe[0] = out->pipe[1] = -1;
+    out->gather = NULL;
+    out->heldHead = out->heldCount = 0;
+    out->spliced = 0;
+    if (sink->mode != FORWARD_OFF && sink->mode != FORWARD_PIPE) {
+        if (pipe2(out->pipe, O_CLOEXEC) == 0)
+            fcntl(out->pipe[1], F_SETPIPE_SZ, FORWARD_PIPE_SIZE);
+        else
+            out->pipe[0] = out->pipe[1] = -1;                           // This reader copies with writev
+    }
+}
+
+/********************************************************
+ * @fn                        -output_keep
+ *
+ * @brief                     -Hand a queued packet's chunk chain to the gather list, to release once written
+ *
+ * @param[in]                 out      Reader's gather list
+ * @param[in]                 packet   Packet whose payload is referenced by out's iovecs
+ *
+ * @return                    -none
+ ********************************************************/
+static void output_keep(OutputVec *out, DataPacket *packet) {
+    Chunk *last;
+
+    if (packet->flags & PACKET_FLAG_BORROWED)
+        return;                                                         // Corpus memory outlives the write; nothing to release
+    for (last = packet->chain; last != NULL && last->next != NULL; last = last->next)
+        ;
+    if (last != NULL) {
+        last->next = out->release;                                      // Keep the chain until it is written
+        out->release = packet->chain;
+    }
+    packet->chain = NULL;
+}
+
+/********************************************************
+ * @fn                        -output_add
+ *
+ * @brief                     -Queue a chunked packet for output in the same format as process_data
+ *
+ * @param[in]                 out      Reader's gather list
+ * @param[in]                 packet   Packet with a chunked or borrowed payload; the gather list takes ownership
+ *
+ * @return                    -none
+ * @note                      The chunks themselves are referenced, not copied. The list is written out early
+ *                            if the packet would not fit; a packet larger than a whole list is streamed out in
+ *                            windows of OUTPUT_IOV_MAX chunks.
+ ********************************************************/
+void output_add(OutputVec *out, DataPacket *packet) {
+    static const char newline = '\n';
+    int n;
+
+    if (out->iovCount + 2 + packet->size / CHUNK_SIZE + 1 > OUTPUT_IOV_MAX)
+        output_flush(out);
+
+    out->iov[out->iovCount].iov_base = out->prefix;
+    out->iov[out->iovCount].iov_len = out->prefixLen;
+    n = packet_iov(packet, &out->iov[out->iovCount + 1], OUTPUT_IOV_MAX - out->iovCount - 2);
+    if (n < 0) {                                                        // Longer than a whole gather list: stream it
+        const Chunk *c = packet->chain;
+        output_flush(out);
+        out->iov[0].iov_base = out->prefix;
+        out->iov[0].iov_len = out->prefixLen;
+        out->iovCount = 1;
+        while (c != NULL) {
+            for (; c != NULL && out->iovCount < OUTPUT_IOV_MAX - 1; c = c->next) {
+                out->iov[out->iovCount].iov_base = (void*) c->data;
+                out->iov[out->iovCount].iov_len = c->len;
+                out->iovCount++;
+            }
+            if (c == NULL) {
+                out->iov[out->iovCount].iov_base = (void*) &newline;
+                out->iov[out->iovCount].iov_len = 1;
+                out->iovCount++;
+                output_keep(out, packet);                               // Released with the last window
+            }
+            output_flush(out);                                          // One writev per window of chunks
+        }
+        return;
+    }
+    out->iovCount += 1 + n;
+    out->iov[out->iovCount].iov_base = (void*) &newline;
+    out->iov[out->iovCount].iov_len = 1;
+    out->iovCount++;
+    output_keep(out, packet);
+}
+
+/********************************************************
+ * @fn                        -output_flush
+ *
+ * @brief                     -Write a reader's gather list to stdout and recycle its chunks
+ *
+ * @param[in]                 out   Reader's gather list
+ *
+ * @return                    -none
+ * @note                      stdio's buffer is flushed first so a writev never lands inside a partly flushed
+ *                            line from process_data. Short writes are resumed from where they stopped.
+ *                            With -F the list is spliced instead, and chunks of a flush that spliced are only
+ *                            recycled once the kernel has consumed them: until then a pipe or socket still
+ *                            reads the pool's pages.
+ ********************************************************/
+void output_flush(OutputVec *out) {
+    struct iovec *iov = out->iov;
+    int left = out->iovCount;
+
+    if (left > 0) {
+        if (out->fd == STDOUT_FILENO)
+            fflush(stdout);
+        if (out->sink->mode != FORWARD_OFF)
+            left = forward_write(out, &iov, left);                      // Zero-copy; anything it could not move is copied below
+        while (left > 0) {
+            ssize_t written = writev(out->fd, iov, left > IOV_MAX ? IOV_MAX : left);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;                                                  // stdout is gone; drop the output
+            }
+            iov_advance(&iov, &left, written);
+        }
+    }
+    if (out->spliced && (out->release != NULL || out->gather != NULL)) {
+        ForwardHold *h;
+        if (out->heldCount == FORWARD_HOLDS)
+            forward_reclaim(out, 1);                                    // Bounded: wait for the oldest chain
+        h = &out->held[(out->heldHead + out->heldCount) % FORWARD_HOLDS];
+        h->chain = out->release;
+        h->gather = out->gather;
+        h->end = __atomic_load_n(&out->sink->written, __ATOMIC_ACQUIRE);
+        out->heldCount++;
+        __atomic_fetch_add(&out->sink->heldChains, 1, __ATOMIC_RELAXED);
+    } else {
+        chunk_free_chain(out->release);                                 // Copied: the kernel holds no reference
+        free(out->gather);
+    }
+    if (out->heldCount > 0)
+        forward_reclaim(out, 0);
+    out->spliced = 0;
+    out->release = NULL;
+    out->gather = NULL;
+    out->iovCount = 0;
+}
+
+/********************************************************
+ * @fn                        -output_close
+ *
+ * @brief                     -Write out and release a reader's gather list when the reader exits
+ *
+ * @param[in]                 out   Reader's gather list
+ *
+ * @return                    -none
+ * @note                      Held chains are recycled once the kernel has consumed them. A stdout nobody reads
+ *                            is waited for FORWARD_CLOSE_NS at most; chains it still references are not reused.
+ ********************************************************/
+void output_close(OutputVec *out) {
+    unsigned long long deadlineNs = now_ns() + FORWARD_CLOSE_NS;
+    struct timespec ts = { 0, FORWARD_POLL_NS };
+
+    output_flush(out);
+    while (out->heldCount > 0) {
+        forward_reclaim(out, 0);
+        if (out->heldCount == 0 || now_ns() >= deadlineNs)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    if (out->pipe[0] >= 0) {
+        close(out->pipe[0]);
+        close(out->pipe[1]);
+    }
+}
+
+/********************************************************
+ * @fn                        -recent_store_reserve
+ *
+ * @brief                     -Reserve consecutive entries of the recent-packet store for a batch
+ *
+ * @param[in]                 count     Number of entries
+ * @param[out]                stampNs   Receives the reservation time, to be passed to recent_store_insert
+ *
+ * @return                    Sequence number of the first entry
+ * @note                      One compare-and-swap per batch keeps readers from contending on the store per
+ *                            packet. The time is read after the current end was loaded and before it is moved,
+ *                            so a later reservation always gets a later or equal time: storedNs never decreases
+ *                            along seq, which is what the time bound of queries bisects on. Entries that end up
+ *                            unused stay invalid and are skipped by queries.
+ ********************************************************/
+unsigned long long recent_store_reserve(int count, unsigned long long *stampNs) {
+    unsigned long long seq = __atomic_load_n(&recentStore.next, __ATOMIC_ACQUIRE);
+
+    do {
+        *stampNs = now_ns();
+    } while (!__atomic_compare_exchange_n(&recentStore.next, &seq, seq + count, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return seq;
+}
+
+/********************************************************
+ * @fn                        -recent_store_insert
+ *
+ * @brief                     -Record a packet in the recent-packet store
+ *
+ * @param[in]                 seq      Entry reserved with recent_store_reserve
+ * @param[in]                 packet   Packet to record; only its ids, timestamp, size and payload prefix are kept
+ * @param[in]                 nowNs    Reservation time returned by recent_store_reserve
+ *
+ * @return                    -none
+ * @note                      Lock-free: a compare-and-swap links the entry into its correlation bucket, stamping
+ *                            linkedNs after the previous head was seen, so times never increase along a chain.
+ *                            At most RECENT_PREFIX bytes are copied (none for a borrowed payload, which is
+ *                            referenced). The oldest entry is overwritten.
+ *                            Queries detect torn or overwritten entries through the entry version, so they
+ *                            never block ingestion.
+ ********************************************************/
+void recent_store_insert(unsigned long long seq, const DataPacket *packet, unsigned long long nowNs) {
+    RecentStore *rs = &recentStore;
+    RecentEntry *e = &rs->entries[seq & (RECENT_CAPACITY - 1)];
+    unsigned long long corr = packet->eventCorrelationId;
+    unsigned long long *bucket = &rs->buckets[(corr * 0x9E3779B97F4A7C15ULL) >> 50 & (RECENT_BUCKETS - 1)];
+    int len = packet->size < RECENT_PREFIX ? packet->size : RECENT_PREFIX;
+    unsigned long long prev;
+
+    __atomic_store_n(&e->version, 2 * seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);                            // Mark the entry busy before touching it
+    e->storedNs = nowNs;
+    e->eventId = packet->eventId;
+    e->correlationId = corr;
+    e->timestamp = packet->timestamp;
+    e->size = packet->size;
+    e->isBorrowed = 0;
+    if (packet->chain != NULL) {
+        const Chunk *c;
+        int off = 0;
+        for (c = packet->chain; c != NULL && off < len; c = c->next) {
+            int n = (c->len < len - off) ? c->len : len - off;
+            memcpy(e->prefix + off, c->data, n);
+            off += n;
+        }
+        len = off;
+    } else if (packet->flags & PACKET_FLAG_BORROWED) {
+        e->borrowed = packet->data;                                     // Read-only corpus memory: no copy needed
+        e->isBorrowed = 1;
+    } else if (len > 0) {
+        memcpy(e->prefix, packet->data, len);
+    }
+    e->len = len > 0 ? len : 0;
+    prev = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+    do {
+        e->linkedNs = now_ns();                                         // Taken after the head it links behind
+        e->prevSame = prev;
+    } while (!__atomic_compare_exchange_n(bucket, &prev, seq + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    __atomic_store_n(&e->version, 2 * seq + 2, __ATOMIC_RELEASE);       // Entry complete
+}
+
+/********************************************************
+ * @fn                        -recent_store_read
+ *
+ * @brief                     -Take a consistent copy of a store entry
+ *
+ * @param[in]                 seq   Sequence number of the entry
+ * @param[out]                out   Receives the entry
+ *
+ * @return                    0 on success, -1 if the entry is being written or was overwritten
+ * @note                      -none
+ ********************************************************/
+static int recent_store_read(unsigned long long seq, RecentEntry *out) {
+    const RecentEntry *e = &recentStore.entries[seq & (RECENT_CAPACITY - 1)];
+    unsigned long long version = __atomic_load_n(&e->version, __ATOMIC_ACQUIRE);
+
+    if (version != 2 * seq + 2)
+        return -1;
+    memcpy(out, e, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&e->version, __ATOMIC_RELAXED) == version ? 0 : -1;
+}
+
+/********************************************************
+ * @fn                        -recent_store_print
+ *
+ * @brief                     -Write one store entry as a reply line
+ *
+ * @param[in]                 e       Entry to print
+ * @param[in]                 nowNs   Current time, for the age
+ * @param[in]                 out     Reply stream
+ *
+ * @return                    -none
+ * @note                      Non-printable payload bytes are shown as '.'.
+ ********************************************************/
+static void recent_store_print(const RecentEntry *e, unsigned long long nowNs, FILE *out) {
+    const char *payload = e->isBorrowed ? e->borrowed : e->prefix;
+    char text[RECENT_PREFIX + 1];
+    int i;
+
+    for (i = 0; i < e->len; i++)
+        text[i] = (payload[i] >= 0x20 && payload[i] < 0x7F) ? payload[i] : '.';
+    text[i] = '\0';
+    fprintf(out, "event=%llu corr=%llu age_ms=%.1f size=%d payload=\"%s\"\n", e->eventId, e->correlationId,
+            nowNs > e->timestamp ? (nowNs - e->timestamp) / 1e6 : 0.0, e->size, text);
+}
+
+/********************************************************
+ * @fn                        -hitter_hash
+ *
+ * @brief                     -Hash a correlation id for sketch row `row`
+ *
+ * @param[in]                 key   Correlation id
+ * @param[in]                 row   Row of the sketch, or HITTER_DEPTH for the top-K index
+ *
+ * @return                    Hash value; callers mask the bits they need
+ * @note                      Multiplicative hashing with a different odd constant per row; the top bits are used.
+ ********************************************************/
+static inline unsigned int hitter_hash(unsigned long long key, int row) {
+    static const unsigned long long mult[HITTER_DEPTH + 1] = {
+        0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL,
+        0xFF51AFD7ED558CCDULL };
+    return (unsigned int) ((key * mult[row]) >> 40);
+}
+
+static void space_saving_swap(SpaceSaving *ss, int i, int j) {
+    HitterCounter t = ss->heap[i];
+    ss->heap[i] = ss->heap[j];
+    ss->heap[j] = t;
+    ss->index[ss->heap[i].slot] = (signed char) (i + 1);
+    ss->index[ss->heap[j].slot] = (signed char) (j + 1);
+}
+
+static void space_saving_sift_down(SpaceSaving *ss, int i) {
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < ss->size && ss->heap[l].count < ss->heap[m].count) m = l;
+        if (r < ss->size && ss->heap[r].count < ss->heap[m].count) m = r;
+        if (m == i)
+            return;
+        space_saving_swap(ss, i, m);
+        i = m;
+    }
+}
+
+/********************************************************
+ * @fn                        -space_saving_add
+ *
+ * @brief                     -Add weight to a key of a Space-Saving top-K table
+ *
+ * @param[in]                 ss         Table
+ * @param[in]                 key        Correlation id
+ * @param[in]                 weight     Packets or bytes to add
+ * @param[in]                 estimate   Count-min estimate of the key including weight
+ *
+ * @return                    -none
+ * @note                      O(log HITTER_TOP). An untracked key takes over the smallest counter, with its
+ *                            count-min estimate as count and the old minimum as error bound, but only once that
+ *                            estimate exceeds the minimum. The long tail of light keys therefore never churns
+ *                            the table, which keeps the common case to one index probe.
+ ********************************************************/
+static void space_saving_add(SpaceSaving *ss, unsigned long long key, unsigned long long weight,
+                             unsigned long long estimate) {
+    int mask = HITTER_INDEX - 1;
+    int slot = hitter_hash(key, HITTER_DEPTH) & mask;
+    int pos;
+
+    while (ss->index[slot] != 0) {
+        pos = ss->index[slot] - 1;
+        if (ss->heap[pos].key == key) {
+            ss->heap[pos].count += weight;                              // Tracked: grows, so it can only sink
+            space_saving_sift_down(ss, pos);
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (ss->size < HITTER_TOP) {
+        pos = ss->size++;
+        ss->heap[pos].key = key;
+        ss->heap[pos].count = estimate;
+        ss->heap[pos].error = estimate - weight;
+        ss->heap[pos].slot = slot;
+        ss->index[slot] = (signed char) (pos + 1);
+        while (pos > 0 && ss->heap[(pos - 1) / 2].count > ss->heap[pos].count) {
+            space_saving_swap(ss, pos, (pos - 1) / 2);
+            pos = (pos - 1) / 2;
+        }
+        return;
+    }
+
+    if (estimate <= ss->heap[0].count)
+        return;                                                         // Not heavier than the lightest tracked key
+    {                                                                   // Full: the minimum counter is taken over
+        int hole = ss->heap[0].slot, j = hole;
+        ss->index[hole] = 0;
+        while (1) {                                                     // Backward-shift deletion keeps probes short
+            j = (j + 1) & mask;
+            if (ss->index[j] == 0)
+                break;
+            pos = ss->index[j] - 1;
+            if (((j - (int) (hitter_hash(ss->heap[pos].key, HITTER_DEPTH) & mask)) & mask) >= ((j - hole) & mask)) {
+                ss->index[hole] = ss->index[j];
+                ss->heap[pos].slot = hole;
+                ss->index[j] = 0;
+                hole = j;
+            }
+        }
+        slot = hitter_hash(key, HITTER_DEPTH) & mask;                   // The deletion may have opened an earlier slot
+        while (ss->index[slot] != 0)
+            slot = (slot + 1) & mask;
+        ss->heap[0].error = ss->heap[0].count;
+        ss->heap[0].count = estimate;
+        ss->heap[0].key = key;
+        ss->heap[0].slot = slot;
+        ss->index[slot] = 1;
+        space_saving_sift_down(ss, 0);
+    }
+}
+
+/********************************************************
+ * @fn                        -hitter_observe
+ *
+ * @brief                     -Count a packet in a reader's heavy-hitter sketch
+ *
+ * @param[in]                 h        Reader's sketch
+ * @param[in]                 packet   Packet to count by eventCorrelationId
+ *
+ * @return                    -none
+ * @note                      Thread-private: no atomics or locks on the hot path, only a few increments and two
+ *                            top-K updates. hitter_merge publishes the counts.
+ ********************************************************/
+void hitter_observe(HitterSketch *h, const DataPacket *packet) {
+    unsigned long long key = packet->eventCorrelationId, size = packet->size > 0 ? packet->size : 0;
+    unsigned long long estPackets = ~0ULL, estBytes = ~0ULL;
+    int row;
+
+    for (row = 0; row < HITTER_DEPTH; row++) {
+        unsigned int col = hitter_hash(key, row) & (HITTER_WIDTH - 1);
+        if (++h->packets[row][col] < estPackets)
+            estPackets = h->packets[row][col];
+        if ((h->bytes[row][col] += size) < estBytes)
+            estBytes = h->bytes[row][col];
+    }
+    space_saving_add(&h->topPackets, key, 1, estPackets);
+    space_saving_add(&h->topBytes, key, size, estBytes);
+    h->totalPackets++;
+    h->totalBytes += size;
+}
+
+static unsigned long long hitter_estimate(unsigned long long sketch[HITTER_DEPTH][HITTER_WIDTH], unsigned long long key);
+
+/********************************************************
+ * @fn                        -hitter_merge
+ *
+ * @brief                     -Fold a reader's sketch into hitterGlobal and clear it
+ *
+ * @param[in]                 local   Reader's sketch
+ * @param[in]                 nowNs   Current time
+ *
+ * @return                    -none
+ * @note                      Count-min sketches add element-wise; top-K candidates are re-added with their
+ *                            local weight and merged estimate. Every HITTER_DECAY_NS the global counts are halved so the report follows
+ *                            current traffic instead of the whole run.
+ ********************************************************/
+void hitter_merge(HitterSketch *local, unsigned long long nowNs) {
+    HitterSketch *g = &hitterGlobal;
+    int row, col, i;
+
+    pthread_mutex_lock(&hitterLock);
+    if (nowNs - g->stampNs >= HITTER_DECAY_NS) {
+        for (row = 0; row < HITTER_DEPTH; row++) {
+            for (col = 0; col < HITTER_WIDTH; col++) {
+                g->packets[row][col] >>= 1;
+                g->bytes[row][col] >>= 1;
+            }
+        }
+        for (i = 0; i < HITTER_TOP; i++) {                              // Halving keeps the heap order
+            g->topPackets.heap[i].count >>= 1;
+            g->topPackets.heap[i].error >>= 1;
+            g->topBytes.heap[i].count >>= 1;
+            g->topBytes.heap[i].error >>= 1;
+        }
+        g->totalPackets >>= 1;
+        g->totalBytes >>= 1;
+        g->stampNs = nowNs;
+    }
+    for (row = 0; row < HITTER_DEPTH; row++) {
+        for (col = 0; col < HITTER_WIDTH; col++) {
+            g->packets[row][col] += local->packets[row][col];
+            g->bytes[row][col] += local->bytes[row][col];
+        }
+    }
+    for (i = 0; i < local->topPackets.size; i++) {                      // Candidates enter with their merged estimate
+        unsigned long long key = local->topPackets.heap[i].key;
+        space_saving_add(&g->topPackets, key, hitter_estimate(local->packets, key), hitter_estimate(g->packets, key));
+    }
+    for (i = 0; i < local->topBytes.size; i++) {
+        unsigned long long key = local->topBytes.heap[i].key;
+        space_saving_add(&g->topBytes, key, hitter_estimate(local->bytes, key), hitter_estimate(g->bytes, key));
+    }
+    g->totalPackets += local->totalPackets;
+    g->totalBytes += local->totalBytes;
+    pthread_mutex_unlock(&hitterLock);
+
+    memset(local, 0, sizeof(*local));
+    local->stampNs = nowNs;
+}
+
+/********************************************************
+ * @fn                        -hitter_estimate
+ *
+ * @brief                     -Count-min estimate of a key
+ *
+ * @param[in]                 sketch   Packet or byte sketch of a HitterSketch (hitterLock held for hitterGlobal)
+ * @param[in]                 key      Correlation id
+ *
+ * @return                    Smallest counter of the key over all rows
+ * @note                      -none
+ ********************************************************/
+static unsigned long long hitter_estimate(unsigned long long sketch[HITTER_DEPTH][HITTER_WIDTH], unsigned long long key) {
+    unsigned long long est = ~0ULL;
+    int row;
+
+    for (row = 0; row < HITTER_DEPTH; row++) {
+        unsigned long long v = sketch[row][hitter_hash(key, row) & (HITTER_WIDTH - 1)];
+        if (v < est)
+            est = v;
+    }
+    return est;
+}
+
+/********************************************************
+ * @fn                        -join_init
+ *
+ * @brief                     -Initialize the partitions of the request/response join
+ *
+ * @return                    -none
+ * @note                      -none
+ ********************************************************/
+void join_init(void) {
+    int i;
+
+    for (i = 0; i < JOIN_PARTITIONS; i++)
+        pthread_mutex_init(&joinPartitions[i].lock, NULL);
+}
+
+/********************************************************
+ * @fn                        -join_unlink
+ *
+ * @brief                     -Remove an entry from its partition and recycle it (partition lock held)
+ *
+ * @param[in]                 jp     Partition
+ * @param[in]                 link   Bucket link pointing at the entry
+ *
+ * @return                    -none
+ * @note                      -none
+ ********************************************************/
+static void join_unlink(JoinPartition *jp, JoinEntry **link) {
+    JoinEntry *e = *link;
+
+    *link = e->next;
+    if (e->older != NULL) e->older->newer = e->newer; else jp->oldest = e->newer;
+    if (e->newer != NULL) e->newer->older = e->older; else jp->newest = e->older;
+    e->next = jp->spare;
+    jp->spare = e;
+    jp->pending--;
+}
+
+/********************************************************
+ * @fn                        -join_expire_oldest
+ *
+ * @brief                     -Evict the oldest unmatched entry of a partition (partition lock held)
+ *
+ * @param[in]                 jp   Partition, not empty
+ *
+ * @return                    -none
+ * @note                      -none
+ ********************************************************/
+static void join_expire_oldest(JoinPartition *jp) {
+    JoinEntry *e = jp->oldest;
+    JoinEntry **link = &jp->buckets[(e->correlationId * 0x9E3779B97F4A7C15ULL) >> 40 & (JOIN_BUCKETS - 1)];
+
+    while (*link != e)
+        link = &(*link)->next;
+    jp->evicted[e->response]++;
+    join_unlink(jp, link);
+}
+
+/********************************************************
+ * @fn                        -join_observe
+ *
+ * @brief                     -Feed a request or response packet to the windowed hash join
+ *
+ * @param[in]                 packet   Packet flagged PACKET_FLAG_REQUEST or PACKET_FLAG_RESPONSE
+ *
+ * @return                    -none
+ * @note                      The packet is matched against the oldest buffered packet of the other side with
+ *                            the same eventCorrelationId. A match is emitted as a joined record (DEBUG log line
+ *                            with the response latency) and counted; otherwise the packet's ids are buffered
+ *                            until join_evict expires it. Only the correlation id's partition is locked, so
+ *                            readers join in parallel. A full partition evicts its oldest entry early.
+ ********************************************************/
+void join_observe(const DataPacket *packet) {
+    unsigned long long key = packet->eventCorrelationId, hash = key * 0x9E3779B97F4A7C15ULL;
+    JoinPartition *jp = &joinPartitions[(hash >> 56) % JOIN_PARTITIONS];
+    JoinEntry **bucket = &jp->buckets[hash >> 40 & (JOIN_BUCKETS - 1)], **link, **match = NULL, *e;
+    int response = (packet->flags & PACKET_FLAG_RESPONSE) != 0;
+    unsigned long long requestId = 0, responseId = 0, latencyNs = 0;
+    char msg[160];
+
+    pthread_mutex_lock(&jp->lock);
+    for (link = bucket; *link != NULL; link = &(*link)->next) {
+        if ((*link)->correlationId == key && (*link)->response != response)
+            match = link;                                               // Entries are pushed at the head: keep the last (oldest)
+    }
+    if (match != NULL) {
+        JoinEntry *other = *match;
+        unsigned long long reqTs = response ? other->timestamp : packet->timestamp;
+        unsigned long long respTs = response ? packet->timestamp : other->timestamp;
+        unsigned long long us;
+        int b = 0;
+
+        requestId = response ? other->eventId : packet->eventId;
+        responseId = response ? packet->eventId : other->eventId;
+        latencyNs = respTs > reqTs ? respTs - reqTs : 0;
+        for (us = latencyNs / 1000; us > 0 && b < JOIN_LATENCY_BUCKETS - 1; us >>= 1)
+            b++;
+        jp->latency[b]++;
+        jp->matched++;
+        join_unlink(jp, match);
+    } else {
+        if (jp->pending >= JOIN_MAX_PENDING)
+            join_expire_oldest(jp);                                     // Bounded memory: give up on the oldest
+        e = jp->spare;
+        if (e != NULL)
+            jp->spare = e->next;
+        else
+            e = (JoinEntry*) malloc(sizeof(JoinEntry));
+        if (e != NULL) {
+            e->correlationId = key;
+            e->eventId = packet->eventId;
+            e->timestamp = packet->timestamp;
+            e->response = response;
+            e->next = *bucket;
+            *bucket = e;
+            e->newer = NULL;
+            e->older = jp->newest;
+            if (jp->newest != NULL) jp->newest->newer = e; else jp->oldest = e;
+            jp->newest = e;
+            jp->pending++;
+        }
+    }
+    pthread_mutex_unlock(&jp->lock);
+
+    if (match != NULL && config_read_begin()->logLevel <= LOG_LEVEL_DEBUG) {
+        config_read_end();                                              // Only format the record if it will be logged
+        snprintf(msg, sizeof(msg), "Join: corr=%llu request=%llu response=%llu latency_ns=%llu",
+                 key, requestId, responseId, latencyNs);
+        log_message_level(LOG_LEVEL_DEBUG, msg);
+    } else if (match != NULL) {
+        config_read_end();
+    }
+}
+
+/********************************************************
+ * @fn                        -join_evict
+ *
+ * @brief                     -Expire buffered join entries older than JOIN_WINDOW_NS
+ *
+ * @param[in]                 nowNs   Current time
+ *
+ * @return                    -none
+ * @note                      Driven by the control thread's eviction timer. Each partition is walked from its
+ *                            oldest arrival and only until the first entry still inside the window.
+ ********************************************************/
+void join_evict(unsigned long long nowNs) {
+    int i;
+
+    for (i = 0; i < JOIN_PARTITIONS; i++) {
+        JoinPartition *jp = &joinPartitions[i];
+        pthread_mutex_lock(&jp->lock);
+        while (jp->oldest != NULL && jp->oldest->timestamp + JOIN_WINDOW_NS < nowNs)
+            join_expire_oldest(jp);
+        pthread_mutex_unlock(&jp->lock);
+    }
+}
+
+/********************************************************
+ * @fn                        -event_time_init
+ *
+ * @brief                     -Start event-time windowing at the current window
+ *
+ * @param[in]                 nowNs   Current time
+ *
+ * @return                    -none
+ * @note                      Packets stamped before startup (for example from a reattached queue file) are late.
+ ********************************************************/
+void event_time_init(unsigned long long nowNs) {
+    eventTime.closedUpTo = eventTime.purgedUpTo = nowNs / EVENT_WINDOW_NS;
+}
+
+/********************************************************
+ * @fn                        -event_batch_count
+ *
+ * @brief                     -Add a reader's batch window counts to the shared windows
+ *
+ * @param[in]                 eb   Reader's batch totals; its window counts are emptied
+ *
+ * @return                    -none
+ * @note                      A packet for a window that already closed is still counted (and flagged late) until
+ *                            the window is purged EVENT_LATENESS_NS later; after that it goes to the late side
+ *                            output.
+ ********************************************************/
+static void event_batch_count(EventBatch *eb) {
+    EventTime *et = &eventTime;
+    unsigned long long purged, closed;
+    char msg[160];
+    int i;
+
+    for (i = 0; i < eb->used; i++) {
+        unsigned long long window = eb->window[i];
+        purged = __atomic_load_n(&et->purgedUpTo, __ATOMIC_ACQUIRE);
+        closed = __atomic_load_n(&et->closedUpTo, __ATOMIC_ACQUIRE);
+        if (window < purged || window >= purged + EVENT_WINDOW_SLOTS) {
+            __atomic_fetch_add(window < purged ? &et->lateDropped : &et->earlyDropped, eb->packets[i], __ATOMIC_RELAXED);
+            snprintf(msg, sizeof(msg), "Window side output: %lu %s packets for start_ms=%llu", eb->packets[i],
+                     window < purged ? "late" : "early", window * (EVENT_WINDOW_NS / 1000000ULL));
+            log_message_level(LOG_LEVEL_DEBUG, msg);
+            continue;
+        }
+        EventWindow *w = &et->windows[window % EVENT_WINDOW_SLOTS];
+        __atomic_fetch_add(&w->packets, eb->packets[i], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->bytes, eb->bytes[i], __ATOMIC_RELAXED);
+        if (window < closed)
+            __atomic_fetch_add(&w->late, eb->packets[i], __ATOMIC_RELAXED);
+    }
+    eb->used = 0;
+}
+
+/********************************************************
+ * @fn                        -event_hold_oldest
+ *
+ * @brief                     -Oldest pop time of packets whose window counts some reader has not added yet
+ *
+ * @return                    Earliest eventHoldNs over the readers, ~0 if no reader holds packets
+ * @note                      Stalled readers are skipped: the watchdog has requeued what they held.
+ ********************************************************/
+static unsigned long long event_hold_oldest(void) {
+    int count = __atomic_load_n(&readerCount, __ATOMIC_ACQUIRE), i;
+    unsigned long long oldest = ~0ULL;
+
+    for (i = 0; i < count && i < MAX_READERS; i++) {
+        unsigned long long hold = __atomic_load_n(&readerStates[i].eventHoldNs, __ATOMIC_ACQUIRE);
+        if (hold != 0 && hold < oldest && !__atomic_load_n(&readerStates[i].stalled, __ATOMIC_ACQUIRE))
+            oldest = hold;
+    }
+    return oldest;
+}
+
+/********************************************************
+ * @fn                        -event_batch_add
+ *
+ * @brief                     -Account a packet to its event-time window in a reader's batch totals
+ *
+ * @param[in]                 eb       Reader's batch totals, emptied by event_batch_flush
+ * @param[in]                 packet   Processed packet
+ *
+ * @return                    -none
+ * @note                      Thread-private. A batch touching more than EVENT_BATCH_WINDOWS windows has its counts
+ *                            published early; the watermark only moves in event_batch_flush.
+ ********************************************************/
+void event_batch_add(EventBatch *eb, const DataPacket *packet) {
+    unsigned long long window = packet->timestamp / EVENT_WINDOW_NS;
+    int i;
+
+    if (packet->source < N && packet->timestamp > eb->sourceMax[packet->source])
+        eb->sourceMax[packet->source] = packet->timestamp;
+    for (i = 0; i < eb->used && eb->window[i] != window; i++)
+        ;
+    if (i == EVENT_BATCH_WINDOWS) {
+        event_batch_count(eb);
+        i = 0;
+    }
+    if (i == eb->used) {
+        eb->window[i] = window;
+        eb->packets[i] = eb->bytes[i] = 0;
+        eb->used++;
+    }
+    eb->packets[i]++;
+    eb->bytes[i] += packet->size > 0 ? packet->size : 0;
+}
+
+/********************************************************
+ * @fn                        -event_window_emit
+ *
+ * @brief                     -Log a window result (eventTime.lock held)
+ *
+ * @param[in]                 window   Window index
+ * @param[in]                 final    Nonzero for the final result after late data, 0 for the on-time result
+ * @param[in]                 nowNs    Current time, for the result latency
+ *
+ * @return                    -none
+ * @note                      -none
+ ********************************************************/
+static void event_window_emit(unsigned long long window, int final, unsigned long long nowNs) {
+    EventWindow *w = &eventTime.windows[window % EVENT_WINDOW_SLOTS];
+    EventWindow result;
+    char msg[200];
+
+    result.packets = __atomic_load_n(&w->packets, __ATOMIC_RELAXED);
+    result.bytes = __atomic_load_n(&w->bytes, __ATOMIC_RELAXED);
+    result.late = __atomic_load_n(&w->late, __ATOMIC_RELAXED);
+    snprintf(msg, sizeof(msg), "Window%s: start_ms=%llu packets=%lu bytes=%lu late=%lu result_delay_ms=%.1f",
+             final ? " final" : "", window * (EVENT_WINDOW_NS / 1000000ULL), result.packets, result.bytes,
+             result.late, (nowNs - (window + 1) * EVENT_WINDOW_NS) / 1e6);
+    log_message(msg);
+    if (!final) {
+        eventTime.lastClosed = result;
+        eventTime.lastClosedWindow = window;
+    }
+}
+
+/********************************************************
+ * @fn                        -event_batch_flush
+ *
+ * @brief                     -Publish a reader's batch totals and advance the watermark
+ *
+ * @param[in]                 eb      Reader's batch totals; emptied
+ * @param[in]                 nowNs   Current time
+ *
+ * @return                    -none
+ * @note                      Counts are added to their windows first (event_batch_count), so a reader's own
+ *                            packets are never late because of its own watermark.
+ *                            Each writer's watermark is the newest timestamp seen from it (a writer's packets
+ *                            enter the queue in order). That is the newest seen by any reader, while older
+ *                            packets of the same writer may still be in flight on other readers, so the minimum
+ *                            over writers heard from within EVENT_SOURCE_IDLE_NS is only pending at first: it
+ *                            becomes the low watermark once every reader that was holding packets when it was
+ *                            seen has added its counts (eventHoldNs), or at once if no reader holds any. Windows
+ *                            close as soon as the low watermark passes their end, so results are held back by
+ *                            one batch in flight rather than by a fixed wall-clock delay.
+ ********************************************************/
+void event_batch_flush(EventBatch *eb, unsigned long long nowNs) {
+    EventTime *et = &eventTime;
+    unsigned long long low = ~0ULL, cur, held;
+    int i;
+
+    event_batch_count(eb);
+    if (eb->holdNs != NULL)
+        __atomic_store_n(eb->holdNs, 0, __ATOMIC_RELEASE);              // After the counts: see event_hold_oldest
+
+    for (i = 0; i < N; i++) {
+        unsigned long long seen = eb->sourceMax[i];
+        if (seen != 0) {
+            cur = __atomic_load_n(&et->sourceWatermark[i], __ATOMIC_RELAXED);
+            while (seen > cur && !__atomic_compare_exchange_n(&et->sourceWatermark[i], &cur, seen, 1,
+                                                               __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+            if (seen > cur)
+                __atomic_store_n(&et->sourceAdvancedNs[i], nowNs, __ATOMIC_RELAXED);
+            eb->sourceMax[i] = 0;
+        }
+        cur = __atomic_load_n(&et->sourceWatermark[i], __ATOMIC_ACQUIRE);
+        if (cur != 0 && nowNs - __atomic_load_n(&et->sourceAdvancedNs[i], __ATOMIC_RELAXED) < EVENT_SOURCE_IDLE_NS &&
+            cur < low)
+            low = cur;
+    }
+    if (low == ~0ULL)
+        return;                                                         // No active writer: the watermark stays
+
+    if (low <= __atomic_load_n(&et->lowWatermark, __ATOMIC_ACQUIRE))
+        return;                                                         // Nothing new from the writers
+    if (pthread_mutex_trylock(&et->lock) != 0)
+        return;                                                         // Another reader is advancing the watermark
+    held = event_hold_oldest();
+    cur = __atomic_load_n(&et->lowWatermark, __ATOMIC_RELAXED);
+    if (et->pendingNs != 0 && held > et->pendingNs) {
+        if (et->pendingLow > cur)
+            cur = et->pendingLow;                                       // Its packets in flight have all been counted
+        et->pendingNs = 0;
+    }
+    if (low > cur && held == ~0ULL) {
+        cur = low;                                                      // Nothing in flight: safe right away
+    } else if (low > cur && et->pendingNs == 0) {
+        et->pendingLow = low;                                           // Not replaced until committed, so it cannot starve
+        et->pendingNs = now_ns();
+    }
+    __atomic_store_n(&et->lowWatermark, cur, __ATOMIC_RELEASE);         // Only raised under the lock
+    low = cur;
+    while (et->closedUpTo < low / EVENT_WINDOW_NS) {
+        event_window_emit(et->closedUpTo, 0, nowNs);                    // On-time result
+        __atomic_store_n(&et->closedUpTo, et->closedUpTo + 1, __ATOMIC_RELEASE);
+    }
+    while (low > EVENT_LATENESS_NS && et->purgedUpTo < (low - EVENT_LATENESS_NS) / EVENT_WINDOW_NS &&
+           et->purgedUpTo < et->closedUpTo) {
+        EventWindow *w = &et->windows[et->purgedUpTo % EVENT_WINDOW_SLOTS];
+        if (__atomic_load_n(&w->late, __ATOMIC_RELAXED) > 0)
+            event_window_emit(et->purgedUpTo, 1, nowNs);                // Final result including late data
+        __atomic_store_n(&w->packets, 0, __ATOMIC_RELAXED);             // Empty before the slot is handed to its next window
+        __atomic_store_n(&w->bytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->late, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&et->purgedUpTo, et->purgedUpTo + 1, __ATOMIC_RELEASE); // The slot now holds window purgedUpTo + SLOTS - 1
+    }
+    pthread_mutex_unlock(&et->lock);
+}
+
+/********************************************************
+ * @fn                        -checkpoint_layout
+ *
+ * @brief                     -Fill in the section offsets and sizes of a snapshot header
+ *
+ * @param[out]                hdr   Header to fill in
+ *
+ * @return                    Total file size
+ * @note                      Sections start on page boundaries so the recent store can be updated in place.
+ ********************************************************/
+static unsigned long long checkpoint_layout(CheckpointHeader *hdr) {
+    unsigned long long size[CHECKPOINT_SECTIONS] = {
+        sizeof(HitterSketch),
+        sizeof(EventTime) - offsetof(EventTime, sourceWatermark),       // Everything after the lock
+        JOIN_PARTITIONS * sizeof(JoinCounters),
+        (unsigned long long) JOIN_PARTITIONS * JOIN_MAX_PENDING * sizeof(JoinRecord),
+        sizeof(recentStore.buckets) + sizeof(recentStore.entries) };
+    unsigned long long off = 4096;
+    int i;
+
+    for (i = 0; i < CHECKPOINT_SECTIONS; i++) {
+        hdr->offset[i] = off;
+        hdr->size[i] = size[i];
+        off += (size[i] + 4095) & ~4095ULL;
+    }
+    return off;
+}
+
+/********************************************************
+ * @fn                        -checkpoint_pwrite
+ *
+ * @brief                     -Write a whole buffer at an offset, resuming short writes
+ *
+ * @return                    0 on success, -1 on error
+ * @note                      -none
+ ********************************************************/
+static int checkpoint_pwrite(int fd, const void *buf, size_t len, unsigned long long off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t) off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char*) buf + n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -checkpoint_write
+ *
+ * @brief                     -Write the stage state to a snapshot file (runs in the forked child)
+ *
+ * @param[in]                 path         Snapshot file
+ * @param[in]                 generation   Generation to record
+ * @param[in]                 fromSeq      Oldest recent-store entry that may differ from the file
+ *
+ * @return                    0 on success, -1 on error
+ * @note                      The child sees the state as it was at fork(), copy-on-write, while the parent keeps
+ *                            running. Stage locks were held across the fork, so every structure is consistent
+ *                            and can be read without locking. No malloc or logging here.
+ *                            The header is first marked incomplete and only marked complete after the sections
+ *                            are synced, so a crash mid-write never leaves a file that looks valid.
+ *                            Only recent-store entries from fromSeq on are written (incremental); borrowed
+ *                            payload prefixes are copied in because the corpus address changes across runs.
+ *                            Since the rest of the recent store is left from earlier snapshots, its part of the
+ *                            checksum is taken by reading the section back once it is synced.
+ ********************************************************/
+static int checkpoint_write(const char *path, unsigned long long generation, unsigned long long fromSeq) {
+    static RecentEntry entryBuf[256];
+    static JoinRecord joinBuf[512];
+    static JoinCounters counters[JOIN_PARTITIONS];
+    CheckpointHeader hdr;
+    unsigned long long total, next = recentStore.next, seq, joinCount = 0, off;
+    unsigned int crc;
+    int fd, i, n = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    total = checkpoint_layout(&hdr);
+    hdr.magic = CHECKPOINT_MAGIC;
+    hdr.version = CHECKPOINT_VERSION;
+    hdr.generation = generation;
+    hdr.takenNs = now_ns();
+    hdr.recentNext = next;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t) total) != 0 || checkpoint_pwrite(fd, &hdr, sizeof(hdr), 0) != 0 ||
+        fdatasync(fd) != 0)
+        return -1;                                                      // Header now says incomplete
+
+    crc = crc32c(0, &hitterGlobal, sizeof(HitterSketch));
+    if (checkpoint_pwrite(fd, &hitterGlobal, sizeof(HitterSketch), hdr.offset[0]) != 0)
+        return -1;
+    crc = crc32c(crc, &eventTime.sourceWatermark, hdr.size[1]);
+    if (checkpoint_pwrite(fd, &eventTime.sourceWatermark, hdr.size[1], hdr.offset[1]) != 0)
+        return -1;
+
+    for (i = 0; i < JOIN_PARTITIONS; i++) {
+        JoinPartition *jp = &joinPartitions[i];
+        JoinEntry *e;
+        counters[i].matched = jp->matched;
+        counters[i].evicted[0] = jp->evicted[0];
+        counters[i].evicted[1] = jp->evicted[1];
+        memcpy(counters[i].latency, jp->latency, sizeof(jp->latency));
+        for (e = jp->oldest; e != NULL; e = e->newer) {                 // Arrival order, so restore can replay it
+            joinBuf[n].correlationId = e->correlationId;
+            joinBuf[n].eventId = e->eventId;
+            joinBuf[n].timestamp = e->timestamp;
+            joinBuf[n].response = e->response;
+            if (++n == (int)(sizeof(joinBuf) / sizeof(joinBuf[0]))) {
+                crc = crc32c(crc, joinBuf, n * sizeof(JoinRecord));
+                if (checkpoint_pwrite(fd, joinBuf, n * sizeof(JoinRecord), hdr.offset[3] + joinCount * sizeof(JoinRecord)) != 0)
+                    return -1;
+                joinCount += n;
+                n = 0;
+            }
+        }
+    }
+    crc = crc32c(crc, joinBuf, n * sizeof(JoinRecord));
+    if (checkpoint_pwrite(fd, joinBuf, n * sizeof(JoinRecord), hdr.offset[3] + joinCount * sizeof(JoinRecord)) != 0)
+        return -1;
+    joinCount += n;
+    crc = crc32c(crc, counters, sizeof(counters));
+    if (checkpoint_pwrite(fd, counters, sizeof(counters), hdr.offset[2]) != 0)
+        return -1;
+
+    if (checkpoint_pwrite(fd, recentStore.buckets, sizeof(recentStore.buckets), hdr.offset[4]) != 0)
+        return -1;
+    if (next - fromSeq > RECENT_CAPACITY || fromSeq > next)
+        fromSeq = next > RECENT_CAPACITY ? next - RECENT_CAPACITY : 0;
+    for (seq = fromSeq; seq < next; ) {                                 // Changed entries only, in runs of contiguous slots
+        unsigned long long slot = seq & (RECENT_CAPACITY - 1);
+        int run = 0;
+        while (run < (int)(sizeof(entryBuf) / sizeof(entryBuf[0])) && seq + run < next &&
+               slot + run < RECENT_CAPACITY) {
+            RecentEntry *e = &entryBuf[run];
+            *e = recentStore.entries[slot + run];
+            if (e->isBorrowed) {
+                const char *payload = e->borrowed;                      // Shares its storage with prefix
+                memcpy(e->prefix, payload, e->len);
+                e->isBorrowed = 0;
+            }
+            run++;
+        }
+        if (checkpoint_pwrite(fd, entryBuf, run * sizeof(RecentEntry),
+                              hdr.offset[4] + sizeof(recentStore.buckets) + slot * sizeof(RecentEntry)) != 0)
+            return -1;
+        seq += run;
+    }
+
+    if (fdatasync(fd) != 0)
+        return -1;
+    for (off = 0; off < hdr.size[4]; ) {                                // Checksum the recent store as it is on disk
+        size_t want = hdr.size[4] - off < sizeof(entryBuf) ? (size_t)(hdr.size[4] - off) : sizeof(entryBuf);
+        ssize_t got = pread(fd, entryBuf, want, (off_t)(hdr.offset[4] + off));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        crc = crc32c(crc, entryBuf, (size_t) got);
+        off += got;
+    }
+    hdr.complete = 1;
+    hdr.checksum = crc;
+    hdr.joinEntries = joinCount;
+    if (checkpoint_pwrite(fd, &hdr, sizeof(hdr), 0) != 0 || fdatasync(fd) != 0)
+        return -1;
+    close(fd);
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -checkpoint_start
+ *
+ * @brief                     -Fork a child that writes a snapshot of the stage state
+ *
+ * @param[in]                 nowNs   Current time
+ *
+ * @return                    -none
+ * @note                      The stage locks are taken only around fork(), which copies page tables and not
+ *                            memory, so readers wait at most a few milliseconds and only if they touch a locked
+ *                            stage. Snapshots alternate between the two files, so the previous one stays valid
+ *                            while the next is written.
+ ********************************************************/
+static void checkpoint_start(unsigned long long nowNs) {
+    Checkpointer *cp = &checkpointer;
+    int target = (cp->target + 1) & 1, i;
+    unsigned long long fromSeq, pauseNs;
+    char path[PATH_MAX];
+    pid_t pid;
+
+    snprintf(path, sizeof(path), "%s.%d", cp->path, target);
+    fromSeq = cp->fileSeq[target] > CHECKPOINT_RECENT_SLACK ? cp->fileSeq[target] - CHECKPOINT_RECENT_SLACK : 0;
+    for (i = 0; i < JOIN_PARTITIONS; i++)
+        pthread_mutex_lock(&joinPartitions[i].lock);
+    pthread_mutex_lock(&hitterLock);
+    pthread_mutex_lock(&eventTime.lock);
+    pauseNs = now_ns();
+    cp->pendingSeq = __atomic_load_n(&recentStore.next, __ATOMIC_ACQUIRE);
+    pid = fork();
+    if (pid == 0)
+        _exit(checkpoint_write(path, cp->generation + 1, cp->fileSeq[target] ? fromSeq : 0) == 0 ? 0 : 1);
+    pthread_mutex_unlock(&eventTime.lock);
+    pthread_mutex_unlock(&hitterLock);
+    for (i = JOIN_PARTITIONS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&joinPartitions[i].lock);
+    cp->lastPauseNs = now_ns() - pauseNs;
+
+    cp->startedNs = nowNs;
+    if (pid < 0) {
+        cp->failed++;
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot fork the checkpoint writer.");
+        return;
+    }
+    cp->child = pid;
+    cp->target = target;
+    cp->fileSeq[target] = 0;                                            // Unknown until the child succeeds
+}
+
+/********************************************************
+ * @fn                        -checkpoint_poll
+ *
+ * @brief                     -Reap a finished snapshot writer and start the next snapshot when due
+ *
+ * @param[in]                 nowNs   Current time
+ * @param[in]                 force   Nonzero to start a snapshot now unless one is running
+ *
+ * @return                    -none
+ * @note                      Called with controlLock held. Does nothing unless -s was given.
+ ********************************************************/
+void checkpoint_poll(unsigned long long nowNs, int force) {
+    Checkpointer *cp = &checkpointer;
+    char msg[160];
+    int status;
+
+    if (cp->path == NULL)
+        return;
+    if (cp->child > 0) {
+        if (waitpid(cp->child, &status, WNOHANG) != cp->child)
+            return;                                                     // Still writing
+        cp->child = 0;
+        cp->lastDurationNs = nowNs - cp->startedNs;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            cp->generation++;
+            cp->fileSeq[cp->target] = cp->pendingSeq;
+            cp->taken++;
+            snprintf(msg, sizeof(msg), "Checkpoint: generation %llu written to %s.%d in %.1f ms (stages paused %.0f us)",
+                     cp->generation, cp->path, cp->target, cp->lastDurationNs / 1e6, cp->lastPauseNs / 1e3);
+            log_message(msg);
+        } else {
+            cp->failed++;
+            log_message_level(LOG_LEVEL_ERROR, "Error: Checkpoint writer failed; previous snapshot kept.");
+        }
+    }
+    if (force || nowNs - cp->startedNs >= CHECKPOINT_PERIOD_NS)
+        checkpoint_start(nowNs);
+}
+
+/********************************************************
+ * @fn                        -checkpoint_restore
+ *
+ * @brief                     -Load the newest complete snapshot and enable periodic snapshots
+ *
+ * @param[in]                 path   Snapshot files are <path>.0 and <path>.1
+ *
+ * @return                    0 if state was restored, -1 if there was no usable snapshot
+ * @note                      Called by main before any thread starts. The file is mapped, not read, and its
+ *                            sections are copied into place. Join entries are replayed in arrival order.
+ *                            Event-time windows are only restored if they are still within reach of the
+ *                            current time (the monotonic clock restarts at boot). Snapshots continue either way.
+ *                            Recent-store entries that do not belong to their slot or lie past the stored end are
+ *                            invalidated, and no entry keeps a borrowed pointer from the previous run.
+ ********************************************************/
+int checkpoint_restore(const char *path) {
+    const CheckpointHeader *best = NULL;
+    CheckpointHeader expect;
+    void *maps[2] = { NULL, NULL };
+    size_t lens[2] = { 0, 0 };
+    char name[PATH_MAX], msg[200];
+    int i, bestFile = -1;
+
+    checkpointer.path = path;
+    checkpointer.target = 1;                                            // First snapshot goes to <path>.0
+    checkpointer.startedNs = now_ns();
+    checkpoint_layout(&expect);
+    for (i = 0; i < 2; i++) {
+        struct stat st;
+        int fd;
+        const CheckpointHeader *hdr;
+
+        snprintf(name, sizeof(name), "%s.%d", path, i);
+        fd = open(name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(CheckpointHeader)) {
+            maps[i] = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            lens[i] = st.st_size;
+            if (maps[i] == MAP_FAILED)
+                maps[i] = NULL;
+        }
+        close(fd);
+        hdr = (const CheckpointHeader*) maps[i];
+        if (hdr == NULL || hdr->magic != CHECKPOINT_MAGIC || hdr->version != CHECKPOINT_VERSION || !hdr->complete ||
+            memcmp(hdr->offset, expect.offset, sizeof(expect.offset)) != 0 ||
+            memcmp(hdr->size, expect.size, sizeof(expect.size)) != 0 ||
+            hdr->offset[CHECKPOINT_SECTIONS - 1] + hdr->size[CHECKPOINT_SECTIONS - 1] > lens[i] ||
+            hdr->joinEntries > (unsigned long long) JOIN_PARTITIONS * JOIN_MAX_PENDING)
+            continue;
+        if (best == NULL || hdr->generation > best->generation) {
+            best = hdr;
+            bestFile = i;
+        }
+    }
+
+    if (best != NULL) {
+        const char *base = (const char*) best;
+        unsigned int crc = crc32c(0, base + best->offset[0], best->size[0]);
+        crc = crc32c(crc, base + best->offset[1], best->size[1]);
+        crc = crc32c(crc, base + best->offset[3], best->joinEntries * sizeof(JoinRecord));
+        crc = crc32c(crc, base + best->offset[2], best->size[2]);
+        crc = crc32c(crc, base + best->offset[4], best->size[4]);
+        if (crc != best->checksum) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Checkpoint checksum mismatch, starting with empty state.");
+            best = NULL;
+        }
+    }
+    if (best != NULL) {
+        const char *base = (const char*) best;
+        const JoinCounters *counters = (const JoinCounters*) (base + best->offset[2]);
+        const JoinRecord *records = (const JoinRecord*) (base + best->offset[3]);
+        EventTime restored;
+        unsigned long long j, window;
+
+        memcpy(&hitterGlobal, base + best->offset[0], sizeof(HitterSketch));
+        memcpy(&restored.sourceWatermark, base + best->offset[1], best->size[1]);
+        window = now_ns() / EVENT_WINDOW_NS;
+        if (restored.purgedUpTo <= window && window < restored.purgedUpTo + EVENT_WINDOW_SLOTS)
+            memcpy(&eventTime.sourceWatermark, &restored.sourceWatermark, best->size[1]);
+        for (j = 0; j < best->joinEntries; j++) {
+            DataPacket packet;
+            memset(&packet, 0, sizeof(packet));
+            packet.eventCorrelationId = records[j].correlationId;
+            packet.eventId = records[j].eventId;
+            packet.timestamp = records[j].timestamp;
+            packet.flags = records[j].response ? PACKET_FLAG_RESPONSE : PACKET_FLAG_REQUEST;
+            join_observe(&packet);                                      // Unmatched entries never pair with each other
+        }
+        for (i = 0; i < JOIN_PARTITIONS; i++) {
+            joinPartitions[i].matched = counters[i].matched;
+            joinPartitions[i].evicted[0] = counters[i].evicted[0];
+            joinPartitions[i].evicted[1] = counters[i].evicted[1];
+            memcpy(joinPartitions[i].latency, counters[i].latency, sizeof(counters[i].latency));
+        }
+        memcpy(recentStore.buckets, base + best->offset[4], sizeof(recentStore.buckets));
+        memcpy(recentStore.entries, base + best->offset[4] + sizeof(recentStore.buckets), sizeof(recentStore.entries));
+        recentStore.next = best->recentNext;                            // Entries torn at the snapshot fail their version check
+        for (j = 0; j < RECENT_BUCKETS; j++) {
+            if (recentStore.buckets[j] > best->recentNext)
+                recentStore.buckets[j] = 0;
+        }
+        for (j = 0; j < RECENT_CAPACITY; j++) {
+            RecentEntry *e = &recentStore.entries[j];
+            unsigned long long seq = e->version / 2 - 1;
+            if (e->version < 2 || (e->version & 1) || (seq & (RECENT_CAPACITY - 1)) != j || seq >= best->recentNext ||
+                e->prevSame > best->recentNext || e->len > RECENT_PREFIX)
+                e->version = 0;                                         // Never readable: no seq maps to version 0
+            if (e->isBorrowed) {
+                e->isBorrowed = 0;                                      // The pointer was into the last run's corpus
+                e->len = 0;
+            }
+        }
+
+        checkpointer.generation = best->generation;
+        checkpointer.target = bestFile;
+        checkpointer.fileSeq[bestFile] = best->recentNext;              // The next snapshot of this file is incremental
+        snprintf(msg, sizeof(msg), "Checkpoint: restored generation %llu from %s.%d (%llu join entries, %llu packets stored)",
+                 best->generation, path, bestFile, best->joinEntries, best->recentNext);
+        log_message(msg);
+    }
+    for (i = 0; i < 2; i++) {
+        if (maps[i] != NULL)
+            munmap(maps[i], lens[i]);
+    }
+    return best != NULL ? 0 : -1;
+}
+
+/********************************************************
+ * @fn                        -log_segment_number
+ *
+ * @brief                     -Parse the segment number of a LOG_FILE.<n> or LOG_FILE.<n>.qz file name
+ *
+ * @param[in]                 name         Directory entry name
+ * @param[out]                compressed   Set to 1 for a .qz segment, 0 for a sealed plain one
+ *
+ * @return                    Segment number, or 0 if name is not a segment
+ ********************************************************/
+static unsigned int log_segment_number(const char *name, int *compressed) {
+    size_t prefix = strlen(LOG_FILE);
+    char *end;
+    unsigned long n;
+
+    if (strncmp(name, LOG_FILE ".", prefix + 1) != 0 || name[prefix + 1] < '1' || name[prefix + 1] > '9')
+        return 0;
+    n = strtoul(name + prefix + 1, &end, 10);
+    if (strcmp(end, "") == 0)
+        *compressed = 0;
+    else if (strcmp(end, ".qz") == 0)
+        *compressed = 1;
+    else
+        return 0;                                                       // Including .qz.tmp leftovers
+    return n > 0 && n < UINT_MAX ? (unsigned int) n : 0;
+}
+
+/********************************************************
+ * @fn                        -log_segments_init
+ *
+ * @brief                     -Continue segment numbering after the segments already on disk
+ *
+ * @return                    -none
+ * @note                      Called by main before any thread starts.
+ ********************************************************/
+void log_segments_init(void) {
+    DIR *dir = opendir(".");
+    struct dirent *de;
+    int compressed;
+
+    compactor.nextSegment = 1;
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        unsigned int n = log_segment_number(de->d_name, &compressed);
+        if (n >= compactor.nextSegment)
+            compactor.nextSegment = n + 1;
+    }
+    closedir(dir);
+}
+
+/********************************************************
+ * @fn                        -log_rotate_poll
+ *
+ * @brief                     -Seal LOG_FILE as the next segment once it reaches the configured size
+ *
+ * @param[in]                 nowNs   Current time
+ *
+ * @return                    -none
+ * @note                      Called with controlLock held. The file is renamed and a fresh LOG_FILE is
+ *                            dup2()ed over logFd, so every thread switches files atomically without a lock on
+ *                            the logging path. A write racing the switch still lands in the sealed segment,
+ *                            which is why the compactor lets a segment settle for SEGMENT_SETTLE_NS.
+ ********************************************************/
+void log_rotate_poll(unsigned long long nowNs) {
+    long limit = config_read_begin()->logSegmentBytes;
+    char name[PATH_MAX], msg[PATH_MAX + 64];
+    struct stat st;
+    int fd;
+
+    config_read_end();
+    pthread_once(&logOnce, log_open);
+    if (limit <= 0 || logFd < 0 || fstat(logFd, &st) != 0 || st.st_size < limit)
+        return;
+
+    snprintf(name, sizeof(name), "%s.%u", LOG_FILE, compactor.nextSegment);
+    if (rename(LOG_FILE, name) != 0)
+        return;
+    fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        rename(name, LOG_FILE);                                         // Keep logging to the old file
+        return;
+    }
+    dup2(fd, logFd);
+    close(fd);
+    __atomic_store_n(&compactor.nextSegment, compactor.nextSegment + 1, __ATOMIC_RELEASE); // Read by the compactor
+    __atomic_store_n(&compactor.rotatedNs, nowNs, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&compactor.sealed, 1, __ATOMIC_RELEASE);
+    futex_wake(&compactor.sealed, 1);
+    snprintf(msg, sizeof(msg), "Log: rotated %lld bytes to %s.", (long long) st.st_size, name);
+    log_message(msg);
+}
+
+/********************************************************
+ * @fn                        -compact_throttle
+ *
+ * @brief                     -Sleep long enough to keep the compactor inside its CPU and I/O budget
+ *
+ * @param[in]                 cpuNs     Thread CPU time spent on the last chunk
+ * @param[in]                 wallNs    Wall time the last chunk took
+ * @param[in]                 ioBytes   Bytes read and written for the last chunk
+ *
+ * @return                    -none
+ ********************************************************/
+static void compact_throttle(unsigned long long cpuNs, unsigned long long wallNs, unsigned long long ioBytes) {
+    Config cfg = *config_read_begin();
+    unsigned long long cpuSleep, ioSleep, sleepNs;
+    struct timespec ts;
+
+    config_read_end();
+    cpuSleep = cpuNs * (100 - cfg.compactCpuPercent) / cfg.compactCpuPercent;
+    ioSleep = ioBytes * 1000 / (unsigned long long) cfg.compactIoMb;    // ns at compactIoMb MB/s
+    ioSleep = ioSleep > wallNs ? ioSleep - wallNs : 0;
+    sleepNs = cpuSleep > ioSleep ? cpuSleep : ioSleep;
+    if (sleepNs == 0)
+        return;
+    ts.tv_sec = sleepNs / 1000000000ULL;
+    ts.tv_nsec = sleepNs % 1000000000ULL;
+    nanosleep(&ts, NULL);
+    __atomic_fetch_add(&compactor.throttledNs, sleepNs, __ATOMIC_RELAXED);
+}
+
+/********************************************************
+ * @fn                        -compact_segment
+ *
+ * @brief                     -Compress a sealed log segment into <segment>.qz and remove the original
+ *
+ * @param[in]                 path   Sealed segment
+ *
+ * @return                    0 on success, -1 on error (the original is kept)
+ * @note                      Chunks are compressed independently (no dictionary), so any one can be decoded
+ *                            on its own through the index at the end of the file. The output is written to
+ *                            a temporary name, synced and renamed, so a crash leaves either the original or
+ *                            a complete .qz. Both files are dropped from the page cache as they are processed.
+ ********************************************************/
+static int compact_segment(const char *path) {
+    static char raw[SEGMENT_CHUNK], packed[SEGMENT_CHUNK];
+    SegmentHeader hdr = { SEGMENT_MAGIC, SEGMENT_VERSION, SEGMENT_CHUNK, 0 };
+    SegmentTrailer trailer;
+    SegmentChunk *index = NULL;
+    char tmp[PATH_MAX + 8], out[PATH_MAX + 8];
+    unsigned long long fileOffset = sizeof(hdr), rawTotal = 0;
+    unsigned int chunks = 0, capacity = 0;
+    struct stat st;
+    int src, dst = -1, rc = -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.qz.tmp", path);
+    snprintf(out, sizeof(out), "%s.qz", path);
+    src = open(path, O_RDONLY | O_CLOEXEC);
+    if (src < 0 || fstat(src, &st) != 0)
+        goto done;
+    capacity = (unsigned int)(st.st_size / SEGMENT_CHUNK + 1);
+    index = (SegmentChunk*) malloc(capacity * sizeof(SegmentChunk));
+    dst = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (index == NULL || dst < 0 || checkpoint_pwrite(dst, &hdr, sizeof(hdr), 0) != 0)
+        goto done;
+
+    for (;;) {
+        struct timespec cpu0, cpu1;
+        unsigned long long wall0 = now_ns();
+        ssize_t n, got = 0;
+        long size;
+        const char *stored = packed;
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+        while (got < SEGMENT_CHUNK && (n = pread(src, raw + got, SEGMENT_CHUNK - got, (off_t)(rawTotal + got))) > 0)
+            got += n;
+        if (got == 0)
+            break;
+        if (chunks == capacity)
+            goto done;                                                  // Segment grew after it was sealed
+        size = lz_compress(NULL, raw, (int) got, packed, (int) got - 1);
+        if (size < 0) {
+            size = got;                                                 // Incompressible chunk: store it as is
+            stored = raw;
+        }
+        index[chunks].fileOffset = fileOffset;
+        index[chunks].packedBytes = (unsigned int) size;
+        index[chunks].rawBytes = (unsigned int) got;
+        index[chunks].checksum = crc32c(0, raw, got);
+        index[chunks].reserved = 0;
+        if (checkpoint_pwrite(dst, stored, size, fileOffset) != 0)
+            goto done;
+        posix_fadvise(src, (off_t) rawTotal, got, POSIX_FADV_DONTNEED);
+        fileOffset += size;
+        rawTotal += got;
+        chunks++;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+        compact_throttle((cpu1.tv_sec - cpu0.tv_sec) * 1000000000ULL + cpu1.tv_nsec - cpu0.tv_nsec,
+                         now_ns() - wall0, got + size);
+    }
+
+    trailer.indexOffset = fileOffset;
+    trailer.rawBytes = rawTotal;
+    trailer.chunks = chunks;
+    trailer.magic = SEGMENT_MAGIC;
+    if (checkpoint_pwrite(dst, index, chunks * sizeof(SegmentChunk), fileOffset) != 0 ||
+        checkpoint_pwrite(dst, &trailer, sizeof(trailer), fileOffset + chunks * sizeof(SegmentChunk)) != 0 ||
+        fdatasync(dst) != 0 || rename(tmp, out) != 0)
+        goto done;
+    posix_fadvise(dst, 0, 0, POSIX_FADV_DONTNEED);
+    unlink(path);
+    __atomic_fetch_add(&compactor.compacted, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&compactor.rawBytes, (unsigned long) rawTotal, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&compactor.packedBytes, (unsigned long)(fileOffset + chunks * sizeof(SegmentChunk) + sizeof(trailer)),
+                       __ATOMIC_RELAXED);
+    rc = 0;
+done:
+    if (rc != 0 && dst >= 0)
+        unlink(tmp);
+    if (dst >= 0) close(dst);
+    if (src >= 0) close(src);
+    free(index);
+    return rc;
+}
+
+/********************************************************
+ * @fn                        -log_segment_read
+ *
+ * @brief                     -Read log text from a segment, compressed or not, at a raw offset
+ *
+ * @param[in]                 path     Segment file (LOG_FILE.<n> or LOG_FILE.<n>.qz)
+ * @param[in]                 offset   Offset in the original, uncompressed segment
+ * @param[out]                buf      Destination
+ * @param[in]                 len      Bytes wanted
+ *
+ * @return                    Bytes read (0 at the end), or -1 if the file is unreadable or corrupt
+ * @note                      A compressed segment is located through its trailer and index; only the chunks
+ *                            covering [offset, offset + len) are read and decompressed.
+ ********************************************************/
+long log_segment_read(const char *path, unsigned long long offset, char *buf, size_t len) {
+    SegmentHeader hdr;
+    SegmentTrailer trailer;
+    struct stat st;
+    char *chunk = NULL, *packed = NULL;
+    long done = 0;
+    size_t plen = strlen(path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (plen < 3 || strcmp(path + plen - 3, ".qz") != 0) {              // Still plain
+        done = pread(fd, buf, len, (off_t) offset);
+        close(fd);
+        return done;
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(hdr) + sizeof(trailer) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        pread(fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) != sizeof(trailer) ||
+        hdr.magic != SEGMENT_MAGIC || hdr.version != SEGMENT_VERSION || trailer.magic != SEGMENT_MAGIC ||
+        hdr.chunkSize == 0 || hdr.chunkSize > (1U << 30) ||
+        trailer.indexOffset + (unsigned long long) trailer.chunks * sizeof(SegmentChunk) + sizeof(trailer) != (unsigned long long) st.st_size)
+        goto corrupt;
+    chunk = (char*) malloc(hdr.chunkSize);
+    packed = (char*) malloc(hdr.chunkSize);
+    if (chunk == NULL || packed == NULL)
+        goto corrupt;
+
+    while ((size_t) done < len && offset < trailer.rawBytes) {
+        unsigned long long i = offset / hdr.chunkSize, skip = offset % hdr.chunkSize, take;
+        SegmentChunk e;
+        if (i >= trailer.chunks ||
+            pread(fd, &e, sizeof(e), (off_t)(trailer.indexOffset + i * sizeof(SegmentChunk))) != sizeof(e) ||
+            e.rawBytes > hdr.chunkSize || e.packedBytes > e.rawBytes || skip >= e.rawBytes ||
+            pread(fd, packed, e.packedBytes, (off_t) e.fileOffset) != (ssize_t) e.packedBytes)
+            goto corrupt;
+        if (e.packedBytes == e.rawBytes)
+            memcpy(chunk, packed, e.rawBytes);
+        else if (lz_decompress(NULL, packed, (int) e.packedBytes, chunk, (int) e.rawBytes) != (long) e.rawBytes)
+            goto corrupt;
+        if (crc32c(0, chunk, e.rawBytes) != e.checksum)
+            goto corrupt;
+        take = e.rawBytes - skip < len - done ? e.rawBytes - skip : len - done;
+        memcpy(buf + done, chunk + skip, take);
+        done += (long) take;
+        offset += take;
+    }
+    free(chunk);
+    free(packed);
+    close(fd);
+    return done;
+corrupt:
+    free(chunk);
+    free(packed);
+    close(fd);
+    return -1;
+}
+
+/********************************************************
+ * @fn                        -compactor_thread
+ *
+ * @brief                     -Background thread compressing sealed log segments
+ *
+ * @param[in]                 arg   Unused
+ *
+ * @return                    -none
+ * @note                      Runs at the lowest CPU priority and in the idle I/O class, so it only uses time
+ *                            nothing else wants, and on top of that paces itself to `compact_cpu_percent` and
+ *                            `compact_io_mb` (compact_throttle). Segments are compressed oldest first, left
+ *                            over ones from earlier runs included. Sleeps on the rotation futex otherwise.
+ ********************************************************/
+void *compactor_thread(void *arg) {
+    char name[PATH_MAX];
+    (void) arg;
+
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), 19);
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);                             // IOPRIO_WHO_PROCESS (this thread), IOPRIO_CLASS_IDLE
+    while (1) {
+        unsigned int sealed = __atomic_load_n(&compactor.sealed, __ATOMIC_ACQUIRE);
+        unsigned int oldest = 0, newest = __atomic_load_n(&compactor.nextSegment, __ATOMIC_ACQUIRE) - 1;
+        struct dirent *de;
+        DIR *dir = opendir(".");
+        int compressed;
+
+        while (dir != NULL && (de = readdir(dir)) != NULL) {
+            unsigned int n = log_segment_number(de->d_name, &compressed);
+            if (n != 0 && !compressed && (oldest == 0 || n < oldest))
+                oldest = n;
+        }
+        if (dir != NULL)
+            closedir(dir);
+        if (oldest != 0 && oldest == newest &&
+            now_ns() - __atomic_load_n(&compactor.rotatedNs, __ATOMIC_ACQUIRE) < SEGMENT_SETTLE_NS)
+            oldest = 0;                                                 // Just sealed: let in-flight writes land
+        if (oldest == 0) {
+            log_flush();                                                // About to sleep: do not hold back log lines
+            futex_wait(&compactor.sealed, sealed, COMPACT_IDLE_NS);
+            continue;
+        }
+        snprintf(name, sizeof(name), "%s.%u", LOG_FILE, oldest);
+        if (compact_segment(name) != 0) {
+            __atomic_fetch_add(&compactor.failures, 1, __ATOMIC_RELAXED);
+            log_message_level(LOG_LEVEL_ERROR, "Error: Log segment compaction failed, retrying later.");
+            log_flush();
+            futex_wait(&compactor.sealed, sealed, COMPACT_IDLE_NS);
+        }
+    }
+    return NULL;
+}
+
+/********************************************************
+ * @fn                        -column_sink_open
+ *
+ * @brief                     -Open the columnar sink file for appending
+ *
+ * @param[in]                 path   File to append columnar blocks to; created if missing
+ *
+ * @return                    0 on success, -1 if the file cannot be opened
+ * @note                      Once open, readers write every packet to this file instead of stdout. Blocks are
+ *                            placed with pwrite at offsets reserved from columnFileEnd, which starts at the
+ *                            current end of the file.
+ ********************************************************/
+int column_sink_open(const char *path) {
+    off_t end;
+
+    columnFd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (columnFd < 0)
+        return -1;
+    end = lseek(columnFd, 0, SEEK_END);
+    if (end < 0) {
+        close(columnFd);
+        columnFd = -1;
+        return -1;
+    }
+    columnFileEnd = (unsigned long long) end;
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -column_batch_create
+ *
+ * @brief                     -Allocate a reader's columnar block
+ *
+ * @return                    Empty ColumnBatch, or NULL if memory allocation failed
+ * @note                      -none
+ ********************************************************/
+ColumnBatch *column_batch_create(void) {
+    ColumnBatch *b = (ColumnBatch*) calloc(1, sizeof(ColumnBatch));
+
+    if (b == NULL)
+        return NULL;
+    b->blob = (char*) malloc(COLUMN_BLOB_SIZE);
+    if (b->blob == NULL) {
+        free(b);
+        return NULL;
+    }
+    b->blobCap = COLUMN_BLOB_SIZE;
+    return b;
+}
+
+/********************************************************
+ * @fn                        -column_batch_add
+ *
+ * @brief                     -Append a packet to a reader's columnar block as one row
+ *
+ * @param[in]                 b        Reader's block
+ * @param[in]                 packet   Packet to store; its payload is released
+ *
+ * @return                    -none
+ * @note                      The block is written out first if the row would not fit. A payload larger than a
+ *                            whole block grows the payload column for that block.
+ ********************************************************/
+void column_batch_add(ColumnBatch *b, DataPacket *packet) {
+    size_t size = packet->size > 0 ? (size_t) packet->size : 0;
+    const Chunk *c;
+    int row;
+
+    if (b->rows == COLUMN_BATCH_ROWS || b->blobLen + size > b->blobCap)
+        column_batch_flush(b);
+    if (size > b->blobCap) {
+        char *blob = (char*) realloc(b->blob, size);
+        if (blob == NULL) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for columnar payload.");
+            packet_free(packet);
+            return;
+        }
+        b->blob = blob;
+        b->blobCap = size;
+    }
+
+    if (packet->chain != NULL) {
+        size_t off = 0;
+        for (c = packet->chain; c != NULL && off < size; c = c->next) {
+            size_t n = ((size_t) c->len < size - off) ? (size_t) c->len : size - off;
+            memcpy(b->blob + b->blobLen + off, c->data, n);
+            off += n;
+        }
+    } else if (size > 0) {
+        memcpy(b->blob + b->blobLen, packet->data, size);
+    }
+
+    row = b->rows++;
+    if (row == 0)
+        b->firstNs = now_ns();
+    b->values[0][row] = packet->eventId;
+    b->values[1][row] = packet->eventCorrelationId;
+    b->values[2][row] = packet->timestamp;
+    b->values[3][row] = size;
+    b->values[4][row] = b->blobLen;
+    b->blobLen += size;
+    packet_free(packet);
+}
+
+/********************************************************
+ * @fn                        -column_encode
+ *
+ * @brief                     -Encode one integer column, choosing the smaller of plain and delta-varint
+ *
+ * @param[in]                 values   Column values
+ * @param[in]                 rows     Number of values
+ * @param[out]                dst      Destination with room for 10 bytes per value
+ * @param[out]                desc     Receives encoding, bytes, min and max
+ *
+ * @return                    -none
+ * @note                      Ids, timestamps and offsets mostly grow by small steps, which delta-varint stores
+ *                            in one to three bytes instead of eight.
+ ********************************************************/
+static void column_encode(const unsigned long long *values, int rows, unsigned char *dst, ColumnDesc *desc) {
+    unsigned long long prev = 0, min = ~0ULL, max = 0;
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < rows; i++) {
+        unsigned long long v = values[i];
+        long long delta = (long long)(v - prev);
+        unsigned long long zz = ((unsigned long long) delta << 1) ^ (unsigned long long)(delta >> 63);
+        while (zz >= 0x80) {
+            dst[n++] = (unsigned char)(zz | 0x80);
+            zz >>= 7;
+        }
+        dst[n++] = (unsigned char) zz;
+        prev = v;
+        if (v < min) min = v;
+        if (v > max) max = v;
+    }
+    desc->min = rows > 0 ? min : 0;
+    desc->max = max;
+    if (n < (size_t) rows * 8) {
+        desc->encoding = COLUMN_ENC_DELTA_VARINT;
+        desc->bytes = (unsigned int) n;
+    } else {
+        desc->encoding = COLUMN_ENC_PLAIN;                              // Noisy column: varints would not pay off
+        desc->bytes = (unsigned int)(rows * 8);
+        memcpy(dst, values, (size_t) rows * 8);
+    }
+}
+
+/********************************************************
+ * @fn                        -column_batch_flush
+ *
+ * @brief                     -Encode a reader's columnar block and append it to the sink file
+ *
+ * @param[in]                 b   Reader's block; empty afterwards
+ *
+ * @return                    -none
+ * @note                      The block's whole extent is reserved from columnFileEnd first and written there with
+ *                            pwrite, so retrying a short write can never interleave with another reader's block.
+ *                            Rows are dropped with an error if the write fails; only completed blocks are counted.
+ ********************************************************/
+void column_batch_flush(ColumnBatch *b) {
+    static const char *names[COLUMN_COUNT] = { "event_id", "correlation_id", "timestamp_ns", "size",
+                                               "payload_offset", "payload" };
+    static const unsigned char types[COLUMN_COUNT] = { COLUMN_TYPE_U64, COLUMN_TYPE_U64, COLUMN_TYPE_U64,
+                                                       COLUMN_TYPE_U32, COLUMN_TYPE_U64, COLUMN_TYPE_BYTES };
+    size_t need = sizeof(ColumnBlockHeader) + COLUMN_COUNT * sizeof(ColumnDesc) +
+                  (COLUMN_COUNT - 1) * (size_t) b->rows * 10 + b->blobLen;
+    ColumnBlockHeader *hdr;
+    ColumnDesc *desc;
+    unsigned long long at;
+    size_t off, left;
+    int i;
+
+    if (b->rows == 0 || columnFd < 0)
+        return;
+    if (need > b->encodedCap) {
+        unsigned char *buf = (unsigned char*) realloc(b->encoded, need);
+        if (buf == NULL) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for columnar block.");
+            b->rows = 0;
+            b->blobLen = 0;
+            return;
+        }
+        b->encoded = buf;
+        b->encodedCap = need;
+    }
+
+    hdr = (ColumnBlockHeader*) b->encoded;
+    desc = (ColumnDesc*) (hdr + 1);
+    memset(desc, 0, COLUMN_COUNT * sizeof(ColumnDesc));
+    off = sizeof(ColumnBlockHeader) + COLUMN_COUNT * sizeof(ColumnDesc);
+    for (i = 0; i < COLUMN_COUNT; i++) {
+        strncpy(desc[i].name, names[i], sizeof(desc[i].name));
+        desc[i].type = types[i];
+        if (types[i] == COLUMN_TYPE_BYTES) {
+            long packed = payloadDict.size > 0 ? lz_compress(&payloadDict, b->blob, (int) b->blobLen, b->encoded + off,
+                                                             (int) b->blobLen - 1) : -1;
+            if (packed >= 0) {
+                desc[i].encoding = COLUMN_ENC_LZ_DICT;                  // Payload text shares most of its bytes
+                desc[i].bytes = (unsigned int) packed;
+                desc[i].min = payloadDict.id;
+                desc[i].max = b->blobLen;
+            } else {
+                desc[i].encoding = COLUMN_ENC_PLAIN;
+                desc[i].bytes = (unsigned int) b->blobLen;
+                memcpy(b->encoded + off, b->blob, b->blobLen);
+            }
+        } else {
+            column_encode(b->values[i], b->rows, b->encoded + off, &desc[i]);
+        }
+        off += desc[i].bytes;
+    }
+    hdr->magic = COLUMN_BLOCK_MAGIC;
+    hdr->version = COLUMN_VERSION;
+    hdr->columns = COLUMN_COUNT;
+    hdr->rows = (unsigned int) b->rows;
+    hdr->blockBytes = off;
+    hdr->checksum = crc32c(0, desc, off - sizeof(ColumnBlockHeader));
+
+    at = __atomic_fetch_add(&columnFileEnd, (unsigned long long) off, __ATOMIC_RELAXED); // This block's extent
+    for (left = off; left > 0; ) {
+        ssize_t written = pwrite(columnFd, b->encoded + (off - left), left, (off_t)(at + (off - left)));
+        if (written <= 0) {
+            if (written < 0 && errno == EINTR)
+                continue;
+            log_message_level(LOG_LEVEL_ERROR, "Error: Columnar sink write failed, block dropped.");
+            break;                                                      // Its checksum marks the extent as unreadable
+        }
+        left -= written;
+    }
+    if (left == 0) {
+        __atomic_fetch_add(&columnBlocks, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&columnRows, b->rows, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&columnRawBytes, (unsigned long)((COLUMN_COUNT - 1) * 8 * b->rows + b->blobLen),
+                           __ATOMIC_RELAXED);
+        __atomic_fetch_add(&columnFileBytes, (unsigned long) off, __ATOMIC_RELAXED);
+    }
+    b->rows = 0;
+    b->blobLen = 0;
+}
+
+/********************************************************
+ * @fn                        -shard_sink_open
+ *
+ * @brief                     -Prepare the directory readers write their output shards to
+ *
+ * @param[in]                 dir   Shard directory; created if missing
+ *
+ * @return                    0 on success, -1 if the directory cannot be used
+ * @note                      Shards of an earlier run are removed: eventIds restart with the process (unless the
+ *                            queue is file-backed), and a shard has to be sorted for the merge.
+ ********************************************************/
+int shard_sink_open(const char *dir) {
+    struct dirent *de;
+    char path[PATH_MAX];
+    DIR *d;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    d = opendir(dir);
+    if (d == NULL)
+        return -1;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, "shard.", 6) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    shardDir = dir;
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -direct_buffer_get
+ *
+ * @brief                     -Take a DIRECT_ALIGN-aligned shard buffer from the pool, or allocate one
+ *
+ * @return                    SHARD_BUFFER_SIZE bytes, or NULL on allocation failure
+ ********************************************************/
+static char *direct_buffer_get(void) {
+    char *buf = NULL;
+
+    pthread_mutex_lock(&directPoolLock);
+    if (directPoolCount > 0)
+        buf = directPool[--directPoolCount];
+    pthread_mutex_unlock(&directPoolLock);
+    return buf != NULL ? buf : (char*) aligned_alloc(DIRECT_ALIGN, SHARD_BUFFER_SIZE);
+}
+
+/********************************************************
+ * @fn                        -direct_buffer_put
+ *
+ * @brief                     -Return a shard buffer to the pool, freeing it if the pool is full
+ ********************************************************/
+static void direct_buffer_put(char *buf) {
+    if (buf == NULL)
+        return;
+    pthread_mutex_lock(&directPoolLock);
+    if (directPoolCount < DIRECT_POOL) {
+        directPool[directPoolCount++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&directPoolLock);
+    free(buf);
+}
+
+/********************************************************
+ * @fn                        -direct_record
+ *
+ * @brief                     -Count one completed shard write in the O_DIRECT latency histogram, bucket b < 2^b us
+ ********************************************************/
+static void direct_record(unsigned long long ns) {
+    unsigned long long us;
+    int b = 0;
+
+    for (us = ns / 1000; us > 0 && b < DIRECT_LATENCY_BUCKETS - 1; us >>= 1)
+        b++;
+    __atomic_fetch_add(&directLatency[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&directWrites, 1, __ATOMIC_RELAXED);
+}
+
+/********************************************************
+ * @fn                        -direct_fallback
+ *
+ * @brief                     -Switch a shard writer to buffered I/O after an O_DIRECT write failed
+ *
+ * @param[in]                 w     Shard writer
+ * @param[in]                 buf   Block-aligned data that did not make it to disk
+ * @param[in]                 len   Bytes of buf
+ * @param[in]                 off   File offset of buf
+ *
+ * @return                    -none
+ * @note                      The writer keeps its block bookkeeping, so the file layout does not change; only
+ *                            the page cache is used from now on.
+ ********************************************************/
+static void direct_fallback(ShardWriter *w, const char *buf, size_t len, unsigned long long off) {
+    int flags = fcntl(w->fd, F_GETFL);
+
+    if (flags >= 0 && (flags & O_DIRECT)) {
+        fcntl(w->fd, F_SETFL, flags & ~O_DIRECT);
+        log_message_level(LOG_LEVEL_ERROR, "Error: O_DIRECT shard write failed, using buffered writes.");
+    }
+    __atomic_fetch_add(&directFallbacks, 1, __ATOMIC_RELAXED);
+    if (checkpoint_pwrite(w->fd, buf, len, off) != 0)
+        log_message_level(LOG_LEVEL_ERROR, "Error: Shard write failed, frames dropped.");
+}
+
+/********************************************************
+ * @fn                        -direct_reap
+ *
+ * @brief                     -Collect the completion of a shard writer's write in flight
+ *
+ * @param[in]                 w      Shard writer
+ * @param[in]                 wait   Block until the write is done (needed before its buffer is reused)
+ *
+ * @return                    -none
+ ********************************************************/
+static void direct_reap(ShardWriter *w, int wait) {
+    struct io_event ev;
+    struct timespec zero = { 0, 0 };
+    unsigned long long startNs = now_ns();
+    long n;
+
+    if (!w->inflight)
+        return;
+    do {
+        n = syscall(SYS_io_getevents, w->aio, wait ? 1 : 0, 1, &ev, wait ? NULL : &zero);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0)
+        return;
+    if (wait)
+        __atomic_fetch_add(&directStallNs, now_ns() - startNs, __ATOMIC_RELAXED);
+    w->inflight = 0;
+    if (n < 0 || ev.res != (long long) w->iocb.aio_nbytes) {
+        direct_fallback(w, (const char*) (uintptr_t) w->iocb.aio_buf, w->iocb.aio_nbytes, w->iocb.aio_offset);
+        return;
+    }
+    direct_record(now_ns() - w->submitNs);
+}
+
+/********************************************************
+ * @fn                        -direct_submit
+ *
+ * @brief                     -Start writing whole blocks of a shard writer, asynchronously when possible
+ *
+ * @param[in]                 w     Shard writer, with no write in flight
+ * @param[in]                 buf   DIRECT_ALIGN-aligned data; stays untouched until the write is reaped
+ * @param[in]                 len   Multiple of DIRECT_ALIGN
+ * @param[in]                 off   Block-aligned file offset
+ *
+ * @return                    -none
+ * @note                      Uses the kernel AIO syscalls directly (no libaio). Without an AIO context, or if
+ *                            the submission is refused, the write is done synchronously with pwrite.
+ ********************************************************/
+static void direct_submit(ShardWriter *w, char *buf, size_t len, unsigned long long off) {
+    struct iocb *list[1] = { &w->iocb };
+
+    memset(&w->iocb, 0, sizeof(w->iocb));
+    w->iocb.aio_lio_opcode = IOCB_CMD_PWRITE;
+    w->iocb.aio_fildes = w->fd;
+    w->iocb.aio_buf = (unsigned long long) (uintptr_t) buf;
+    w->iocb.aio_nbytes = len;
+    w->iocb.aio_offset = off;
+    w->submitNs = now_ns();
+    if (w->aio != 0 && syscall(SYS_io_submit, w->aio, 1, list) == 1) {
+        w->inflight = 1;
+        return;
+    }
+    if (pwrite(w->fd, buf, len, off) == (ssize_t) len)
+        direct_record(now_ns() - w->submitNs);
+    else
+        direct_fallback(w, buf, len, off);
+}
+
+/********************************************************
+ * @fn                        -shard_writer_create
+ *
+ * @brief                     -Open the output shard of a reader
+ *
+ * @param[in]                 index   Reader slot; the shard is <shardDir>/shard.<index>
+ *
+ * @return                    Writer, or NULL on error
+ * @note                      Appends, so a replacement reader reusing a slot continues its shard. With -D the
+ *                            shard is opened with O_DIRECT: the partial last block is read back into the buffer
+ *                            and rewritten with the next frames. If the filesystem refuses O_DIRECT the shard is
+ *                            written through the page cache as without -D.
+ ********************************************************/
+ShardWriter *shard_writer_create(int index) {
+    ShardWriter *w = (ShardWriter*) calloc(1, sizeof(ShardWriter));
+    char path[PATH_MAX];
+
+    if (w == NULL)
+        return NULL;
+    w->buf = direct_buffer_get();
+    if (w->buf == NULL) {
+        free(w);
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/shard.%d", shardDir, index);
+    w->fd = -1;
+    if (shardDirect) {
+        w->fd = open(path, O_RDWR | O_CREAT | O_DIRECT | O_CLOEXEC, 0644);
+        w->spare = w->fd >= 0 ? direct_buffer_get() : NULL;
+        if (w->spare != NULL) {
+            struct stat st;
+            if (fstat(w->fd, &st) == 0) {
+                w->fileOffset = st.st_size & ~(unsigned long long) (DIRECT_ALIGN - 1);
+                w->len = w->carried = st.st_size - w->fileOffset;
+                if (w->len > 0 && pread(w->fd, w->buf, DIRECT_ALIGN, w->fileOffset) < (ssize_t) w->len)
+                    w->len = w->carried = 0;                            // Unreadable tail: overwrite the block
+            }
+            if (syscall(SYS_io_setup, 1, &w->aio) != 0)
+                w->aio = 0;                                             // No kernel AIO: synchronous O_DIRECT writes
+            w->direct = 1;
+            return w;
+        }
+        if (w->fd >= 0)
+            close(w->fd);
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot open shard with O_DIRECT, using buffered writes.");
+        __atomic_fetch_add(&directFallbacks, 1, __ATOMIC_RELAXED);
+    }
+    w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        direct_buffer_put(w->buf);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/********************************************************
+ * @fn                        -shard_writer_flush
+ *
+ * @brief                     -Append a reader's buffered frames to its shard
+ *
+ * @param[in]                 w   Reader's shard writer
+ *
+ * @return                    -none
+ * @note                      Only whole frames are ever buffered, so a shard never ends mid-frame unless a
+ *                            write fails, and the merge stops at such a tail.
+ *                            With -D the buffer is written as whole blocks, the last one zero-padded, while the
+ *                            reader carries on in the second buffer; the partial block is kept and written
+ *                            again by the next flush. The previous write is reaped first, so at most one write
+ *                            per shard is in flight and they complete in file order.
+ ********************************************************/
+void shard_writer_flush(ShardWriter *w) {
+    size_t off = 0;
+
+    if (w->direct) {
+        size_t full = w->len & ~(size_t) (DIRECT_ALIGN - 1), tail = w->len - full;
+        char *t;
+
+        if (w->len == w->carried)
+            return;
+        direct_reap(w, 1);                                              // Frees the spare buffer
+        if (tail > 0) {
+            memset(w->buf + w->len, 0, DIRECT_ALIGN - tail);            // Padding the merge recognizes as "no frame yet"
+            memcpy(w->spare, w->buf + full, tail);
+        }
+        direct_submit(w, w->buf, full + (tail > 0 ? DIRECT_ALIGN : 0), w->fileOffset);
+        __atomic_fetch_add(&shardBytes, (unsigned long) (w->len - w->carried), __ATOMIC_RELAXED);
+        t = w->buf;
+        w->buf = w->spare;
+        w->spare = t;
+        w->fileOffset += full;
+        w->len = w->carried = tail;
+        return;
+    }
+    while (off < w->len) {
+        ssize_t n = write(w->fd, w->buf + off, w->len - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_message_level(LOG_LEVEL_ERROR, "Error: Shard write failed, frames dropped.");
+            break;
+        }
+        off += n;
+    }
+    __atomic_fetch_add(&shardBytes, (unsigned long) w->len, __ATOMIC_RELAXED);
+    w->len = 0;
+}
+
+/********************************************************
+ * @fn                        -shard_writer_poll
+ *
+ * @brief                     -Reap a finished O_DIRECT shard write without waiting
+ *
+ * @param[in]                 w   Reader's shard writer
+ *
+ * @return                    -none
+ * @note                      Called once per batch so completion latency is measured close to the real value
+ *                            instead of when the next flush needs the buffer.
+ ********************************************************/
+void shard_writer_poll(ShardWriter *w) {
+    if (w->direct)
+        direct_reap(w, 0);
+}
+
+/********************************************************
+ * @fn                        -shard_writer_close
+ *
+ * @brief                     -Flush, close and free a reader's shard writer
+ *
+ * @param[in]                 w   Reader's shard writer
+ *
+ * @return                    -none
+ * @note                      An O_DIRECT shard is truncated to its real length, dropping the padding of the
+ *                            last block; buffers go back to the pool for the next reader.
+ ********************************************************/
+void shard_writer_close(ShardWriter *w) {
+    shard_writer_flush(w);
+    if (w->direct) {
+        direct_reap(w, 1);
+        if (ftruncate(w->fd, w->fileOffset + w->len) != 0)
+            log_message_level(LOG_LEVEL_ERROR, "Error: Cannot trim shard padding.");
+        if (w->aio != 0)
+            syscall(SYS_io_destroy, w->aio);
+        direct_buffer_put(w->spare);
+    }
+    close(w->fd);
+    direct_buffer_put(w->buf);
+    free(w);
+}
+
+/********************************************************
+ * @fn                        -shard_writer_add
+ *
+ * @brief                     -Append one packet to a reader's shard as a wire frame
+ *
+ * @param[in]                 w        Reader's shard writer
+ * @param[in]                 packet   Packet to write; its buffer is released
+ *
+ * @return                    -none
+ * @note                      Frames go through wire_encode_packed, so payloads are compressed when a dictionary
+ *                            is loaded (-z). Readers take batches in queue order, so each shard is sorted by
+ *                            eventId without any coordination between readers.
+ ********************************************************/
+void shard_writer_add(ShardWriter *w, DataPacket *packet) {
+    size_t frame = WIRE_FRAME_SIZE(packet->size);
+
+    if (w->len + frame > SHARD_BUFFER_SIZE - (w->direct ? DIRECT_ALIGN : 0)) // Room for the padding of a direct flush
+        shard_writer_flush(w);
+    if (frame > SHARD_BUFFER_SIZE - DIRECT_ALIGN) {                     // Larger than the whole buffer: write it alone
+        size_t cap = (w->len + frame + DIRECT_ALIGN) & ~(size_t) (DIRECT_ALIGN - 1);
+        char *big = (char*) aligned_alloc(DIRECT_ALIGN, cap);
+        long n = -1;
+
+        if (big != NULL) {
+            memcpy(big, w->buf, w->len);                                // Direct: carried partial block goes first
+            n = wire_encode_packed(packet, big + w->len, frame);
+        }
+        if (n > 0 && w->direct) {
+            size_t end = w->len + n, full = end & ~(size_t) (DIRECT_ALIGN - 1);
+            direct_reap(w, 1);
+            memset(big + end, 0, cap - end);
+            direct_submit(w, big, (end + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1), w->fileOffset);
+            direct_reap(w, 1);                                          // big is freed below
+            memcpy(w->buf, big + full, end - full);
+            w->fileOffset += full;
+            w->len = w->carried = end - full;
+            __atomic_fetch_add(&shardBytes, (unsigned long) n, __ATOMIC_RELAXED);
+        } else if (n > 0 && write(w->fd, big, n) == n) {
+            __atomic_fetch_add(&shardBytes, (unsigned long) n, __ATOMIC_RELAXED);
+        } else {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Shard write failed, frames dropped.");
+        }
+        free(big);
+    } else {
+        w->len += wire_encode_packed(packet, w->buf + w->len, SHARD_BUFFER_SIZE - w->len);
+    }
+    __atomic_fetch_add(&shardFrames, 1, __ATOMIC_RELAXED);
+    packet_free(packet);
+}
+
+/********************************************************
+ * @fn                        -merge_fill
+ *
+ * @brief                     -Make the next frame of a merge input available, reading more of the shard if needed
+ *
+ * @param[in]                 in            Merge input
+ * @param[in]                 byTimestamp   Sort by timestamp instead of eventId
+ *
+ * @return                    1 if a frame is buffered, 0 if the shard has no complete frame yet
+ * @note                      Frames are validated with wire_decode. A corrupt frame ends the input: without a
+ *                            valid length there is no safe way to find the next one. A zero header is the padding
+ *                            of a shard written with -D and means no more frames yet.
+ ********************************************************/
+static int merge_fill(MergeInput *in, int byTimestamp) {
+    DataPacket view;
+
+    for (;;) {
+        long frame = wire_decode(in->buf + in->start, in->end - in->start, &view);
+        ssize_t n;
+
+        if (frame < 0 && ((const WireHeader*) (in->buf + in->start))->magic == 0) {
+            in->offset -= in->end - in->start;                          // Zero padding of an O_DIRECT tail block:
+            in->end = in->start;                                        // re-read it once the writer has filled it
+            return 0;
+        }
+        if (frame > 0) {
+            in->frame = frame;
+            in->key = byTimestamp ? view.timestamp : view.eventId;
+            return 1;
+        }
+        if (frame < 0) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Corrupt shard frame, rest of the shard skipped.");
+            in->done = 1;
+            return 0;
+        }
+        if (in->start > 0) {                                            // Keep frames at aligned buffer offsets
+            memmove(in->buf, in->buf + in->start, in->end - in->start);
+            in->end -= in->start;
+            in->start = 0;
+        }
+        if (in->end == MERGE_BUFFER_SIZE) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Shard frame larger than the merge buffer, shard skipped.");
+            in->done = 1;
+            return 0;
+        }
+        n = pread(in->fd, in->buf + in->end, MERGE_BUFFER_SIZE - in->end, in->offset);
+        if (n <= 0)
+            return 0;                                                   // End of the shard for now
+        in->end += n;
+        in->offset += n;
+    }
+}
+
+/********************************************************
+ * @fn                        -merge_less
+ *
+ * @brief                     -Heap order of merge inputs: key, then shard for a stable order of equal keys
+ ********************************************************/
+static inline int merge_less(const MergeInput *in, int a, int b) {
+    return in[a].key < in[b].key || (in[a].key == in[b].key && a < b);
+}
+
+/********************************************************
+ * @fn                        -merge_sift_down
+ *
+ * @brief                     -Restore the min-heap of input indices below position i
+ ********************************************************/
+static void merge_sift_down(const MergeInput *in, int *heap, int count, int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i, t;
+        if (l < count && merge_less(in, heap[l], heap[m])) m = l;
+        if (r < count && merge_less(in, heap[r], heap[m])) m = r;
+        if (m == i)
+            return;
+        t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+/********************************************************
+ * @fn                        -shard_merge
+ *
+ * @brief                     -Merge the shards of a directory into one stream ordered by eventId or timestamp
+ *
+ * @param[in]                 dir           Shard directory written with -o
+ * @param[in]                 byTimestamp   Order by producer timestamp instead of eventId
+ * @param[in]                 follow        Keep merging as readers append (live merge) instead of stopping at the end
+ *
+ * @return                    0 on success, 1 on error
+ * @note                      k-way merge with a binary heap of the shard heads: memory is MERGE_BUFFER_SIZE per
+ *                            shard whatever the shard sizes. Frames are copied to stdout unchanged.
+ *                            In live mode the smallest frame can only be emitted once every shard has a frame
+ *                            buffered; a shard holds the merge back from the moment it runs dry until it has had
+ *                            nothing new for MERGE_IDLE_NS (parked reader), and again once it grows. Frames that arrive after a larger key
+ *                            was emitted are still written and counted as out of order.
+ ********************************************************/
+int shard_merge(const char *dir, int byTimestamp, int follow) {
+    MergeInput in[MAX_READERS];
+    int heap[MAX_READERS], count = 0, i, k = 0;
+    char path[PATH_MAX], *out = (char*) malloc(MERGE_BUFFER_SIZE);
+    unsigned long long last = 0, frames = 0, late = 0;
+    size_t outLen = 0;
+
+    for (i = 0; i < MAX_READERS && out != NULL; i++) {
+        snprintf(path, sizeof(path), "%s/shard.%d", dir, i);
+        memset(&in[k], 0, sizeof(in[k]));
+        in[k].fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (in[k].fd < 0)
+            continue;
+        in[k].buf = (char*) aligned_alloc(WIRE_ALIGN, MERGE_BUFFER_SIZE);
+        if (in[k].buf == NULL) {
+            close(in[k].fd);
+            continue;
+        }
+        posix_fadvise(in[k].fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        k++;
+    }
+    if (k == 0) {
+        fprintf(stderr, "merge: no shards in %s\n", dir);
+        free(out);
+        return 1;
+    }
+
+    for (;;) {
+        unsigned long long nowNs = now_ns();
+        int waiting = 0;
+
+        count = 0;                                                      // Rebuild the heap from the inputs with a frame
+        for (i = 0; i < k; i++) {
+            if (in[i].frame == 0 && !in[i].done && !merge_fill(&in[i], byTimestamp) && !in[i].done) {
+                if (!follow) {
+                    in[i].done = 1;
+                } else {
+                    if (in[i].idleSinceNs == 0)
+                        in[i].idleSinceNs = nowNs;                      // Just ran dry, here or in the loop below
+                    if (nowNs - in[i].idleSinceNs < MERGE_IDLE_NS)
+                        waiting = 1;                                    // May still produce a smaller key
+                }
+            }
+            if (in[i].frame > 0) {
+                in[i].idleSinceNs = 0;
+                heap[count++] = i;
+            }
+        }
+        for (i = count / 2 - 1; i >= 0; i--)
+            merge_sift_down(in, heap, count, i);
+
+        while (count > 0 && !waiting) {
+            MergeInput *m = &in[heap[0]];
+            if (outLen + m->frame > MERGE_BUFFER_SIZE) {
+                if (write(STDOUT_FILENO, out, outLen) != (ssize_t) outLen)
+                    return 1;
+                outLen = 0;
+            }
+            if (m->key < last)
+                late++;
+            last = m->key;
+            memcpy(out + outLen, m->buf + m->start, m->frame);
+            outLen += m->frame;
+            frames++;
+            m->start += m->frame;
+            m->frame = 0;
+            if (merge_fill(m, byTimestamp)) {
+                merge_sift_down(in, heap, count, 0);
+            } else {
+                heap[0] = heap[--count];                                // Ran dry: rebuild once every input is checked
+                merge_sift_down(in, heap, count, 0);
+                if (!m->done)
+                    break;
+            }
+        }
+        if (outLen > 0) {
+            if (write(STDOUT_FILENO, out, outLen) != (ssize_t) outLen)
+                return 1;
+            outLen = 0;
+        }
+        if (!follow) {
+            for (i = 0; i < k && in[i].done; i++)
+                ;
+            if (i == k)
+                break;
+        } else {
+            struct timespec ts = { 0, MERGE_POLL_NS };
+            nanosleep(&ts, NULL);
+        }
+    }
+    fprintf(stderr, "merge: %llu frames from %d shards, %llu out of order\n", frames, k, late);
+    for (i = 0; i < k; i++) {
+        close(in[i].fd);
+        free(in[i].buf);
+    }
+    free(out);
+    return 0;
+}
+
+/********************************************************
+ * @fn                        -writer_thread
+ *
+ * @brief                     -Writer thread
+ *
+ * @param[in]                 arg       Index of the writer, cast to a pointer
+ *
+ * @return                    -none
+ * @note                      This function represents a writer thread that continuously retrieves
+ *                            external data, encapsulates it into a `DataPacket` structure, and enqueues
+ *                            the packet into a shared queue (`dataQueue`) for processing by reader threads.
+ *                            Packets carry the id of a simulated session as their `eventCorrelationId`; a
+ *                            session alternates request and response packets (PACKET_FLAG_REQUEST/RESPONSE).
+ *                            Payloads of up to `message_size` bytes are slices of the payload corpus, either
+ *                            borrowed by reference or copied into pooled chunks (`payload_mode`).
+ *                            Packets are handed over in batches sized by the `enqueueBatch` controller; a
+ *                            partial batch is submitted once it has waited BATCH_LATENCY_TARGET_NS.
+ *                            Each writer is paced to 1/N of the configured `rate_limit`, if any.
+ *                            If data retrieval fails or returns an empty packet, memory allocated for the
+ *                            data buffer (`packet.chain`) is returned to the pool to avoid memory leaks.
+ ********************************************************/
+void *writer_thread(void *arg) {
+    unsigned int source = (unsigned int)(unsigned long) arg;            // Stamped on every packet for watermarks
+    DataPacket batch[BATCH_MAX];
+    int pending = 0;
+    unsigned long long firstNs = 0, nextSendNs = 0;
+    unsigned long correlationId = 0;                                    // Session the writer is currently sending for
+    int awaitingResponse = 0;                                           // Next packet of the session is its response
+
+    while (1) {
+        DataPacket packet;
+        const Config *cfg = config_read_begin();
+        long rateLimit = cfg->rateLimit;
+        int messageSize = cfg->messageSize;
+        int payloadMode = cfg->payloadMode;
+        config_read_end();
+
+        if (rateLimit > 0) {                                            // Pace this writer to its share of the limit
+            unsigned long long now = now_ns();
+            if (nextSendNs > now) {
+                struct timespec pause = { 0, 0 };
+                if (pending > 0) {
+                    enqueue_batch(&dataQueue, batch, pending);          // Do not hold packets while pacing
+                    batch_controller_observe(&enqueueBatch, pending, now - firstNs);
+                    pending = 0;
+                }
+                pause.tv_sec = (nextSendNs - now) / 1000000000ULL;
+                pause.tv_nsec = (nextSendNs - now) % 1000000000ULL;
+                log_flush();                                            // About to sleep: do not hold back log lines
+                nanosleep(&pause, NULL);
+                now = nextSendNs;
+            }
+            nextSendNs = now + (unsigned long long)N * 1000000000ULL / rateLimit;
+        }
+
+        packet.flags = 0;
+        if (payloadMode == PAYLOAD_MODE_COPY)
+            packet.size = get_external_data_chain(&packet, messageSize); // Retrieve external data into pooled chunks
+        else
+            packet.size = get_external_data_ref(&packet, messageSize);  // Borrow external data from the corpus
+        if (packet.size < 0) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for data packet.");
+            continue;                                                   // Handle memory allocation failure
+        }
+        if (correlationId == 0 || (!awaitingResponse && (fast_rand() & 15) == 0))
+            correlationId = 1 + fast_rand() % WRITER_CORRELATIONS;      // Start a new session now and then
+        packet.flags |= awaitingResponse ? PACKET_FLAG_RESPONSE : PACKET_FLAG_REQUEST;
+        packet.eventId = 0;                                             // Assigned by enqueue_batch
+        packet.eventCorrelationId = correlationId;
+        packet.timestamp = now_ns();                                    // Stamp the packet as it enters the pipeline
+        packet.source = source;
+
+        if (packet.size > 0) {
+            awaitingResponse = !awaitingResponse;                       // Sessions alternate requests and responses
+            if (pending == 0)
+                firstNs = now_ns();
+            batch[pending++] = packet;                                  // Collect the packet into the current batch
+        } else {
+            packet_free(&packet);                                       // Clean up if data retrieval failed
+        }
+
+        if (pending > 0 && (pending >= batch_controller_size(&enqueueBatch) ||
+                            now_ns() - firstNs >= BATCH_LATENCY_TARGET_NS)) {
+            enqueue_batch(&dataQueue, batch, pending);                  // Enqueue the batch of data packets
+            batch_controller_observe(&enqueueBatch, pending, now_ns() - firstNs);
+            pending = 0;
+        }
+    }
+    return NULL;
+}
+
+/********************************************************
+ * @fn                        -reader_thread
+ *
+ * @brief                     -Reader thread
+
+ *
+ * @param[in]                 arg       Pointer to the ReaderState slot of this reader
+ *
+ * @return                    -none
+ * @note                      This function represents a reader thread that continuously dequeues
+ *                            batches of data packets from a shared queue (`dataQueue`), sized by the
+ *                            `dequeueBatch` controller. Each valid data packet is processed using the
+ *                            `process_data` function and the associated memory of the data buffer
+ *                            (`packet.data`) is then freed. Chunked payloads are instead gathered and written
+ *                            with one writev per output batch, then their chunks go back to the pool.
+ *                            stdout is flushed every `outputBatch` packets.
+ *                            Packets are claimed one at a time from the slot's batch and a heartbeat is
+ *                            stored after each, so `watchdog_thread` can take back what a stuck reader has
+ *                            not started yet. A reader the watchdog gave up on exits once it unblocks.
+ *                            Between batches the reader parks itself if the configuration asks for fewer readers.
+ *                            Scratch memory from reader_scratch is released when the batch is done.
+ *                            Every packet is also recorded in the recent-packet store and counted in the reader's
+ *                            heavy-hitter sketch, which is merged into `hitterGlobal` every HITTER_MERGE_NS, and
+ *                            counted in its event-time window once per batch (event_batch_flush).
+ *                            With a columnar sink open, packets are collected into blocks and appended to it
+ *                            instead of being written to stdout.
  ********************************************************/
 void *reader_thread(void *arg) {
+    ReaderState *r = (ReaderState*) arg;
+    OutputVec out;                                                      // Chunked payloads waiting for one writev
+    ColumnBatch *cols = NULL;                                           // Rows waiting for the columnar sink
+    ShardWriter *shard = NULL;                                          // Frames waiting for this reader's shard
+    HitterSketch *hitters = (HitterSketch*) calloc(1, sizeof(HitterSketch)); // Traffic per correlation id
+    EventBatch events;                                                  // Event-time window counts of the batch
+    int unflushed = 0;
+    unsigned long long unflushedSinceNs = 0;
+    unsigned long long claim = 0;                                       // Last batchClaim word this reader published
+
+    output_init(&out, &forwardSink, STDOUT_FILENO);
+    memset(&events, 0, sizeof(events));
+    if (columnFd >= 0 && (cols = column_batch_create()) == NULL)
+        log_message_level(LOG_LEVEL_ERROR, "Error: Memory allocation failed for columnar block, using text output.");
+    readerColumns = cols;                                               // Flushed by dequeue_batch before it blocks
+    readerEventHold = events.holdNs = &r->eventHoldNs;
+    if (cols == NULL && shardDir != NULL && (shard = shard_writer_create(r->index)) == NULL)
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot open output shard, using text output.");
+    readerShard = shard;                                                // Likewise its shard frames
+    readerArena = &r->arena;                                            // Scratch memory for process_data and handlers
+    while (!__atomic_load_n(&r->stalled, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&r->parkRequested, __ATOMIC_ACQUIRE)) {
+            if (cols != NULL)
+                column_batch_flush(cols);
+            if (shard != NULL)
+                shard_writer_flush(shard);
+            if (hitters != NULL)
+                hitter_merge(hitters, now_ns());
+            output_flush(&out);
+            fflush(stdout);
+            log_flush();
+            __atomic_store_n(&r->parked, 1, __ATOMIC_RELEASE);
+            while (__atomic_load_n(&r->parkRequested, __ATOMIC_ACQUIRE))
+                sem_wait(&r->park);                                     // Out of service until the configuration resumes us
+            __atomic_store_n(&r->parked, 0, __ATOMIC_RELEASE);
+        }
+
+        Pulse pulse;
+        int pulses = 0, flushNow = 0;
+
+        while (pulses < PULSE_BATCH && pulse_receive(&pulseRing, &pulse)) {
+            pulses++;                                                   // Control pulses go ahead of packets
+            if (pulse.code == PULSE_CODE_FLUSH)
+                flushNow = 1;
+            else
+                pulse_handle(&pulse);
+        }
+
+        int count = dequeue_batch(&dataQueue, r->batch, batch_controller_size(&dequeueBatch));
+        unsigned long long startNs = now_ns();
+        unsigned long long recentNs;
+        unsigned long long recentSeq = recent_store_reserve(count, &recentNs); // Store entries of this batch
+        int i;
+
+        unsigned long long waitNs = (count > 0 && r->batch[0].timestamp != 0 && r->batch[0].timestamp < startNs) ?
+                                    startNs - r->batch[0].timestamp : 0; // Queue wait of the oldest packet
+
+        __atomic_store_n(&r->heartbeatNs, startNs, __ATOMIC_RELAXED);
+        claim = BATCH_CLAIM(BATCH_CLAIM_GEN(claim) + 1, count, 0);      // A new generation: stale watchdog claims fail
+        __atomic_store_n(&r->batchClaim, claim, __ATOMIC_RELEASE);      // After batch[] and the heartbeat
+        __atomic_store_n(&r->busy, 1, __ATOMIC_RELEASE);                // Batch is now visible to the watchdog
+
+        while ((i = BATCH_CLAIM_NEXT(__atomic_fetch_add(&r->batchClaim, 1, __ATOMIC_ACQ_REL))) < count) {
+            DataPacket packet = r->batch[i];                            // Next data packet of the batch
+            if (packet.size > 0) {
+                recent_store_insert(recentSeq + i, &packet, recentNs);  // Keep a copy for incident queries
+                if (hitters != NULL)
+                    hitter_observe(hitters, &packet);
+                if (packet.flags & (PACKET_FLAG_REQUEST | PACKET_FLAG_RESPONSE))
+                    join_observe(&packet);                              // Pair requests with their responses
+                event_batch_add(&events, &packet);
+            }
+            if (packet.size > 0 && cols != NULL) {
+                column_batch_add(cols, &packet);                        // One row of the columnar block
+            } else if (packet.size > 0) {
+                if (shard != NULL) {
+                    shard_writer_add(shard, &packet);                   // Frame for this reader's shard
+                } else if (packet.chain != NULL || (packet.flags & PACKET_FLAG_BORROWED)) {
+                    output_add(&out, &packet);                          // Chunked or borrowed: gathered and written with writev
+                } else {
+                    process_data(packet.data, packet.size);             // Process the data packet
+                    packet_free(&packet);                               // Free the data buffer after processing
+                }
+                if (unflushed++ == 0)
+                    unflushedSinceNs = startNs;
+            }
+            __atomic_store_n(&r->heartbeatNs, now_ns(), __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+        if (count > 0)
+            event_batch_flush(&events, now_ns());                       // Window counts and watermark advance
+        else
+            __atomic_store_n(&r->eventHoldNs, 0, __ATOMIC_RELEASE);     // Claimed nothing after all
+        arena_reset(&r->arena);                                         // All scratch memory of the batch at once
+        if (count > 0) {
+            __atomic_fetch_add(&packetsProcessed, count, __ATOMIC_RELAXED);
+            batch_controller_observe(&dequeueBatch, count, waitNs);
+        }
+
+        if (unflushed > 0 && (flushNow || unflushed >= batch_controller_size(&outputBatch) ||
+                              now_ns() - unflushedSinceNs >= BATCH_LATENCY_TARGET_NS ||
+                              __atomic_load_n(&dataQueue.ready, __ATOMIC_RELAXED) == 0)) {
+            output_flush(&out);                                         // Write gathered chunked payloads
+            fflush(stdout);                                             // Flush output once per output batch
+            if (shard != NULL)
+                shard_writer_flush(shard);
+            batch_controller_observe(&outputBatch, unflushed, now_ns() - unflushedSinceNs);
+            unflushed = 0;
+        }
+        if (shard != NULL)
+            shard_writer_poll(shard);                                   // Reap a finished O_DIRECT write
+        if (cols != NULL && cols->rows > 0 && now_ns() - cols->firstNs >= COLUMN_FLUSH_NS)
+            column_batch_flush(cols);                                   // Bound how stale the file can get at low rates
+        if (hitters != NULL && now_ns() - hitters->stampNs >= HITTER_MERGE_NS)
+            hitter_merge(hitters, now_ns());
+        batch_metrics_report();
+    }
+
+    readerColumns = NULL;
+    readerShard = NULL;
+    if (cols != NULL) {
+        column_batch_flush(cols);
+        free(cols->blob);
+        free(cols->encoded);
+        free(cols);
+    }
+    if (shard != NULL)
+        shard_writer_close(shard);
+    if (hitters != NULL) {
+        hitter_merge(hitters, now_ns());
+        free(hitters);
+    }
+    output_close(&out);
+    fflush(stdout);
+    log_message("Watchdog: stalled reader resumed and retired.");
+    log_flush();
+    return NULL;
+}
+
+/********************************************************
+ * @fn                        -start_reader
+ *
+ * @brief                     -Start a reader thread in the next free ReaderState slot
+ *
+ * @return                    Pointer to the slot, or NULL if MAX_READERS slots are used up or the thread failed
+ * @note                      -none
+ ********************************************************/
+ReaderState *start_reader(void) {
+    int index = __atomic_fetch_add(&readerCount, 1, __ATOMIC_ACQ_REL);
+    ReaderState *r;
+
+    if (index >= MAX_READERS) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: No reader slot left.");
+        return NULL;
+    }
+    r = &readerStates[index];
+    r->index = index;
+    r->heartbeatNs = now_ns();
+    sem_init(&r->park, 0, 0);
+    if (pthread_create(&r->thread, NULL, reader_thread, r) != 0) {
+        log_message_level(LOG_LEVEL_ERROR, "Error: Failed to create reader thread.");
+        return NULL;
+    }
+    return r;
+}
+
+/********************************************************
+ * @fn                        -watchdog_thread
+ *
+ * @brief                     -Watchdog thread detecting and replacing stalled readers
+ *
+ * @param[in]                 arg       Pointer to optional thread argument (not used in this function)
+ *
+ * @return                    -none
+ * @note                      Every WATCHDOG_PERIOD_NS the heartbeat of each busy reader is checked. A reader
+ *                            that made no progress for READER_STALL_NS is marked stalled, the packets of its
+ *                            batch it has not claimed yet are requeued at the head of `dataQueue`, and a
+ *                            replacement reader is started so throughput is kept. Idle readers blocked in
+ *                            `dequeue_batch` are not busy and are never considered stalled. The watchdog claims
+ *                            the rest of a batch with a compare-and-swap on the reader's batchClaim word, which
+ *                            carries the batch generation, so a claim can never land on (or be undone by) the
+ *                            reader's next batch and no packet is both requeued and processed.
+ ********************************************************/
+void *watchdog_thread(void *arg) {
+    struct timespec period = { WATCHDOG_PERIOD_NS / 1000000000ULL, WATCHDOG_PERIOD_NS % 1000000000ULL };
+    char line[160];
+
+    while (1) {
+        int count = __atomic_load_n(&readerCount, __ATOMIC_ACQUIRE);
+        unsigned long long now;
+        int i;
+
+        nanosleep(&period, NULL);
+        now = now_ns();
+        if (count > MAX_READERS)
+            count = MAX_READERS;
+
+        for (i = 0; i < count; i++) {
+            ReaderState *r = &readerStates[i];
+            unsigned long long beat, claim;
+            int next, end, pending = 0;
+
+            if (__atomic_load_n(&r->stalled, __ATOMIC_ACQUIRE) || !__atomic_load_n(&r->busy, __ATOMIC_ACQUIRE))
+                continue;
+            claim = __atomic_load_n(&r->batchClaim, __ATOMIC_ACQUIRE);  // Heartbeat is stored before the claim word
+            beat = __atomic_load_n(&r->heartbeatNs, __ATOMIC_RELAXED);
+            if (now < beat || now - beat < READER_STALL_NS)
+                continue;
+
+            __atomic_store_n(&r->stalled, 1, __ATOMIC_RELEASE);
+            do {                                                        // Take the rest of whichever batch is current
+                next = BATCH_CLAIM_NEXT(claim);
+                end = BATCH_CLAIM_END(claim);
+            } while (next < end && !__atomic_compare_exchange_n(&r->batchClaim, &claim,
+                                                                BATCH_CLAIM(BATCH_CLAIM_GEN(claim), end, end), 0,
+                                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+            if (next < end) {
+                pending = end - next;                                   // Packets the reader never claimed
+                requeue_front(&dataQueue, &r->batch[next], pending);    // batch[] belongs to the generation claimed
+            }
+            __atomic_fetch_add(&readerStalls, 1, __ATOMIC_RELAXED);
+
+            snprintf(line, sizeof(line), "Watchdog: reader %d stalled for %llu ms, requeued %d packets.",
+                     r->index, (now - beat) / 1000000ULL, pending);
+            log_message(line);
+            if (start_reader() == NULL)
+                log_message_level(LOG_LEVEL_ERROR, "Error: Watchdog could not start a replacement reader.");
+        }
+        log_flush();
+    }
+    return NULL;
+}
+
+/********************************************************
+ * @fn                        -apply_reader_count
+ *
+ * @brief                     -Bring the number of readers in service to target
+ *
+ * @param[in]                 target    Desired number of readers (at least 1)
+ *
+ * @return                    -none
+ * @note                      Surplus readers are parked from the highest slot down after their current batch;
+ *                            missing readers are resumed from parked slots first and started otherwise.
+ *                            Stalled readers do not count. Called with controlLock held.
+ ********************************************************/
+void apply_reader_count(int target) {
+    int count = __atomic_load_n(&readerCount, __ATOMIC_ACQUIRE);
+    int running = 0, i;
+
+    if (target < 1)
+        target = 1;
+    if (count > MAX_READERS)
+        count = MAX_READERS;
+
+    for (i = 0; i < count; i++) {
+        ReaderState *r = &readerStates[i];
+        if (__atomic_load_n(&r->stalled, __ATOMIC_ACQUIRE) || __atomic_load_n(&r->parkRequested, __ATOMIC_ACQUIRE))
+            continue;
+        if (running < target) {
+            running++;                                                  // Keep the lowest slots in service
+        } else {
+            __atomic_store_n(&r->parkRequested, 1, __ATOMIC_RELEASE);
+        }
+    }
+    for (i = 0; i < count && running < target; i++) {
+        ReaderState *r = &readerStates[i];
+        if (!__atomic_load_n(&r->stalled, __ATOMIC_ACQUIRE) && __atomic_load_n(&r->parkRequested, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&r->parkRequested, 0, __ATOMIC_RELEASE);
+            sem_post(&r->park);                                         // Harmless if the reader never parked
+            running++;
+        }
+    }
+    for (; running < target; running++) {
+        if (start_reader() == NULL)
+            break;
+    }
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_help, stats_cmd_stats, stats_cmd_reload
+ *
+ * @brief                     -Handlers of the built-in stats socket commands
+ *
+ * @param[in]                 args  Remainder of the command line after the command word
+ * @param[in]                 out   Stream the reply is written to
+ *
+ * @return                    -none
+ * @note                      -none
+ ********************************************************/
+static void stats_cmd_help(const char *args, FILE *out);
+
+static void stats_cmd_stats(const char *args, FILE *out) {
+    BatchController *controllers[] = { &enqueueBatch, &dequeueBatch, &logBatch, &outputBatch };
+    int count = __atomic_load_n(&readerCount, __ATOMIC_ACQUIRE);
+    int running = 0, parked = 0, stalled = 0, i;
+    unsigned long overflows = 0;
+    Config cfg = *config_read_begin();
+
+    config_read_end();
+    if (count > MAX_READERS)
+        count = MAX_READERS;
+    for (i = 0; i < count; i++) {
+        if (__atomic_load_n(&readerStates[i].stalled, __ATOMIC_ACQUIRE)) stalled++;
+        else if (__atomic_load_n(&readerStates[i].parked, __ATOMIC_ACQUIRE)) parked++;
+        else running++;
+        overflows += __atomic_load_n(&readerStates[i].arena.overflows, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&dataQueue.lock);
+    fprintf(out, "queue count=%d debt=%d capacity=%d\n", dataQueue.count, dataQueue.debt, dataQueue.capacity);
+    pthread_mutex_unlock(&dataQueue.lock);
+    fprintf(out, "wakeups published=%lu woken=%lu idle=%d\n", __atomic_load_n(&dataQueue.published, __ATOMIC_RELAXED),
+            __atomic_load_n(&dataQueue.wakeups, __ATOMIC_RELAXED), __atomic_load_n(&dataQueue.idle, __ATOMIC_RELAXED));
+    fprintf(out, "readers running=%d parked=%d stalled=%d stalls_total=%lu\n",
+            running, parked, stalled, __atomic_load_n(&readerStalls, __ATOMIC_RELAXED));
+    fprintf(out, "arena overflow_blocks=%lu\n", overflows);
+    fprintf(out, "pulses sent=%lu delivered=%lu coalesced=%lu dropped=%lu\n",
+            __atomic_load_n(&pulseRing.sent, __ATOMIC_RELAXED), __atomic_load_n(&pulseRing.delivered, __ATOMIC_RELAXED),
+            __atomic_load_n(&pulseRing.merged, __ATOMIC_RELAXED), __atomic_load_n(&pulseRing.dropped, __ATOMIC_RELAXED));
+    if (forwardSink.mode != FORWARD_OFF)
+        fprintf(out, "forward mode=%s spliced_bytes=%lu syscalls=%lu copied_bytes=%lu held_chains=%d%s\n",
+                forwardSink.mode == FORWARD_PIPE ? "pipe" : forwardSink.mode == FORWARD_SOCKET ? "socket" : "file",
+                __atomic_load_n(&forwardSink.bytes, __ATOMIC_RELAXED), __atomic_load_n(&forwardSink.calls, __ATOMIC_RELAXED),
+                __atomic_load_n(&forwardSink.copied, __ATOMIC_RELAXED),
+                __atomic_load_n(&forwardSink.heldChains, __ATOMIC_RELAXED), forwardSink.failed ? " failed" : "");
+    if (shardDir != NULL)
+        fprintf(out, "shards dir=%s frames=%lu bytes=%lu\n", shardDir, __atomic_load_n(&shardFrames, __ATOMIC_RELAXED),
+                __atomic_load_n(&shardBytes, __ATOMIC_RELAXED));
+    if (payloadDict.size > 0) {
+        unsigned long raw = __atomic_load_n(&compressRawBytes, __ATOMIC_RELAXED);
+        unsigned long packed = __atomic_load_n(&compressPackedBytes, __ATOMIC_RELAXED);
+        fprintf(out, "compression dictionary=%08x dict_bytes=%d ring_raw_bytes=%lu ring_packed_bytes=%lu ratio=%.2f\n",
+                payloadDict.id, payloadDict.size, raw, packed, packed ? (double) raw / packed : 0.0);
+    }
+    if (columnFd >= 0)
+        fprintf(out, "columnar blocks=%lu rows=%lu raw_bytes=%lu file_bytes=%lu\n",
+                __atomic_load_n(&columnBlocks, __ATOMIC_RELAXED), __atomic_load_n(&columnRows, __ATOMIC_RELAXED),
+                __atomic_load_n(&columnRawBytes, __ATOMIC_RELAXED), __atomic_load_n(&columnFileBytes, __ATOMIC_RELAXED));
+    for (i = 0; i < (int)(sizeof(controllers) / sizeof(controllers[0])); i++) {
+        BatchController *c = controllers[i];
+        pthread_mutex_lock(&c->lock);
+        fprintf(out, "batch %s size=%d max=%d rate=%.0f/s latency=%.0fns grows=%lu shrinks=%lu\n",
+                c->name, c->batchSize, c->maxSize, c->arrivalRate, c->latencyNs, c->grows, c->shrinks);
+        pthread_mutex_unlock(&c->lock);
+    }
+    fprintf(out, "config log_level=%d rate_limit=%ld readers=%d\n", cfg.logLevel, cfg.rateLimit, cfg.readers);
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_recent
+ *
+ * @brief                     -"recent [corr=<id>] [last=<seconds>] [limit=<n>]": query the recent-packet store
+ *
+ * @param[in]                 args   Optional filters
+ * @param[in]                 out    Reply stream
+ *
+ * @return                    -none
+ * @note                      Newest packets first. With corr the correlation index is followed and the time
+ *                            bound applies to linkedNs, which never increases along a chain. Otherwise the
+ *                            store is bisected on storedNs, which never decreases along seq; entries that are
+ *                            unused or still being written are stepped over rather than steering the search.
+ *                            Both stop at the time bound, so the cost follows the size of the answer rather than
+ *                            of the store. The last line reports how many packets matched within the scanned range.
+ ********************************************************/
+static void stats_cmd_recent(const char *args, FILE *out) {
+    unsigned long long corr = 0, sinceNs = 0, now = now_ns(), next, oldest, seq, link;
+    unsigned long matched = 0;
+    int limit = RECENT_QUERY_LIMIT, shown = 0, useCorr = 0;
+    double last = 0;
+    const char *p = args;
+    RecentEntry e;
+
+    while (*p != '\0') {
+        if (sscanf(p, "corr=%llu", &corr) == 1) useCorr = 1;
+        else if (sscanf(p, "last=%lf", &last) == 1 && last > 0) sinceNs = now - (unsigned long long)(last * 1e9);
+        else if (sscanf(p, "limit=%d", &limit) == 1 && limit < 0) limit = 0;
+        p += strcspn(p, " \t");
+        p += strspn(p, " \t");
+    }
+    if (sinceNs > now)
+        sinceNs = 0;
+
+    link = useCorr ? __atomic_load_n(&recentStore.buckets[(corr * 0x9E3779B97F4A7C15ULL) >> 50 &
+                                                          (RECENT_BUCKETS - 1)], __ATOMIC_ACQUIRE) : 0;
+    next = __atomic_load_n(&recentStore.next, __ATOMIC_ACQUIRE);        // After the head, so the head is below it
+    oldest = next > RECENT_CAPACITY ? next - RECENT_CAPACITY : 0;
+    if (useCorr) {
+        while (link != 0 && link - 1 < next && link - 1 >= oldest) {    // Links point back in link order, not seq
+            seq = link - 1;
+            if (recent_store_read(seq, &e) != 0 || e.linkedNs < sinceNs)
+                break;
+            if (e.correlationId == corr) {
+                if (shown < limit) {
+                    recent_store_print(&e, now, out);
+                    shown++;
+                }
+                matched++;
+            }
+            link = e.prevSame;
+        }
+    } else {
+        unsigned long long lo = oldest, hi = next;
+        while (lo < hi) {                                               // Time index: storedNs grows with seq
+            unsigned long long mid = lo + (hi - lo) / 2, probe = mid;
+            while (probe < hi && recent_store_read(probe, &e) != 0)
+                probe++;                                                // Unused or being written: no time to compare
+            if (probe == hi || e.storedNs >= sinceNs) hi = mid;
+            else lo = probe + 1;
+        }
+        matched = next - lo;
+        for (seq = next; seq > lo && shown < limit; seq--) {
+            if (recent_store_read(seq - 1, &e) == 0) {
+                recent_store_print(&e, now, out);
+                shown++;
+            }
+        }
+    }
+    fprintf(out, "matched=%lu shown=%d stored=%llu\n", matched, shown, next - oldest);
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_top
+ *
+ * @brief                     -"top [n]": heaviest correlation ids by packets and by bytes
+ *
+ * @param[in]                 args   Optional number of ids per list (default and maximum HITTER_TOP)
+ * @param[in]                 out    Reply stream
+ *
+ * @return                    -none
+ * @note                      Counts are count-min estimates over the merged reader sketches (decayed every
+ *                            HITTER_DECAY_NS), ranked among the Space-Saving candidates. Readers merge every
+ *                            HITTER_MERGE_NS, so the last second of traffic may be missing.
+ ********************************************************/
+static void stats_cmd_top(const char *args, FILE *out) {
+    HitterSketch *g = &hitterGlobal;
+    const char *titles[2] = { "packets", "bytes" };
+    int n = atoi(args), list, i, j;
+
+    if (n <= 0 || n > HITTER_TOP)
+        n = HITTER_TOP;
+    pthread_mutex_lock(&hitterLock);
+    fprintf(out, "total packets=%llu bytes=%llu\n", g->totalPackets, g->totalBytes);
+    for (list = 0; list < 2; list++) {
+        SpaceSaving *ss = list == 0 ? &g->topPackets : &g->topBytes;
+        HitterCounter ranked[HITTER_TOP];
+        unsigned long long total = list == 0 ? g->totalPackets : g->totalBytes;
+
+        for (i = 0; i < ss->size; i++) {                                // Rank candidates by their estimate
+            HitterCounter c = ss->heap[i];
+            c.count = hitter_estimate(list == 0 ? g->packets : g->bytes, c.key);
+            for (j = i; j > 0 && ranked[j - 1].count < c.count; j--)
+                ranked[j] = ranked[j - 1];
+            ranked[j] = c;
+        }
+        fprintf(out, "top by %s:\n", titles[list]);
+        for (i = 0; i < ss->size && i < n; i++) {
+            fprintf(out, "  corr=%llu %s=%llu share=%.2f%% packets=%llu bytes=%llu\n", ranked[i].key, titles[list],
+                    ranked[i].count, total ? 100.0 * ranked[i].count / total : 0.0,
+                    hitter_estimate(g->packets, ranked[i].key), hitter_estimate(g->bytes, ranked[i].key));
+        }
+    }
+    pthread_mutex_unlock(&hitterLock);
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_join
+ *
+ * @brief                     -"join": request/response join counters and latency percentiles
+ *
+ * @param[in]                 args   -none
+ * @param[in]                 out    Reply stream
+ *
+ * @return                    -none
+ * @note                      Percentiles are upper bounds of power-of-two microsecond buckets.
+ ********************************************************/
+static void stats_cmd_join(const char *args, FILE *out) {
+    unsigned long latency[JOIN_LATENCY_BUCKETS] = { 0 }, matched = 0, evicted[2] = { 0, 0 }, seen = 0;
+    const double quantiles[3] = { 0.5, 0.9, 0.99 };
+    int pending = 0, i, b, q = 0;
+
+    for (i = 0; i < JOIN_PARTITIONS; i++) {
+        JoinPartition *jp = &joinPartitions[i];
+        pthread_mutex_lock(&jp->lock);
+        matched += jp->matched;
+        evicted[0] += jp->evicted[0];
+        evicted[1] += jp->evicted[1];
+        pending += jp->pending;
+        for (b = 0; b < JOIN_LATENCY_BUCKETS; b++)
+            latency[b] += jp->latency[b];
+        pthread_mutex_unlock(&jp->lock);
+    }
+    fprintf(out, "join matched=%lu pending=%d expired_requests=%lu expired_responses=%lu\n",
+            matched, pending, evicted[0], evicted[1]);
+    fprintf(out, "latency_us");
+    for (b = 0; b < JOIN_LATENCY_BUCKETS && q < 3; b++) {
+        seen += latency[b];
+        while (q < 3 && matched > 0 && seen >= quantiles[q] * matched)
+            fprintf(out, " p%g<%lu", quantiles[q++] * 100, 1UL << b);
+    }
+    fprintf(out, "\n");
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_direct
+ *
+ * @brief                     -"direct": O_DIRECT shard writes, fallbacks, reader stall time and write latency
+ *
+ * @param[in]                 args   -none
+ * @param[in]                 out    Reply stream
+ *
+ * @return                    -none
+ * @note                      Latency runs from submission to completion; stall_ms is the time readers waited
+ *                            for the previous write of their shard before reusing its buffer.
+ ********************************************************/
+static void stats_cmd_direct(const char *args, FILE *out) {
+    const double quantiles[3] = { 0.5, 0.9, 0.99 };
+    unsigned long writes = 0, seen = 0, latency[DIRECT_LATENCY_BUCKETS];
+    int b, q = 0;
+
+    if (shardDir == NULL || !shardDirect) {
+        fprintf(out, "direct off\n");
+        return;
+    }
+    for (b = 0; b < DIRECT_LATENCY_BUCKETS; b++)
+        writes += latency[b] = __atomic_load_n(&directLatency[b], __ATOMIC_RELAXED);
+    fprintf(out, "direct writes=%lu fallbacks=%lu stall_ms=%llu pooled_buffers=%d\n", writes,
+            __atomic_load_n(&directFallbacks, __ATOMIC_RELAXED),
+            __atomic_load_n(&directStallNs, __ATOMIC_RELAXED) / 1000000, __atomic_load_n(&directPoolCount, __ATOMIC_RELAXED));
+    fprintf(out, "latency_us");
+    for (b = 0; b < DIRECT_LATENCY_BUCKETS && q < 3; b++) {
+        seen += latency[b];
+        while (q < 3 && writes > 0 && seen >= quantiles[q] * writes)
+            fprintf(out, " p%g<%lu", quantiles[q++] * 100, 1UL << b);
+    }
+    fprintf(out, "\n");
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_windows
+ *
+ * @brief                     -"windows": watermarks and event-time window results
+ *
+ * @param[in]                 args   -none
+ * @param[in]                 out    Reply stream
+ *
+ * @return                    -none
+ * @note                      Watermark lags are relative to now; an idle writer shows as idle.
+ ********************************************************/
+static void stats_cmd_windows(const char *args, FILE *out) {
+    EventTime *et = &eventTime;
+    unsigned long long now = now_ns(), low;
+    int i;
+
+    pthread_mutex_lock(&et->lock);
+    low = __atomic_load_n(&et->lowWatermark, __ATOMIC_ACQUIRE);
+    fprintf(out, "watermark lag_ms=%.1f open_from_ms=%llu accepting_late_from_ms=%llu\n",
+            low ? (now - low) / 1e6 : 0.0, et->closedUpTo * (EVENT_WINDOW_NS / 1000000ULL),
+            et->purgedUpTo * (EVENT_WINDOW_NS / 1000000ULL));
+    fprintf(out, "last window start_ms=%llu packets=%lu bytes=%lu late=%lu\n",
+            et->lastClosedWindow * (EVENT_WINDOW_NS / 1000000ULL), et->lastClosed.packets, et->lastClosed.bytes,
+            et->lastClosed.late);
+    pthread_mutex_unlock(&et->lock);
+    fprintf(out, "side_output late=%lu early=%lu\n", __atomic_load_n(&et->lateDropped, __ATOMIC_RELAXED),
+            __atomic_load_n(&et->earlyDropped, __ATOMIC_RELAXED));
+    fprintf(out, "writer_lag_ms");
+    for (i = 0; i < N; i++) {
+        unsigned long long wm = __atomic_load_n(&et->sourceWatermark[i], __ATOMIC_RELAXED);
+        if (wm == 0 || now - __atomic_load_n(&et->sourceAdvancedNs[i], __ATOMIC_RELAXED) >= EVENT_SOURCE_IDLE_NS)
+            fprintf(out, " idle");
+        else
+            fprintf(out, " %.1f", (now - wm) / 1e6);
+    }
+    fprintf(out, "\n");
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_checkpoint
+ *
+ * @brief                     -"checkpoint [now]": snapshot status, optionally starting one
+ *
+ * @param[in]                 args   "now" to start a snapshot unless one is running
+ * @param[in]                 out    Reply stream
+ *
+ * @return                    -none
+ * @note                      Runs under controlLock, which serializes it with the control thread's own polls.
+ ********************************************************/
+static void stats_cmd_checkpoint(const char *args, FILE *out) {
+    Checkpointer *cp = &checkpointer;
+
+    if (cp->path == NULL) {
+        fprintf(out, "checkpoints disabled (start with -s path)\n");
+        return;
+    }
+    if (strcmp(args, "now") == 0 && cp->child == 0)
+        checkpoint_poll(now_ns(), 1);
+    fprintf(out, "checkpoint generation=%llu taken=%lu failed=%lu running=%s last_ms=%.1f last_pause_us=%.0f\n",
+            cp->generation, cp->taken, cp->failed, cp->child > 0 ? "yes" : "no", cp->lastDurationNs / 1e6,
+            cp->lastPauseNs / 1e3);
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_pulse
+ *
+ * @brief                     -"pulse code [value]": post a pulse to the readers
+ *
+ * @param[in]                 args   Pulse code and optional value (default 0)
+ * @param[in]                 out    Reply stream
+ *
+ * @return                    -none
+ * @note                      Code 1 makes the reader that takes it flush its output; other codes are logged.
+ ********************************************************/
+static void stats_cmd_pulse(const char *args, FILE *out) {
+    unsigned int code, value = 0;
+
+    if (sscanf(args, "%u %u", &code, &value) < 1) {
+        fprintf(out, "usage: pulse code [value]\n");
+        return;
+    }
+    fprintf(out, "pulse %u %u %s\n", code, value, pulse_send(&pulseRing, code, value) ? "queued" :
+            code < PULSE_CODES ? "coalesced" : "dropped");
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_segments
+ *
+ * @brief                     -"segments [n offset [bytes]]": compaction totals, or log text of segment n
+ *
+ * @param[in]                 args   Empty, or a segment number, a raw offset and a byte count (default 4096)
+ * @param[in]                 out    Reply stream
+ *
+ * @return                    -none
+ * @note                      Reads through log_segment_read, so compressed segments are decoded by chunk.
+ ********************************************************/
+static void stats_cmd_segments(const char *args, FILE *out) {
+    unsigned int segment;
+    unsigned long long offset;
+    unsigned long bytes = 4096, raw, packed;
+    char path[PATH_MAX], *buf;
+    long got;
+
+    if (sscanf(args, "%u %llu %lu", &segment, &offset, &bytes) >= 2) {
+        if (bytes > (1 << 20))
+            bytes = 1 << 20;
+        buf = (char*) malloc(bytes);
+        snprintf(path, sizeof(path), "%s.%u.qz", LOG_FILE, segment);
+        if (access(path, R_OK) != 0)
+            snprintf(path, sizeof(path), "%s.%u", LOG_FILE, segment);
+        got = buf != NULL ? log_segment_read(path, offset, buf, bytes) : -1;
+        if (got < 0)
+            fprintf(out, "cannot read %s\n", path);
+        else
+            fwrite(buf, 1, got, out);
+        free(buf);
+        return;
+    }
+    raw = __atomic_load_n(&compactor.rawBytes, __ATOMIC_RELAXED);
+    packed = __atomic_load_n(&compactor.packedBytes, __ATOMIC_RELAXED);
+    fprintf(out, "segments next=%u compacted=%lu failures=%lu raw_bytes=%lu packed_bytes=%lu ratio=%.2f throttled_ms=%llu\n",
+            __atomic_load_n(&compactor.nextSegment, __ATOMIC_RELAXED), __atomic_load_n(&compactor.compacted, __ATOMIC_RELAXED),
+            __atomic_load_n(&compactor.failures, __ATOMIC_RELAXED), raw, packed, packed ? (double) raw / packed : 0.0,
+            __atomic_load_n(&compactor.throttledNs, __ATOMIC_RELAXED) / 1000000ULL);
+}
+
+/********************************************************
+ * @fn                        -stats_cmd_resize
+ *
+ * @brief                     -"resize n": change the capacity of the shared queue
+ *
+ * @param[in]                 args   New capacity
+ * @param[in]                 out    Reply stream
+ *
+ * @return                    -none
+ * @note                      Lasts until the next reload that sets queue_capacity.
+ ********************************************************/
+static void stats_cmd_resize(const char *args, FILE *out) {
+    int size;
+
+    if (sscanf(args, "%d", &size) != 1 || size < 1) {
+        fprintf(out, "usage: resize capacity\n");
+        return;
+    }
+    if (queue_resize(&dataQueue, size) != 0) {
+        fprintf(out, "resize failed, capacity=%d\n", __atomic_load_n(&dataQueue.capacity, __ATOMIC_RELAXED));
+        return;
+    }
+    pthread_mutex_lock(&dataQueue.lock);
+    fprintf(out, "capacity=%d count=%d debt=%d\n", dataQueue.capacity, dataQueue.count, dataQueue.debt);
+    pthread_mutex_unlock(&dataQueue.lock);
+}
+
+static void stats_cmd_reload(const char *args, FILE *out) {
+    config_reload();
+    fprintf(out, "reloaded\n");
+}
+
+StatsCommand statsCommands[] = {
+    { "help",   "list commands",                          stats_cmd_help },
+    { "stats",  "queue, reader and batch controller state", stats_cmd_stats },
+    { "reload", "re-read " CONFIG_FILE,                   stats_cmd_reload },
+    { "recent", "[corr=<id>] [last=<s>] [limit=<n>] recent packets", stats_cmd_recent },
+    { "top",    "[n] heaviest correlation ids by packets and bytes", stats_cmd_top },
+    { "join",   "request/response join counters and latency", stats_cmd_join },
+    { "direct", "O_DIRECT shard write latency and fallbacks", stats_cmd_direct },
+    { "windows", "event-time watermarks and window results", stats_cmd_windows },
+    { "checkpoint", "[now] state snapshot status", stats_cmd_checkpoint },
+    { "pulse",  "code [value] post a pulse to the readers", stats_cmd_pulse },
+    { "resize", "capacity change the shared queue's capacity", stats_cmd_resize },
+    { "segments", "[n offset [bytes]] log compaction, or text of segment n", stats_cmd_segments },
+};
+
+static void stats_cmd_help(const char *args, FILE *out) {
+    int i;
+    for (i = 0; i < (int)(sizeof(statsCommands) / sizeof(statsCommands[0])); i++)
+        fprintf(out, "%-8s %s\n", statsCommands[i].name, statsCommands[i].help);
+}
+
+/********************************************************
+ * @fn                        -stats_socket_open
+ *
+ * @brief                     -Create the listening stats socket
+ *
+ * @param[in]                 path  Filesystem path of the UNIX stream socket
+ *
+ * @return                    Listening file descriptor, or -1 on failure
+ * @note                      A stale socket file from a previous run is replaced.
+ ********************************************************/
+int stats_socket_open(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/********************************************************
+ * @fn                        -stats_handle_client
+ *
+ * @brief                     -Serve one stats socket connection
+ *
+ * @param[in]                 fd    Connected socket; closed by this function
+ *
+ * @return                    -none
+ * @note                      Reads one command per line until EOF and answers each. Handlers run under
+ *                            controlLock, so they see the control thread's state between its ticks, and write
+ *                            into a memory stream; the reply is sent after the lock is released. One second
+ *                            receive and send timeouts bound how long a silent or non-reading client can keep
+ *                            the stats thread busy; a reply that cannot be delivered drops the client.
+ ********************************************************/
+void stats_handle_client(int fd) {
+    struct timeval timeout = { 1, 0 };
+    FILE *in;
+    char line[256];
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    in = fdopen(fd, "r");
+    if (in == NULL) {
+        close(fd);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char *args = line + strcspn(line, " \t\r\n");
+        char *reply = NULL;
+        size_t replyLen = 0, sent = 0;
+        FILE *out;
+        int i, found = 0;
+
+        if (*args != '\0')
+            *args++ = '\0';
+        args[strcspn(args, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        out = open_memstream(&reply, &replyLen);
+        if (out == NULL)
+            break;
+        pthread_mutex_lock(&controlLock);
+        for (i = 0; i < (int)(sizeof(statsCommands) / sizeof(statsCommands[0])); i++) {
+            if (strcmp(line, statsCommands[i].name) == 0) {
+                statsCommands[i].handler(args, out);
+                found = 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&controlLock);
+        if (!found)
+            fprintf(out, "unknown command '%s', try 'help'\n", line);
+        fclose(out);
+        while (sent < replyLen) {
+            ssize_t n = send(fd, reply + sent, replyLen - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;                                                  // Send deadline passed or peer gone
+            sent += n;
+        }
+        free(reply);
+        if (sent < replyLen) {
+            log_message_level(LOG_LEVEL_ERROR, "Error: Stats client stopped reading, dropped it.");
+            break;
+        }
+    }
+    fclose(in);
+}
+
+/********************************************************
+ * @fn                        -stats_thread
+ *
+ * @brief                     -Accept and serve stats socket clients
+ *
+ * @param[in]                 arg       Listening socket, cast to a pointer
+ *
+ * @return                    -none
+ * @note                      Clients are served one at a time on this thread, never on the control thread, so a
+ *                            slow client cannot delay SIGHUP handling, join eviction, checkpoints or rotation.
+ ********************************************************/
+void *stats_thread(void *arg) {
+    int listenFd = (int) (long) arg;
+
     while (1) {
-         DataPacket packet = dequeue(&dataQueue);                       // Dequeue a data packet from the queue
-        if (packet.size > 0) {
-            process_data(packet.data, packet.size);                     // Process the data packet
-            free(packet.data);                                          // Free the data buffer after processing
+        int client = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (client >= 0) {
+            stats_handle_client(client);
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+            struct timespec backoff = { 0, CONTROL_TICK_MS * 1000000L };
+            log_message_level(LOG_LEVEL_ERROR, "Error: Stats socket accept failed.");
+            nanosleep(&backoff, NULL);                                  // Out of descriptors or similar: do not spin
+        }
+        log_flush();
+    }
+    return NULL;
+}
+
+/********************************************************
+ * @fn                        -control_thread
+ *
+ * @brief                     -Control thread serving SIGHUP, timers and checkpoints
+ *
+ * @param[in]                 arg       Pointer to optional thread argument (not used in this function)
+ *
+ * @return                    -none
+ * @note                      SIGHUP is blocked in every thread by main and received here through a signalfd,
+ *                            so reloading runs in normal thread context. Reloads from the signal and from the
+ *                            "reload" command are both serialized on this thread. A timerfd drives the expiry of
+ *                            unmatched join entries every JOIN_EVICT_PERIOD_NS. State snapshots are started and
+ *                            reaped from here as well, LOG_FILE is rotated and a shrunk ring file is moved to
+ *                            a smaller file. SIGUSR1 is the one signal with a real handler (it posts a pulse);
+ *                            it is unblocked on this thread only, so it never interrupts a reader's or writer's
+ *                            sem_wait. The stats socket is served by stats_thread; each tick's work holds
+ *                            controlLock so commands never interleave with it.
+ ********************************************************/
+void *control_thread(void *arg) {
+    struct itimerspec period = { { 0, JOIN_EVICT_PERIOD_NS }, { 0, JOIN_EVICT_PERIOD_NS } };
+    struct pollfd fds[2];
+    pthread_t stats;
+    sigset_t mask;
+    int statsFd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    fds[0].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    fds[0].events = POLLIN;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);                          // Its handler runs here, interrupting poll at worst
+    statsFd = stats_socket_open(STATS_SOCKET_PATH);
+    if (statsFd < 0 || pthread_create(&stats, NULL, stats_thread, (void*) (long) statsFd) != 0)
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot open stats socket " STATS_SOCKET_PATH ".");
+    fds[1].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    fds[1].events = POLLIN;
+    if (fds[1].fd < 0 || timerfd_settime(fds[1].fd, 0, &period, NULL) != 0)
+        log_message_level(LOG_LEVEL_ERROR, "Error: Cannot start the join eviction timer.");
+
+    while (1) {
+        int ready = poll(fds, 2, CONTROL_TICK_MS);
+
+        pthread_mutex_lock(&controlLock);
+        if (ready > 0) {
+            if (fds[0].revents & POLLIN) {
+                struct signalfd_siginfo info;
+                if (read(fds[0].fd, &info, sizeof(info)) == sizeof(info)) {
+                    log_message("Config: SIGHUP received.");
+                    config_reload();
+                }
+            }
+            if (fds[1].revents & POLLIN) {
+                unsigned long long expirations;
+                if (read(fds[1].fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    join_evict(now_ns());                               // Expire unmatched join entries
+            }
+        }
+        checkpoint_poll(now_ns(), 0);                                   // Periodic state snapshots
+        log_rotate_poll(now_ns());                                      // Seal LOG_FILE for the compactor
+        queue_ring_poll(&dataQueue, now_ns());                          // Finish a shrink of the ring file
+        pthread_mutex_unlock(&controlLock);
+        log_flush();
+    }
+    return NULL;
+}
+
+/********************************************************
+ * @fn                        -bench_wire_fuzz
+ *
+ * @brief                     -Round-trip random packets through the wire codec and feed wire_decode damaged frames
+ *
+ * @return                    Number of failures (0 when the codec behaves)
+ * @note                      Each frame is encoded from a random corpus slice and must decode to the same fields
+ *                            and bytes. Then one bit of its header or payload is flipped, which the checksum must
+ *                            reject, and the frame is decoded truncated and with random bytes written over it,
+ *                            each copied into an exactly sized heap buffer so an over-read lands past the end.
+ ********************************************************/
+static int bench_wire_fuzz(void) {
+    const int rounds = 20000;
+    size_t cap = WIRE_FRAME_SIZE(1024);
+    char *frame = (char*) aligned_alloc(WIRE_ALIGN, cap);
+    int failures = 0, rejected = 0, i;
+
+    if (frame == NULL || payloadCorpus.size == 0) {
+        free(frame);
+        return 0;
+    }
+    for (i = 0; i < rounds; i++) {
+        DataPacket packet = { 0 }, view;
+        int size = (int) (fast_rand() % (payloadCorpus.size < 1024 ? payloadCorpus.size + 1 : 1025));
+        long len, got;
+        size_t bit, cut;
+        char *copy;
+
+        packet.data = (char*) payloadCorpus.base + fast_rand() % (payloadCorpus.size - size + 1);
+        packet.size = size;
+        packet.eventId = ((unsigned long long) fast_rand() << 32) | fast_rand();
+        packet.eventCorrelationId = fast_rand();
+        packet.timestamp = now_ns();
+        packet.source = fast_rand() % N;
+        packet.flags = (fast_rand() & 1) ? PACKET_FLAG_REQUEST : 0;
+        len = (i & 1) ? wire_encode_packed(&packet, frame, cap) : wire_encode(&packet, frame, cap);
+        got = wire_decode(frame, (size_t) len, &view);
+        if (len <= 0 || got != len || view.eventId != packet.eventId || view.source != packet.source ||
+            view.eventCorrelationId != packet.eventCorrelationId || view.timestamp != packet.timestamp ||
+            ((view.flags & PACKET_FLAG_COMPRESSED) ? ((WireHeader*) frame)->rawLength != (unsigned int) size :
+             (view.size != size || memcmp(view.data, packet.data, size) != 0))) {
+            failures++;                                                 // Round trip lost something
+            continue;
+        }
+
+        bit = fast_rand() % ((sizeof(WireHeader) + view.size) * 8);     // Header or payload, not the padding
+        frame[bit / 8] ^= (char) (1 << (bit % 8));
+        if (wire_decode(frame, (size_t) len, &view) > 0)
+            failures++;                                                 // A single flipped bit went unnoticed
+        else
+            rejected++;
+
+        cut = fast_rand() % (size_t) len;                               // Truncated, then overwritten frames
+        copy = (char*) malloc(cut ? cut : 1);
+        if (copy != NULL) {
+            memcpy(copy, frame, cut);
+            if (wire_decode(copy, cut, &view) > 0)
+                failures++;
+            for (bit = 0; bit < 8; bit++)
+                if (cut > 0)
+                    copy[fast_rand() % cut] = (char) fast_rand();
+            got = wire_decode(copy, cut, &view);
+            if (got > (long) cut)
+                failures++;
+            free(copy);
+        }
+    }
+    fprintf(stderr, "bench: wire fuzz %d frames, %d bit flips rejected, %d failures\n", rounds, rejected, failures);
+    free(frame);
+    return failures;
+}
+
+/********************************************************
+ * @fn                        -bench_compression
+ *
+ * @brief                     -Report LZ ratio and speed on corpus slices, with and without the dictionary
+ *
+ * @return                    -none
+ * @note                      Uses the loaded dictionary (-z), or trains one for the bench. Timed on this thread's
+ *                            CPU clock; the same slices are compressed once and then decompressed repeatedly.
+ ********************************************************/
+static void bench_compression(void) {
+    static const int sizes[] = { 64, 256, 1024 };
+    static PayloadDictionary trained;
+    const PayloadDictionary *dicts[2] = { NULL, &payloadDict };
+    const int count = 2000, stride = 1024 + 1024 / 255 + 16;
+    struct timespec cpu0, cpu1;
+    unsigned char *packed = (unsigned char*) malloc((size_t) count * stride);
+    long *lens = (long*) malloc(count * sizeof(long));
+    char out[1024];
+    int s, d, k, r;
+
+    if (packed == NULL || lens == NULL || payloadCorpus.size < 1024) {
+        free(packed);
+        free(lens);
+        return;
+    }
+    if (payloadDict.size == 0) {
+        payload_dict_train(&trained, payloadCorpus.base, payloadCorpus.size);
+        dicts[1] = &trained;
+    }
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        for (d = 0; d < 2; d++) {
+            size_t span = payloadCorpus.size - sizes[s];
+            unsigned long long raw = 0, comp = 0;
+            double compressNs, decompressNs;
+
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+            for (k = 0; k < count; k++) {
+                lens[k] = lz_compress(dicts[d], payloadCorpus.base + (size_t) k * 7919 * sizes[s] % span, sizes[s],
+                                      packed + (size_t) k * stride, stride);
+                raw += sizes[s];
+                comp += lens[k];
+            }
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+            compressNs = (cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec);
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+            for (r = 0; r < 10; r++) {
+                for (k = 0; k < count; k++)
+                    lz_decompress(dicts[d], packed + (size_t) k * stride, (int) lens[k], out, sizes[s]);
+            }
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+            decompressNs = ((cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec)) / 10;
+            fprintf(stderr, "bench: lz %4d B %-13s ratio %.2f compress %.0f MB/s decompress %.0f MB/s\n",
+                    sizes[s], d ? "dictionary" : "no dictionary", (double) raw / comp, raw * 1e3 / compressNs,
+                    raw * 1e3 / decompressNs);
+        }
+    }
+    free(packed);
+    free(lens);
+}
+
+/********************************************************
+ * @fn                        -bench_forward_drain
+ *
+ * @brief                     -Consumer side of bench_forward: read pipe arg[0] until EOF, CPU ns to arg[1], bytes to arg[2]
+ ********************************************************/
+static void *bench_forward_drain(void *arg) {
+    int fd = (int) ((long long*) arg)[0];
+    char *buf = (char*) malloc(65536);
+    struct timespec cpu0, cpu1;
+    long long bytes = 0;
+    ssize_t n;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+    while (buf != NULL && (n = read(fd, buf, 65536)) > 0)
+        bytes += n;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+    free(buf);
+    ((long long*) arg)[1] = (cpu1.tv_sec - cpu0.tv_sec) * 1000000000LL + (cpu1.tv_nsec - cpu0.tv_nsec);
+    ((long long*) arg)[2] = bytes;
+    return NULL;
+}
+
+/********************************************************
+ * @fn                        -bench_forward
+ *
+ * @brief                     -Report CPU per forwarded GB of reader output into a pipe, with writev and with -F
+ *
+ * @return                    -none
+ * @note                      Chunked and borrowed packets go through output_add and output_flush exactly as a
+ *                            reader writes them, into a pipe read by another thread; with -F that is
+ *                            forward_write and the hold and reclaim of spliced chunks. The bench has its own
+ *                            sink and pipe, so the running pipeline's stdout is not touched. Producer CPU is
+ *                            net of building the packets (measured in a pass that only builds and frees
+ *                            them); the consumer's read copies in both cases.
+ ********************************************************/
+static void bench_forward(void) {
+    static const int sizes[] = { WRITER_MESSAGE_SIZE, 16384 };
+    const unsigned long long total = 256ULL << 20;
+    OutputVec *out = (OutputVec*) malloc(sizeof(OutputVec));
+    struct timespec cpu0, cpu1;
+    int s, chunked, mode;
+
+    if (out == NULL || payloadCorpus.size == 0) {
+        free(out);
+        return;
+    }
+    for (chunked = 0; chunked < 2; chunked++) {
+        for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+            double buildNs = 0;
+
+            for (mode = -1; mode < 2; mode++) {                         // -1: build and free the packets only
+                ForwardSink sink = { mode == 1 ? FORWARD_PIPE : FORWARD_OFF, 0, PTHREAD_MUTEX_INITIALIZER };
+                unsigned long long built = 0;
+                long long drain[3] = { 0, 0, 0 };
+                pthread_t consumer;
+                int fds[2];
+                double producerNs;
+
+                if (pipe2(fds, O_CLOEXEC) != 0)
+                    break;
+                fcntl(fds[1], F_SETPIPE_SZ, FORWARD_PIPE_SIZE);
+                drain[0] = fds[0];
+                pthread_create(&consumer, NULL, bench_forward_drain, drain);
+                output_init(out, &sink, fds[1]);
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+                while (built < total) {
+                    DataPacket packet;
+                    int size;
+
+                    memset(&packet, 0, sizeof(packet));
+                    size = chunked ? get_external_data_chain(&packet, sizes[s]) : get_external_data_ref(&packet, sizes[s]);
+                    if (size < 0)
+                        break;
+                    built += size;
+                    if (mode < 0)
+                        packet_free(&packet);
+                    else
+                        output_add(out, &packet);                       // Flushes itself whenever the list is full
+                }
+                output_close(out);
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+                close(fds[1]);
+                pthread_join(consumer, NULL);
+                close(fds[0]);
+                producerNs = (cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec);
+                if (mode < 0) {
+                    buildNs = producerNs;
+                    continue;
+                }
+                fprintf(stderr, "bench: forward %-8s <%5d B %-6s producer %.0f ms/GB consumer %.0f ms/GB%s\n",
+                        chunked ? "chunked" : "borrowed", sizes[s], mode ? "splice" : "writev",
+                        (producerNs - buildNs) / 1e6 * (1 << 30) / (double) (drain[2] ? drain[2] : 1),
+                        drain[1] / 1e6 * (1 << 30) / (double) (drain[2] ? drain[2] : 1), sink.failed ? " (failed)" : "");
+            }
+        }
+    }
+    free(out);
+}
+
+/********************************************************
+ * @fn                        -bench_channel_server
+ *
+ * @brief                     -Echo server of bench_channel: replies with the request until an empty one
+ ********************************************************/
+static long benchServerSwitches;                                        // Context switches of the last bench server
+
+static void *bench_channel_server(void *arg) {
+    struct rusage ru;
+    ChannelMsg *rcvid;
+    char buf[64];
+    int n;
+
+    do {
+        n = channel_receive((Channel*) arg, buf, sizeof(buf), &rcvid);
+        channel_reply(rcvid, n, buf, n);
+    } while (n > 0);
+    getrusage(RUSAGE_THREAD, &ru);
+    benchServerSwitches = ru.ru_nvcsw + ru.ru_nivcsw;
+    return NULL;
+}
+
+/********************************************************
+ * @fn                        -bench_queue_server
+ *
+ * @brief                     -Echo server of bench_channel over two Queues: requests in q[0], replies to q[1]
+ ********************************************************/
+static void *bench_queue_server(void *arg) {
+    Queue *q = (Queue*) arg;
+    struct rusage ru;
+    DataPacket packet;
+
+    do {
+        packet = dequeue(&q[0]);
+        enqueue(&q[1], packet);
+    } while (packet.size > 0);
+    getrusage(RUSAGE_THREAD, &ru);
+    benchServerSwitches = ru.ru_nvcsw + ru.ru_nivcsw;
+    return NULL;
+}
+
+/********************************************************
+ * @fn                        -bench_channel
+ *
+ * @brief                     -Report request/reply round-trip latency over a channel and over a pair of Queues
+ *
+ * @return                    -none
+ * @note                      8-byte requests echoed by a server thread, one at a time. Context switches are
+ *                            counted per thread (client plus server), so the running pipeline does not
+ *                            blur them; the latency does include competing with it for the CPU.
+ ********************************************************/
+static void bench_channel(void) {
+    static const char request[8] = "request";
+    const int rounds = 2000;
+    const char *savedQueueFile = queueFilePath;
+    Channel ch;
+    Queue q[2];
+    pthread_t server;
+    struct rusage ru0, ru1;
+    char reply[8];
+    int mode, i;
+
+    channel_init(&ch);
+    queueFilePath = NULL;                                               // Bench queues live in memory
+    initializeQueue(&q[0], 100);
+    initializeQueue(&q[1], 100);
+    queueFilePath = savedQueueFile;
+    for (mode = 0; mode < 2; mode++) {
+        unsigned long long startNs;
+        double elapsedNs;
+
+        pthread_create(&server, NULL, mode ? bench_queue_server : bench_channel_server, mode ? (void*) q : (void*) &ch);
+        getrusage(RUSAGE_THREAD, &ru0);
+        startNs = now_ns();
+        for (i = 0; i < rounds; i++) {
+            if (mode) {
+                DataPacket packet = { 0 };
+                packet.data = (char*) request;
+                packet.size = sizeof(request);
+                packet.flags = PACKET_FLAG_BORROWED;
+                enqueue(&q[0], packet);
+                packet = dequeue(&q[1]);
+            } else {
+                channel_send(&ch, request, sizeof(request), reply, sizeof(reply));
+            }
+        }
+        elapsedNs = (double) (now_ns() - startNs);
+        getrusage(RUSAGE_THREAD, &ru1);
+        if (mode) {
+            DataPacket stop = { 0 };
+            enqueue(&q[0], stop);
+            dequeue(&q[1]);
+        } else {
+            channel_send(&ch, NULL, 0, NULL, 0);
         }
+        pthread_join(server, NULL);
+        fprintf(stderr, "bench: round trip %-7s %.1f us, %.2f context switches\n", mode ? "queue" : "channel",
+                elapsedNs / rounds / 1e3,
+                ((ru1.ru_nvcsw + ru1.ru_nivcsw) - (ru0.ru_nvcsw + ru0.ru_nivcsw) + benchServerSwitches) / (double) rounds);
+    }
+}
+
+/********************************************************
+ * @fn                        -bench_waitset_producer
+ *
+ * @brief                     -Producer of bench_waitset: sparse timestamped packets into one queue, then an empty one
+ ********************************************************/
+static void *bench_waitset_producer(void *arg) {
+    static const char payload[8] = "payload";
+    Queue *q = (Queue*) arg;
+    struct timespec pause = { 0, 0 };
+    int i;
+
+    for (i = 0; i < 500; i++) {
+        DataPacket packet = { 0 };
+        pause.tv_nsec = 20000 + (long) (fast_rand() % 180000);          // 20-200 us apart
+        nanosleep(&pause, NULL);
+        packet.data = (char*) payload;
+        packet.size = sizeof(payload);
+        packet.flags = PACKET_FLAG_BORROWED;
+        packet.timestamp = now_ns();
+        enqueue(q, packet);
     }
+    enqueue(q, (DataPacket) { 0 });
     return NULL;
 }
 
+/********************************************************
+ * @fn                        -bench_waitset
+ *
+ * @brief                     -Report delivery latency of one consumer draining four queues, blocked in a wait set
+ *                            and, for comparison, polling them in turn with a 100 us nap
+ *
+ * @return                    -none
+ * @note                      One producer per queue sends 500 packets at random 20-200 us intervals.
+ ********************************************************/
+static void bench_waitset(void) {
+    const int queues = 4;
+    const char *savedQueueFile = queueFilePath;
+    const struct timespec nap = { 0, 100000 };
+    Queue q[4];
+    WaitSet ws;
+    pthread_t producers[4];
+    int mode, i;
+
+    for (mode = 0; mode < 2; mode++) {
+        unsigned long long latencyNs = 0, mask;
+        unsigned long packets = 0, sleeps = 0;
+        int open = queues;
+
+        waitset_init(&ws);
+        queueFilePath = NULL;                                           // Bench queues live in memory
+        for (i = 0; i < queues; i++) {
+            initializeQueue(&q[i], 100);
+            if (mode == 0)
+                waitset_add(&ws, &q[i]);
+        }
+        queueFilePath = savedQueueFile;
+        for (i = 0; i < queues; i++)
+            pthread_create(&producers[i], NULL, bench_waitset_producer, &q[i]);
+
+        while (open > 0) {
+            if (mode == 0) {
+                waitset_wait(&ws, &mask, 0);
+            } else {
+                mask = (1ULL << queues) - 1;                            // Try every queue
+            }
+            for (i = 0; i < queues; i++) {
+                DataPacket batch[16];
+                int n, k;
+
+                if (!(mask & (1ULL << i)))
+                    continue;
+                n = dequeue_ready(&q[i], batch, 16);
+                for (k = 0; k < n; k++) {
+                    if (batch[k].size == 0) {
+                        open--;
+                        continue;
+                    }
+                    latencyNs += now_ns() - batch[k].timestamp;
+                    packets++;
+                }
+                if (n == 0)
+                    mask &= ~(1ULL << i);
+            }
+            if (mode == 1 && mask == 0) {
+                nanosleep(&nap, NULL);
+                sleeps++;
+            }
+        }
+        for (i = 0; i < queues; i++)
+            pthread_join(producers[i], NULL);
+        if (mode == 0)
+            sleeps = ws.waits;
+        fprintf(stderr, "bench: %d queues %-8s %lu packets, %.1f us delivery latency, %lu sleeps\n", queues,
+                mode ? "polled" : "wait set", packets, packets ? latencyNs / 1e3 / packets : 0.0, sleeps);
+    }
+}
+
+/********************************************************
+ * @fn                        -run_bench
+ *
+ * @brief                     -Let the pipeline run for a fixed time and report throughput figures
+ *
+ * @param[in]                 seconds   Measurement duration
+ *
+ * @return                    -none (terminates the process, with status 1 if the wire codec fuzz failed)
+ * @note                      Reports packets per second, context switches per packet (from getrusage) and
+ *                            reader wake-ups per packet on stderr, so stdout can be sent to /dev/null.
+ ********************************************************/
+void run_bench(int seconds) {
+    struct rusage before, after;
+    unsigned long startPackets, startWakeups, packets, wakeups;
+    unsigned long long startNs, elapsedNs;
+    volatile unsigned long long sink = 0;
+    struct timespec cpu0, cpu1;
+    void *wireBuf = aligned_alloc(WIRE_ALIGN, WIRE_FRAME_SIZE(1024));
+    long switches;
+    int fuzzFailures, i;
+
+    getrusage(RUSAGE_SELF, &before);
+    startPackets = __atomic_load_n(&packetsProcessed, __ATOMIC_RELAXED);
+    startWakeups = __atomic_load_n(&dataQueue.wakeups, __ATOMIC_RELAXED);
+    startNs = now_ns();
+
+    sleep(seconds);
+
+    getrusage(RUSAGE_SELF, &after);
+    elapsedNs = now_ns() - startNs;
+    packets = __atomic_load_n(&packetsProcessed, __ATOMIC_RELAXED) - startPackets;
+    wakeups = __atomic_load_n(&dataQueue.wakeups, __ATOMIC_RELAXED) - startWakeups;
+    switches = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+
+    fprintf(stderr, "bench: %lu packets in %.2f s (%.0f packets/s)\n", packets, elapsedNs / 1e9,
+            packets * 1e9 / (double)elapsedNs);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);                      // CPU time, so other threads do not count
+    for (i = 0; i < 1000000; i++)
+        sink += now_ns();                                               // Cost of one timestamp
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+    fprintf(stderr, "bench: now_ns %.1f ns/call (%s)\n",
+            ((cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec)) / 1e6,
+            clockSource.useTsc ? "tsc" : "clock_gettime");
+    if (wireBuf != NULL) {                                              // Wire format round trip on a 1 KiB payload
+        int size = payloadCorpus.size < 1024 ? (int) payloadCorpus.size : 1024;
+        DataPacket sample = { (char*) payloadCorpus.base, size, 1, 2, 3, NULL, 0 }, view;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+        for (i = 0; i < 200000; i++) {
+            wire_encode(&sample, wireBuf, WIRE_FRAME_SIZE(1024));
+            sink += wire_decode(wireBuf, WIRE_FRAME_SIZE(1024), &view);
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+        fprintf(stderr, "bench: wire encode+decode %.2f GB/s\n",
+                200000.0 * size / ((cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec)));
+        free(wireBuf);
+    }
+    fuzzFailures = bench_wire_fuzz();
+    bench_compression();
+    bench_forward();
+    bench_channel();
+    bench_waitset();
+    fprintf(stderr, "bench: %ld context switches (%.3f per packet), %lu reader wake-ups (%.3f per packet)\n",
+            switches, packets ? (double)switches / packets : 0.0, wakeups, packets ? (double)wakeups / packets : 0.0);
+    log_flush();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(fuzzFailures ? 1 : 0);                                        // Other threads are still running
+}
+
 /*****************/
 
 int main(int argc, char **argv) {
-    pthread_t writers[N], readers[M];
+    pthread_t writers[N], watchdog, control, compaction;
+    struct sigaction usr1;
+    sigset_t mask;
+    const char *checkpointPath = NULL, *dictPath = NULL, *mergeDir = NULL;
+    int opt, benchSeconds = 0, mergeByTimestamp = 0, mergeFollow = 0, forwardOutput = 0;
+
+    while ((opt = getopt(argc, argv, "f:b:c:a:s:z:o:Dm:TlF")) != -1) {
+        switch (opt) {
+        case 'f':
+            queueFilePath = optarg;                                     // Keep dataQueue in a persistent ring file
+            break;
+        case 'b':
+            benchSeconds = atoi(optarg);                                // Run the bench for this many seconds, then exit
+            break;
+        case 'c':
+            corpusFilePath = optarg;                                    // Slice payloads from this file instead
+            break;
+        case 'o':
+            if (shard_sink_open(optarg) != 0) {                         // One output shard per reader instead of stdout
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'F':
+            forwardOutput = 1;                                          // Splice gathered output to stdout instead of copying
+            break;
+        case 'D':
+            shardDirect = 1;                                            // Write shards with O_DIRECT and async submission
+            break;
+        case 'm':
+            mergeDir = optarg;                                          // Merge the shards of a directory to stdout and exit
+            break;
+        case 'T':
+            mergeByTimestamp = 1;
+            break;
+        case 'l':
+            mergeFollow = 1;
+            break;
+        case 'z':
+            dictPath = optarg;                                          // Compress stored payloads with this dictionary
+            break;
+        case 's':
+            checkpointPath = optarg;                                    // Snapshot stage state to <path>.0/.1 and restore it
+            break;
+        case 'a':
+            if (column_sink_open(optarg) != 0) {                        // Write packets to a columnar file instead of stdout
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f queue_file] [-b bench_seconds] [-c corpus_file] [-a columnar_file] [-s checkpoint_path] [-z dictionary_file] [-o shard_dir [-D]] [-F]\n"
+                    "       %s -m shard_dir [-T] [-l] [-z dictionary_file]\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);                            // SIGHUP and SIGUSR1 are only received by the control thread
+    clock_init();                                                       // Timestamps are taken from here on
+    signal(SIGPIPE, SIG_IGN);                                           // Stats clients may disconnect mid-reply
+    if (mergeDir != NULL) {
+        if (dictPath != NULL && payload_dict_open(dictPath) != 0)       // Compressed frames only verify with it
+            return 1;
+        return shard_merge(mergeDir, mergeByTimestamp, mergeFollow);    // Merge tool: no pipeline
+    }
 
     initializeQueue(&dataQueue, 100);                                   // Initialize the shared queue with a size limit
+    pulse_ring_init(&pulseRing, &dataQueue);
+    memset(&usr1, 0, sizeof(usr1));
+    usr1.sa_handler = pulse_signal_handler;
+    usr1.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &usr1, NULL);                                    // SIGUSR1 posts a pulse from the handler itself
+    join_init();
+    event_time_init(now_ns());
+    log_segments_init();
+    if (checkpointPath != NULL)
+        checkpoint_restore(checkpointPath);                             // Resume stage state from the last snapshot
+    if (corpus_init(corpusFilePath) != 0 && (corpusFilePath == NULL || corpus_init(NULL) != 0))
+        return 1;                                                       // Writers need a payload corpus
+    if (dictPath != NULL)
+        payload_dict_open(dictPath);                                    // Trained on the corpus unless the file exists
+    if (forwardOutput && forward_sink_open() != 0)
+        log_message_level(LOG_LEVEL_ERROR, "Error: stdout cannot be spliced to, -F ignored.");
+    if (access(CONFIG_FILE, R_OK) == 0)
+        config_reload();                                                // Start from CONFIG_FILE if there is one
 
     // Create writer threads
     for (int i = 0; i < N; i++) {
-        pthread_create(&writers[i], NULL, writer_thread, NULL);
+        pthread_create(&writers[i], NULL, writer_thread, (void*)(unsigned long) i);
     }
 
     // Create reader threads
-    for (int i = 0; i < M; i++) {
-        pthread_create(&readers[i], NULL, reader_thread, NULL);
-    }
+    apply_reader_count(activeConfig->readers);
+
+    // Create the watchdog supervising the readers
+    pthread_create(&watchdog, NULL, watchdog_thread, NULL);
+
+    // Create the control thread serving SIGHUP and timers; it starts the stats thread
+    pthread_create(&control, NULL, control_thread, NULL);
+
+    // Create the low-priority compactor of rotated log segments
+    pthread_create(&compaction, NULL, compactor_thread, NULL);
+
+    log_flush();                                                        // The main thread only waits from here on
+    if (benchSeconds > 0)
+        run_bench(benchSeconds);
 
     // Wait for all writer threads to complete
     for (int i = 0; i < N; i++) {
@@ -314,8 +8182,8 @@ int main(int argc, char **argv) {
     }
 
     // Wait for all reader threads to complete
-    for (int i = 0; i < M; i++) {
-        pthread_join(readers[i], NULL);
+    for (int i = 0; i < readerCount && i < MAX_READERS; i++) {
+        pthread_join(readerStates[i].thread, NULL);
     }
 
     return 0;